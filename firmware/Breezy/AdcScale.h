@@ -0,0 +1,142 @@
+#ifndef ADC_SCALE_H
+#define ADC_SCALE_H
+
+#include <inttypes.h>
+#include <math.h>
+#include "Configuration.h"
+
+/*
+Sampler readings -> output unit as gain * adc + offset. Both are folded at
+compile time from the <name>_MINVOLT .. <name>_MAXOUTP settings and the
+oversampling bits, so a conversion is one multiply and one add, no division.
+The pressure sensors use the lines of their calibration table instead, see
+Sensors.cpp. A header of its own, so the host tests (tools/breezy_decode)
+check the conversion that is compiled here.
+
+With SENSORS_FIXED_POINT gain and offset are integers, each with the most
+fractional bits that keep it in 30 bits: gain * reading over the whole range,
+and the offset with the result. The product is rounded to the bits of the
+offset before it is added, so a large offset does not cost the gain its
+precision. Every channel is within a hundredth of a reading of the exact
+line, any calibration line within a fiftieth (firmware_test adc).
+Only the result is turned into a float.
+*/
+#define ADC_FULL(name) ((double)ADC_MAXVAL * (1 << name##_BITS))
+#define ADC_GAIN(name) ((double)ADC_REF_VOLT / ADC_FULL(name) * (name##_MAXOUTP - name##_MINOUTP) / (name##_MAXVOLT - name##_MINVOLT))
+#define ADC_OFFSET(name) ((double)name##_MINOUTP - (double)name##_MINVOLT * (name##_MAXOUTP - name##_MINOUTP) / (name##_MAXVOLT - name##_MINVOLT))
+
+#if SENSORS_FIXED_POINT
+struct AdcScale{
+  int32_t gain; // per count, gain bits = offset bits + shift
+  int32_t offset;
+  uint8_t shift; // product -> offset bits
+  float unit; // 2^-offset bits
+};
+
+static constexpr double adc_pow2(uint8_t s) { return s ? 2 * adc_pow2(s - 1) : 1; }
+static constexpr double adc_abs(double x) { return x < 0 ? -x : x; }
+
+// fractional bits for |x| up to span, below 2^30, at compile time
+static constexpr uint8_t adc_bits(double span, uint8_t s = 60)
+{
+  return s && span * adc_pow2(s) >= 1073741824.0 ? adc_bits(span, s - 1) : s;
+}
+
+static constexpr int32_t adc_fixed(double x, uint8_t bits)
+{
+  return (int32_t)(x < 0 ? x * adc_pow2(bits) - 0.5 : x * adc_pow2(bits) + 0.5);
+}
+
+// the result is at most |gain| * full + |offset|
+static constexpr uint8_t adc_gain_bits(double gain, double full) { return adc_bits(adc_abs(gain) * full); }
+static constexpr uint8_t adc_offset_bits(double gain, double offset, double full)
+{
+  return adc_bits(adc_abs(gain) * full + adc_abs(offset));
+}
+
+static constexpr AdcScale adc_scale(double gain, double offset, double full)
+{
+  return AdcScale{ adc_fixed(gain, adc_gain_bits(gain, full)), adc_fixed(offset, adc_offset_bits(gain, offset, full)),
+                   (uint8_t)(adc_gain_bits(gain, full) - adc_offset_bits(gain, offset, full)),
+                   (float)(1.0 / adc_pow2(adc_offset_bits(gain, offset, full))) };
+}
+
+#define ADC_SCALE(name) adc_scale(ADC_GAIN(name), ADC_OFFSET(name), ADC_FULL(name))
+
+// fractional bits and 2^bits for |x| up to span, below 2^30; a loop, no recursion on the task stack
+static inline uint8_t adc_line_bits(float span, float *pow2)
+{
+  uint8_t s = 60;
+  float p = 1152921504606846976.0; // 2^60
+  while(s && span * p >= 1073741824.0){
+    s--;
+    p *= 0.5;
+  }
+  *pow2 = p;
+  return s;
+}
+
+// a line at run time (calibration), full: the largest reading the line is used for
+static inline AdcScale adc_line(float gain, float offset, uint16_t full)
+{
+  float gain_pow2, offset_pow2;
+  uint8_t gain_bits = adc_line_bits(fabs(gain) * full, &gain_pow2);
+  uint8_t offset_bits = adc_line_bits(fabs(gain) * full + fabs(offset), &offset_pow2);
+  float g = gain * gain_pow2, o = offset * offset_pow2;
+  AdcScale s = { (int32_t)(g < 0 ? g - 0.5f : g + 0.5f), (int32_t)(o < 0 ? o - 0.5f : o + 0.5f),
+                 (uint8_t)(gain_bits - offset_bits), 1 / offset_pow2 };
+  return s;
+}
+
+// gain * reading, rounded to the bits of the offset
+static inline int32_t adc_product(const AdcScale &s, int32_t p)
+{
+  return s.shift ? (p + ((int32_t)1 << (s.shift - 1))) >> s.shift : p;
+}
+
+static inline float adc_convert(const AdcScale &s, uint16_t adc)
+{
+  return (float)(adc_product(s, s.gain * (int32_t)adc) + s.offset) * s.unit;
+}
+
+// mean of n readings, from their sum
+static inline float adc_convert_mean(const AdcScale &s, uint32_t sum, uint16_t n)
+{
+  return (float)(adc_product(s, (int32_t)((int64_t)s.gain * sum / n)) + s.offset) * s.unit;
+}
+#else
+struct AdcScale{
+  float gain; // per count
+  float offset;
+};
+#define ADC_SCALE(name) { (float)ADC_GAIN(name), (float)ADC_OFFSET(name) }
+
+static inline AdcScale adc_line(float gain, float offset, uint16_t full)
+{
+  (void)full;
+  AdcScale s = { gain, offset };
+  return s;
+}
+
+static inline float adc_convert(const AdcScale &s, uint16_t adc)
+{
+  return (float)adc * s.gain + s.offset;
+}
+
+static inline float adc_convert_mean(const AdcScale &s, uint32_t sum, uint16_t n)
+{
+  return (float)sum / n * s.gain + s.offset;
+}
+#endif
+
+// oversampling of each reading, see Sampler.h
+#define P_ACT_BITS SAMPLER_P_ACT_BITS
+#define P_O2_BITS SAMPLER_SLOW_BITS
+#define SET_O2_BITS SAMPLER_SLOW_BITS
+#define SET_MAX_P_BITS SAMPLER_SLOW_BITS
+#define SET_PEEP_BITS SAMPLER_SLOW_BITS
+#define SET_RR_BITS SAMPLER_SLOW_BITS
+#define SET_TV_BITS SAMPLER_SLOW_BITS
+#define SET_IE_BITS SAMPLER_SLOW_BITS
+
+#endif // #ifndef ADC_SCALE_H
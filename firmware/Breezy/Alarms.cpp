@@ -0,0 +1,99 @@
+#include <Arduino.h>
+#include <util/atomic.h>
+#include "Configuration.h"
+#include "Alarms.h"
+
+Alarms alarms;
+
+void Alarms::init(void)
+{
+  active = 0;
+  latched = 0;
+  memset(count, 0, sizeof(count));
+  last_breath_ms = millis();
+}
+
+// over: the limit is exceeded, back: the value is back within the limit minus the hysteresis.
+// Between the two the alarm keeps its state.
+void Alarms::check(uint8_t alarm, uint8_t over, uint8_t back, uint8_t delay)
+{
+  uint16_t bit = _BV(alarm);
+
+  if(over){
+    if(count[alarm] < delay){
+      count[alarm]++;
+      return;
+    }
+    if(!(active & bit)){
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+        active |= bit;
+        latched |= bit;
+      }
+    }
+    return;
+  }
+
+  count[alarm] = 0;
+  if(back && (active & bit)){
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+      active &= ~bit;
+    }
+  }
+}
+
+void Alarms::sample(float p_max, float slm, float p_o2, float set_max_p, uint32_t mil)
+{
+  check(ALARM_HIGH_PRESSURE, p_max > set_max_p + ALARM_HIGH_P_MARGIN,
+        p_max < set_max_p + ALARM_HIGH_P_MARGIN - ALARM_P_HYSTERESIS, ALARM_HIGH_P_DELAY);
+  check(ALARM_FLOW_SENSOR, isnan(slm), !isnan(slm), ALARM_FLOW_SENSOR_DELAY);
+  check(ALARM_LOW_O2_SUPPLY, p_o2 < ALARM_MIN_P_O2,
+        p_o2 > ALARM_MIN_P_O2 + ALARM_P_O2_HYSTERESIS, ALARM_P_O2_DELAY);
+
+  uint8_t apnea = mil - last_breath_ms > ALARM_APNEA_MS;
+  check(ALARM_APNEA, apnea, !apnea, 0);
+}
+
+void Alarms::breath(float peep, float set_peep, float mve, uint32_t mil)
+{
+  last_breath_ms = mil;
+
+  // NAN compares false both ways, an unmeasured value keeps the state
+  check(ALARM_LOW_PEEP, peep < set_peep - ALARM_PEEP_MARGIN,
+        peep > set_peep - ALARM_PEEP_MARGIN + ALARM_P_HYSTERESIS, ALARM_BREATHS_DELAY);
+  check(ALARM_LOW_MVE, mve < ALARM_MIN_MVE, mve > ALARM_MIN_MVE + ALARM_MVE_HYSTERESIS, ALARM_BREATHS_DELAY);
+  check(ALARM_HIGH_MVE, mve > ALARM_MAX_MVE, mve < ALARM_MAX_MVE - ALARM_MVE_HYSTERESIS, ALARM_BREATHS_DELAY);
+}
+
+void Alarms::ack(void)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+    latched = active;
+  }
+}
+
+void Alarms::get(uint16_t *a, uint16_t *l)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+    *a = active;
+    *l = latched;
+  }
+}
+
+uint8_t Alarms::top(uint16_t mask)
+{
+  return mask ? __builtin_ctz(mask) : ALARMS;
+}
+
+const char *Alarms::name(uint8_t alarm)
+{
+  switch(alarm){
+    case ALARM_HIGH_PRESSURE: return "HIGH PRESSURE";
+    case ALARM_APNEA: return "APNEA";
+    case ALARM_FLOW_SENSOR: return "FLOW SENSOR";
+    case ALARM_LOW_O2_SUPPLY: return "LOW O2 SUPPLY";
+    case ALARM_LOW_PEEP: return "LOW PEEP";
+    case ALARM_LOW_MVE: return "LOW MVe";
+    case ALARM_HIGH_MVE: return "HIGH MVe";
+    default: return "";
+  }
+}
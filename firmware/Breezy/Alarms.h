@@ -0,0 +1,51 @@
+#ifndef ALARMS_H
+#define ALARMS_H
+
+#include <inttypes.h>
+#include "Configuration.h"
+
+/*
+Alarm rules, evaluated by Statistics: sample() once per batch of samples,
+breath() once per breath (next inspiration starts). Each call checks every
+rule once with a few compares, there is no history to scan.
+
+A rule raises its alarm when its limit is exceeded for a number of calls
+in a row, and clears it only when the value is back by the hysteresis.
+Raised alarms are latched until acknowledged (ack command), so a short
+alarm is not missed. The alarms are bits of a mask, the bit number is the
+priority (0 = highest): the alarm to show first is the lowest set bit.
+*/
+
+// bit numbers, highest priority first
+#define ALARM_HIGH_PRESSURE 0
+#define ALARM_APNEA 1
+#define ALARM_FLOW_SENSOR 2
+#define ALARM_LOW_O2_SUPPLY 3
+#define ALARM_LOW_PEEP 4
+#define ALARM_LOW_MVE 5
+#define ALARM_HIGH_MVE 6
+#define ALARMS 7
+
+class Alarms{
+  public:
+  void init(void);
+  void sample(float p_max, float slm, float p_o2, float set_max_p, uint32_t mil); // per batch, p_max of the batch
+  void breath(float peep, float set_peep, float mve, uint32_t mil); // per breath
+  void ack(void); // clears the latched alarms that are no longer active
+  void get(uint16_t *active, uint16_t *latched); // consistent copy for the other tasks
+
+  static uint8_t top(uint16_t mask); // highest priority alarm in mask, ALARMS if none
+  static const char *name(uint8_t alarm);
+
+  private:
+  uint16_t active; // limit exceeded now
+  uint16_t latched; // raised since the last ack, includes active
+  uint8_t count[ALARMS]; // calls in a row over the limit
+  uint32_t last_breath_ms;
+
+  void check(uint8_t alarm, uint8_t over, uint8_t back, uint8_t delay);
+};
+
+extern Alarms alarms;
+
+#endif // #ifndef ALARMS_H
@@ -0,0 +1,55 @@
+#include <Arduino.h>
+#include "BinaryProtocol.h"
+
+int16_t bin_s16(float v, float scale)
+{
+  if(isnan(v)) return BIN_NAN_S16;
+  v = v * scale;
+  if(v > 32767) return 32767;
+  if(v < -32767) return -32767; // -32768 is reserved for NAN
+  return (int16_t)lround(v);
+}
+
+uint16_t bin_u16(float v, float scale)
+{
+  if(isnan(v)) return BIN_NAN_U16;
+  v = v * scale;
+  if(v > 65534) return 65534; // 65535 is reserved for NAN
+  if(v < 0) return 0;
+  return (uint16_t)lround(v);
+}
+
+uint8_t bin_u8(float v, float scale)
+{
+  if(isnan(v)) return BIN_NAN_U8;
+  v = v * scale;
+  if(v > 254) return 254; // 255 is reserved for NAN
+  if(v < 0) return 0;
+  return (uint8_t)lround(v);
+}
+
+/*
+Consistent Overhead Byte Stuffing - removes all 0x00 bytes from the frame,
+so 0x00 can be used as the frame delimiter. Frames are shorter than 254 bytes,
+so there is always a single block and the overhead is exactly one byte.
+*/
+uint8_t cobs_encode(const uint8_t *src, uint8_t len, uint8_t *dst)
+{
+  uint8_t code_idx = 0; // where the length code of the current run goes
+  uint8_t code = 1;
+  uint8_t out = 1;
+
+  for(uint8_t i = 0; i < len; i++){
+    if(src[i] == 0){
+      dst[code_idx] = code;
+      code_idx = out++;
+      code = 1;
+    }else{
+      dst[out++] = src[i];
+      code++;
+    }
+  }
+  dst[code_idx] = code;
+
+  return out;
+}
@@ -0,0 +1,110 @@
+#ifndef BINARY_PROTOCOL_H
+#define BINARY_PROTOCOL_H
+
+#include <inttypes.h>
+#include "BreathLog.h"
+
+/*
+Breezy serial protocol version 2 (binary), see docs/serial_protocol.md
+
+frame on the wire: COBS(payload + crc16) 0x00
+payload: BinHeader followed by the fields of the frame type, little endian
+crc16: CRC16-CCITT of the payload (same algorithm as the text protocol), low byte first
+
+Fields are fixed point integers. A value that cannot be measured (NAN)
+is sent as BIN_NAN_S16 / BIN_NAN_U16 / BIN_NAN_U8.
+*/
+
+#define BIN_PROTOCOL_VERSION 2
+
+// frame type = version in the high nibble, kind in the low nibble
+#define BIN_TYPE_SAMPLE  ((BIN_PROTOCOL_VERSION << 4) | 1) // waveform sample
+#define BIN_TYPE_BREATH  ((BIN_PROTOCOL_VERSION << 4) | 2) // per-breath values
+#define BIN_TYPE_SERVICE ((BIN_PROTOCOL_VERSION << 4) | 3) // service values
+#define BIN_TYPE_TEXT    ((BIN_PROTOCOL_VERSION << 4) | 4) // a text line, e.g. a command response
+#define BIN_TYPE_PROFILE ((BIN_PROTOCOL_VERSION << 4) | 5) // run time counters, see Profiler.h
+#define BIN_TYPE_BREATH_LOG ((BIN_PROTOCOL_VERSION << 4) | 6) // breath history, answers the breaths command
+#define BIN_TYPE_ALARM   ((BIN_PROTOCOL_VERSION << 4) | 7) // alarm masks, see Alarms.h
+
+#define BIN_NAN_S16 ((int16_t)0x8000)
+#define BIN_NAN_U16 ((uint16_t)0xFFFF)
+#define BIN_NAN_U8  ((uint8_t)0xFF)
+
+#define BIN_MAX_PAYLOAD 100
+// COBS adds one byte per started 254 bytes, plus crc and the 0x00 delimiter
+#define BIN_MAX_FRAME (BIN_MAX_PAYLOAD + 2 + 1 + 1)
+
+struct BinHeader{
+  uint8_t type; // BIN_TYPE_*
+  uint8_t seq; // incremented for each frame sent, detects lost frames
+  uint16_t time; // ms, wraps like the text protocol time
+} __attribute__((packed));
+
+#define BIN_MAX_TEXT (BIN_MAX_PAYLOAD - sizeof(BinHeader)) // longest line in a text frame
+
+struct BinSample{
+  BinHeader h;
+  int16_t p_act; // 0.01 cmH2O
+  int16_t slm; // 0.01 l/min
+  int16_t slm_sum; // 0.1 ml
+} __attribute__((packed));
+
+struct BinBreath{
+  BinHeader h;
+  uint16_t p_peak; // 0.1 cmH2O
+  uint8_t p_mean; // cmH2O
+  uint8_t peep; // cmH2O
+  uint8_t rr; // b/min
+  uint8_t o2_perc; // %
+  uint16_t ti; // 0.01 s
+  uint16_t i_e; // 0.01 (ti/te)
+  uint16_t mvi; // 0.1 l/min
+  uint16_t mve; // 0.1 l/min
+  uint16_t vti; // ml
+  uint16_t vte; // ml
+  uint16_t compliance; // 0.1 ml/cmH2O
+  uint16_t resistance; // 0.1 cmH2O/l/s
+  int16_t p_plat; // 0.1 cmH2O
+  int16_t peep_tot; // 0.1 cmH2O
+} __attribute__((packed));
+
+struct BinService{
+  BinHeader h;
+  int16_t p_o2; // 0.1 kPa
+  uint8_t is_i; // 1 = inspiration
+  uint16_t tx_dropped; // messages dropped by the serial TX queue
+  uint16_t tx_high_watermark; // max bytes waiting in the serial TX queue
+  uint16_t telemetry_dropped; // samples dropped because the telemetry task fell behind
+} __attribute__((packed));
+
+struct BinProfile{
+  BinHeader h;
+  uint16_t section[6][3]; // min, avg, max in 10 us, PROFILE_STATISTICS .. PROFILE_ALARMS
+  uint16_t jitter[2][8]; // period lateness histograms, statistics and message period
+  uint16_t stack_free[5]; // bytes, tasks LCD, Ventilator, Valve, Telemetry, Command
+} __attribute__((packed));
+
+struct BinAlarm{
+  BinHeader h;
+  uint16_t active; // bit ALARM_* set while the limit is exceeded
+  uint16_t latched; // raised since the last ack
+} __attribute__((packed));
+
+#define BIN_BREATH_LOG_RECORDS 5 // per frame, fits BIN_MAX_PAYLOAD
+
+struct BinBreathLog{
+  BinHeader h;
+  uint16_t number; // breath number of r[0], the following records are consecutive
+  uint8_t count; // records in this frame, the frame is cut after r[count - 1]
+  BreathRecord r[BIN_BREATH_LOG_RECORDS];
+} __attribute__((packed));
+
+// float -> fixed point with rounding, clamping and NAN mapping
+int16_t bin_s16(float v, float scale);
+uint16_t bin_u16(float v, float scale);
+uint8_t bin_u8(float v, float scale);
+
+// COBS encoder, returns encoded length (len + 1 for len < 254). dst must not overlap src.
+uint8_t cobs_encode(const uint8_t *src, uint8_t len, uint8_t *dst);
+
+#endif // #ifndef BINARY_PROTOCOL_H
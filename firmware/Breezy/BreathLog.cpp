@@ -0,0 +1,112 @@
+#include <Arduino.h>
+#include <util/atomic.h>
+#include "Configuration.h"
+#include "BreathLog.h"
+#include "BinaryProtocol.h"
+
+BreathLog breath_log;
+
+void BreathLog::init(void)
+{
+  count = 0;
+  memset(buckets, 0, sizeof(buckets));
+  for(uint8_t i = 0; i < BREATH_TREND_BUCKETS; i++){
+    buckets[i].minute = 0xFFFF; // matches no minute until used
+  }
+}
+
+void BreathLog::add(float p_peak, float p_mean, float peep, float ti, float te, float vti, float vte)
+{
+  uint32_t mil = millis();
+  uint16_t minute = mil / 60000;
+  BreathRecord r;
+
+  r.end_s = mil / 1000;
+  r.p_peak = bin_s16(p_peak, 10);
+  r.p_mean = bin_s16(p_mean, 10);
+  r.peep = bin_s16(peep, 10);
+  r.vti = bin_u16(vti, 1);
+  r.vte = bin_u16(vte, 1);
+  r.ti = bin_u16(ti, 100);
+  r.te = bin_u16(te, 100);
+
+  BreathBucket *b = &buckets[minute % BREATH_TREND_BUCKETS];
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+    ring[count % BREATH_LOG_SIZE] = r;
+    count++;
+
+    if(b->minute != minute){ // first breath of this minute, the bucket is 16 minutes old
+      memset(b, 0, sizeof(*b));
+      b->minute = minute;
+    }
+    if(b->count < 0xFF && r.vti != BIN_NAN_U16 && r.vte != BIN_NAN_U16 &&
+       r.p_peak != BIN_NAN_S16 && r.peep != BIN_NAN_S16){
+      b->count++;
+      b->vti += r.vti;
+      b->vte += r.vte;
+      b->p_peak += r.p_peak;
+      b->peep += r.peep;
+    }
+  }
+}
+
+uint16_t BreathLog::first(void)
+{
+  uint16_t n;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+    n = count;
+  }
+  return n > BREATH_LOG_SIZE ? n - BREATH_LOG_SIZE : 0;
+}
+
+uint8_t BreathLog::get(uint16_t number, BreathRecord *r)
+{
+  uint8_t ret = 1;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+    if((uint16_t)(count - number - 1) < BREATH_LOG_SIZE){ // number < count and within the last BREATH_LOG_SIZE
+      *r = ring[number % BREATH_LOG_SIZE];
+      ret = 0;
+    }
+  }
+  return ret;
+}
+
+// Sums at most BREATH_TREND_MINUTES buckets, independent of the number of breaths
+void BreathLog::trend(uint8_t minutes, BreathTrend *t)
+{
+  uint16_t now = millis() / 60000;
+  uint32_t vti = 0, vte = 0;
+  int32_t p_peak = 0, peep = 0;
+  BreathBucket b;
+
+  if(minutes > BREATH_TREND_MINUTES) minutes = BREATH_TREND_MINUTES;
+  if(minutes > now) minutes = now; // only completed minutes
+  t->minutes = minutes;
+  t->breaths = 0;
+
+  for(uint8_t i = 1; i <= minutes; i++){
+    uint16_t minute = now - i;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+      b = buckets[minute % BREATH_TREND_BUCKETS];
+    }
+    if(b.minute != minute) continue; // no breath in that minute
+    t->breaths += b.count;
+    vti += b.vti;
+    vte += b.vte;
+    p_peak += b.p_peak;
+    peep += b.peep;
+  }
+
+  if(!t->breaths){
+    t->rr = minutes ? 0 : NAN;
+    t->mve = minutes ? 0 : NAN;
+    t->vti = t->vte = t->p_peak = t->peep = NAN;
+    return;
+  }
+  t->rr = (float)t->breaths / minutes;
+  t->vti = (float)vti / t->breaths;
+  t->vte = (float)vte / t->breaths;
+  t->mve = (float)vte / minutes / 1000;
+  t->p_peak = (float)p_peak / t->breaths / 10;
+  t->peep = (float)peep / t->breaths / 10;
+}
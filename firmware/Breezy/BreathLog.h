@@ -0,0 +1,70 @@
+#ifndef BREATHLOG_H
+#define BREATHLOG_H
+
+#include <inttypes.h>
+#include "Configuration.h"
+
+/*
+History of the last BREATH_LOG_SIZE breaths and per-minute sums for the
+1 / 5 / 15 minute trends, so a host that connects late can backfill
+(commands "breaths" and "trend", see docs/serial_protocol.md).
+
+Statistics adds one record when a breath ends (next inspiration starts).
+The other tasks read copies, each record and bucket is copied with
+interrupts off.
+*/
+
+// Fixed point, same scales as the binary protocol. NAN is stored as BIN_NAN_*.
+struct BreathRecord{
+  uint16_t end_s; // seconds since reset when the breath ended, wraps
+  int16_t p_peak; // 0.1 cmH2O
+  int16_t p_mean; // 0.1 cmH2O
+  int16_t peep; // 0.1 cmH2O
+  uint16_t vti; // ml
+  uint16_t vte; // ml
+  uint16_t ti; // 0.01 s
+  uint16_t te; // 0.01 s
+} __attribute__((packed));
+
+// Sums of the breaths that ended within one minute
+struct BreathBucket{
+  uint16_t minute; // minutes since reset
+  uint8_t count;
+  uint32_t vti; // ml
+  uint32_t vte; // ml
+  int32_t p_peak; // 0.1 cmH2O
+  int32_t peep; // 0.1 cmH2O
+};
+
+// Averages over the completed minutes of a window
+struct BreathTrend{
+  uint8_t minutes; // minutes covered, less than asked for shortly after reset
+  uint16_t breaths;
+  float rr; // b/min
+  float vti; // ml
+  float vte; // ml
+  float mve; // l/min
+  float p_peak; // cmH2O
+  float peep; // cmH2O
+};
+
+#define BREATH_TREND_BUCKETS (BREATH_TREND_MINUTES + 1) // + the minute in progress
+
+class BreathLog{
+  public:
+  uint16_t count; // breaths added since reset, numbers the records
+
+  void init(void);
+  void add(float p_peak, float p_mean, float peep, float ti, float te, float vti, float vte);
+  uint16_t first(void); // number of the oldest record kept
+  uint8_t get(uint16_t number, BreathRecord *r); // 0 = ok, 1 = no longer (or not yet) kept
+  void trend(uint8_t minutes, BreathTrend *t); // last 1 .. BREATH_TREND_MINUTES completed minutes
+
+  private:
+  BreathRecord ring[BREATH_LOG_SIZE];
+  BreathBucket buckets[BREATH_TREND_BUCKETS];
+};
+
+extern BreathLog breath_log;
+
+#endif // #ifndef BREATHLOG_H
@@ -6,17 +6,26 @@
 #include "Statistics.h"
 #include "Messaging.h" 
 #include "Display.h"
+#include "Uart.h"
+#include "Commands.h"
+#include "Profiler.h"
+#include "Trigger.h"
+#include "Sampler.h"
 #include "Configuration.h"
 
 // Declare a mutex Semaphore Handle which we will use to manage the Serial Port.
 // It will be used to ensure only only one Task is accessing this resource at any time.
 SemaphoreHandle_t xSerialSemaphore;
 
-SemaphoreHandle_t xStatisticsSemaphore;
-
 void TaskLCD( void *pvParameters );
 void TaskVentilator( void *pvParameters );
 void TaskValve( void *pvParameters );
+void TaskTelemetry( void *pvParameters );
+void TaskCommand( void *pvParameters );
+
+// notification bits of TaskValve
+#define VALVE_NOTIFY_TRIGGER 0x01 // a patient effort, see Trigger
+#define VALVE_NOTIFY_PUBLISHED 0x02 // a new statistics snapshot, every STATISTICS_PERIOD_MS
 
 void setup() {
 
@@ -30,12 +39,20 @@ void setup() {
   valve_C_close();
   valve_D_close();
   
-  Serial.begin(115200);  // start serial for output
+  uart.begin(UART_BAUD);  // start serial for output
+
+  uart.print("MCU_RESET\r\n");
 
-  Serial.println("MCU_RESET");
+  profiler.init();
+
+  trigger.init(); // before the sampler starts feeding it
 
   statistics.init();
 
+  messaging.init();
+
+  commands.init();
+
   display.init();
 
   // Semaphores should only be used whilst the scheduler is running, but we can set it up here.
@@ -46,13 +63,6 @@ void setup() {
       xSemaphoreGive( ( xSerialSemaphore ) );  // Make the Serial Port available for use, by "Giving" the Semaphore.
   }
 
-  if ( xStatisticsSemaphore == NULL )  // Check to confirm that the Serial Semaphore has not already been created.
-  {
-    xStatisticsSemaphore = xSemaphoreCreateMutex();  // Create a mutex semaphore we will use to manage the Serial Port
-    if ( ( xStatisticsSemaphore ) != NULL )
-      xSemaphoreGive( ( xStatisticsSemaphore ) );  // Make the Serial Port available for use, by "Giving" the Semaphore.
-  }
-  
   // Now set up two Tasks to run independently.
   xTaskCreate(
     TaskLCD
@@ -60,24 +70,47 @@ void setup() {
     ,  1500  // This stack size can be checked & adjusted by reading the Stack Highwater
     ,  NULL
     ,  2  // Priority, with 3 (configMAX_PRIORITIES - 1) being the highest, and 0 being the lowest.
-    ,  NULL );
+    ,  &profiler.tasks[PROFILE_TASK_LCD] );
+  statistics.notify_on_settings(profiler.tasks[PROFILE_TASK_LCD]); // redraws a turned knob right away
 
   xTaskCreate(
     TaskVentilator
     ,  "Ventilator"
-    ,  1500  // Stack size
+    ,  1000  // Stack size (message formatting moved to TaskTelemetry)
     ,  NULL
     ,  2  // Priority
-    ,  NULL );
+    ,  &profiler.tasks[PROFILE_TASK_VENTILATOR] );
 
 
   xTaskCreate(
     TaskValve
     ,  "Valve"
-    ,  500  // Stack size
+    ,  600  // Stack size, holds a StatisticsSnapshot
+    ,  NULL
+    ,  3  // Priority, above the others: it sleeps between snapshots and runs first when a trigger fires
+    ,  &profiler.tasks[PROFILE_TASK_VALVE] );
+  trigger.notify(profiler.tasks[PROFILE_TASK_VALVE], VALVE_NOTIFY_TRIGGER);
+  statistics.notify_on_publish(profiler.tasks[PROFILE_TASK_VALVE], VALVE_NOTIFY_PUBLISHED);
+
+  // Formats and sends the samples queued by Statistics. It only runs when a sample is waiting.
+  // Below TaskValve, formatting never delays a valve step.
+  xTaskCreate(
+    TaskTelemetry
+    ,  "Telemetry"
+    ,  800  // Stack size, the profile message is the largest
     ,  NULL
     ,  2  // Priority
-    ,  NULL );
+    ,  &profiler.tasks[PROFILE_TASK_TELEMETRY] );
+
+  // Serial commands, woken by the uart RX interrupt when a line is complete
+  xTaskCreate(
+    TaskCommand
+    ,  "Command"
+    ,  600  // Stack size, cal needs the most: about 250 bytes of buffers
+    ,  NULL
+    ,  2  // Priority
+    ,  &profiler.tasks[PROFILE_TASK_COMMAND] );
+  uart.notify_on_line(profiler.tasks[PROFILE_TASK_COMMAND]);
 
   // Now the Task scheduler, which takes over control of scheduling individual Tasks, is automatically started.
 }
@@ -94,8 +127,8 @@ void TaskLCD( void *pvParameters __attribute__((unused)) )  // This is a Task.
 {
   for (;;) // A Task shall never return or exit.
   {
-    display.poll();  
-    vTaskDelay(1);  // one tick delay (15ms)
+    uint8_t changed = ulTaskNotifyTake(pdTRUE, 1) != 0; // a setting changed, or one tick delay (15ms)
+    display.poll(changed);
   }
 }
 
@@ -103,47 +136,28 @@ void TaskVentilator( void *pvParameters __attribute__((unused)) )  // This is a
 {
   for (;;)
   {
-    if (Serial.available()) {      // TODO semaphore for serial
-      int r = Serial.read();
-      switch(r){
-        case 'a':
-          valve_A_open();
-          break;
-        case 's':
-          valve_B_open();
-          break;
-        case 'd':
-          valve_C_open();
-          break;
-        case 'f':
-          valve_D_open();
-          break;
-          
-        case 'w':
-          valve_A_close();
-          break;
-        case 'e':
-          valve_B_close();
-          break;
-        case 'r':
-          valve_C_close();
-          break;
-        case 't':
-          valve_D_close();
-          break;
-        
-        default:
-          break;
-      }
-    }
-    
     statistics.poll();
-    messaging.poll();
     delay(1);
  //   vTaskDelay(1);  // one tick delay (15ms)
   }
 }
 
+void TaskTelemetry( void *pvParameters __attribute__((unused)) )  // This is a Task.
+{
+  for (;;)
+  {
+    messaging.poll(); // blocks until Statistics queues a sample
+  }
+}
+
+void TaskCommand( void *pvParameters __attribute__((unused)) )  // This is a Task.
+{
+  for (;;)
+  {
+    commands.poll(); // blocks until a command line arrives
+  }
+}
+
 void TaskValve( void *pvParameters __attribute__((unused)) )  // This is a Task.
 {
     
@@ -156,6 +170,7 @@ void TaskValve( void *pvParameters __attribute__((unused)) )  // This is a Task.
   float lung_pressure_target_cmH20 = 30;
 
   float p_act, p_o2, set_tv, slm_sum, set_rr, set_o2, set_ie;
+  StatisticsSnapshot st;
   
   uint32_t last_insp_start_millis = 0;
   uint32_t last_exp_start_millis = 0;
@@ -168,7 +183,7 @@ void TaskValve( void *pvParameters __attribute__((unused)) )  // This is a Task.
   {
     // expiration phase
     last_exp_start_millis = millis();
-    statistics.is_inspiration_from_automat = 0;
+    sampler.set_phase(0);
     valve_C_close(); // this is duplicate
     valve_D_open();
     uint8_t peep_target_reached = 0;
@@ -179,25 +194,23 @@ void TaskValve( void *pvParameters __attribute__((unused)) )  // This is a Task.
     
     
     do{
-      while( xSemaphoreTake( xStatisticsSemaphore, ( TickType_t ) 5 ) == pdFALSE ){ 
-        vTaskDelay(1);
-      }
-      p_act = statistics.p_act;
-      p_o2 = statistics.p_o2;
-      set_o2 = statistics.set_o2;
-      set_ie = statistics.set_ie;
+      ulTaskNotifyTake(pdTRUE, 1); // the next snapshot or a tick, the lower priority tasks run meanwhile
+      statistics.read(&st);
+      p_act = st.p_act;
+      p_o2 = st.p_o2;
+      set_o2 = st.set_o2;
+      set_ie = st.set_ie;
       
-      peep_target = statistics.set_peep;
-      //bottle_kPa_target = 1/statistics.set_ie * 50 + 100; // 100 kPa -only for testing... range 150 to 250 kPa in bottle
+      peep_target = st.set_peep;
+      //bottle_kPa_target = 1/st.set_ie * 50 + 100; // 100 kPa -only for testing... range 150 to 250 kPa in bottle
       bottle_kPa_target = 200;
       
-      lung_pressure_target_cmH20 = statistics.set_max_p;
-      set_rr = statistics.set_rr;
-      
-      xSemaphoreGive( xStatisticsSemaphore );
+      lung_pressure_target_cmH20 = st.set_max_p;
+      set_rr = st.set_rr;
       
       if(p_act <= peep_target){ // peep
         valve_D_close();
+        sampler.set_phase(SAMPLE_HOLD); // expiratory pause, Statistics measures the total PEEP at its end
         peep_target_reached = 1;
       }
       if(p_o2 >= bottle_kPa_target){
@@ -278,8 +291,16 @@ void TaskValve( void *pvParameters __attribute__((unused)) )  // This is a Task.
       delay_pe = MAX_PEEP_DELAY_MS;
     }
     
+    // a patient effort ends the delay early
+    uint8_t triggered = 0;
     if(delay_pe > 0){
-      vTaskDelay(delay_pe / (1000/configTICK_RATE_HZ));   
+      TickType_t wait = delay_pe / (1000/configTICK_RATE_HZ);
+      TickType_t start = xTaskGetTickCount();
+      trigger.arm(last_exp_start_millis + MIN_EXPIRATION_TIME_MS);
+      for(TickType_t waited = 0; !triggered && waited < wait; waited = xTaskGetTickCount() - start){
+        triggered = (ulTaskNotifyTake(pdTRUE, wait - waited) & VALVE_NOTIFY_TRIGGER) != 0; // each snapshot wakes it too
+      }
+      if(!triggered) trigger.disarm();
     }
     
     /*
@@ -304,26 +325,26 @@ void TaskValve( void *pvParameters __attribute__((unused)) )  // This is a Task.
     
     // inspiration phase
     last_insp_start_millis = millis();
-    statistics.is_inspiration_from_automat = 1;    
-    vTaskDelay(2); // let the Statistics do the PEEP measurement
-
+    sampler.set_phase(SAMPLE_INSPIRATION); // the samples carry the phase, the PEEP measurement needs no delay
     valve_C_open();
+    if(triggered){
+      trigger.taken();
+    }
 
     
 
     do{
-      while( xSemaphoreTake( xStatisticsSemaphore, ( TickType_t ) 5 ) == pdFALSE ){ 
-        vTaskDelay(1);
-      }
-      p_act = statistics.p_act;
-      p_o2 = statistics.p_o2;
-      set_tv = statistics.set_tv;
-      slm_sum = statistics.slm_sum;
-      xSemaphoreGive( xStatisticsSemaphore );
+      ulTaskNotifyTake(pdTRUE, 1); // the next snapshot or a tick
+      statistics.read(&st);
+      p_act = st.p_act;
+      p_o2 = st.p_o2;
+      set_tv = st.set_tv;
+      slm_sum = st.slm_sum;
       
     }while((p_act < lung_pressure_target_cmH20) && (slm_sum < set_tv));
 
     valve_C_close();
+    sampler.set_phase(SAMPLE_INSPIRATION | SAMPLE_HOLD); // Statistics measures the plateau pressure at its end
     
     ti = millis() - last_insp_start_millis;
 
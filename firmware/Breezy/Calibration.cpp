@@ -0,0 +1,143 @@
+#include <Arduino.h>
+#include <avr/eeprom.h>
+#include <util/atomic.h>
+#include "Configuration.h"
+#include "Calibration.h"
+#include "crc16.h"
+
+Calibration calibration;
+
+// EEPROM layout
+struct CalImage{
+  uint8_t version; // CAL_VERSION
+  CalTable table[CAL_CHANNELS];
+  uint16_t crc; // CRC16 of the bytes above
+};
+
+static uint16_t image_crc(const CalImage *img)
+{
+  CRC16 crc16;
+  crc16.reset();
+  crc16.update((const char *)img, offsetof(CalImage, crc));
+  return crc16.get();
+}
+
+void Calibration::init(void)
+{
+  CalImage img;
+  eeprom_read_block(&img, (const void *)CAL_EEPROM_ADDR, sizeof(img));
+  loaded = img.version == CAL_VERSION && img.crc == image_crc(&img);
+  for(uint8_t i = 0; i < CAL_CHANNELS; i++){
+    table[i].n = (loaded && img.table[i].n <= CAL_POINTS) ? img.table[i].n : 0;
+    memcpy(table[i].p, img.table[i].p, sizeof(table[i].p));
+  }
+  edit_channel = CAL_CHANNELS;
+  changed = 1;
+}
+
+void Calibration::get(uint8_t channel, CalTable *t)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+    *t = table[channel];
+  }
+}
+
+void Calibration::start(uint8_t channel)
+{
+  edit_channel = channel;
+  edit.n = 0;
+}
+
+uint8_t Calibration::add(uint8_t channel, uint16_t adc, float value, uint8_t *points)
+{
+  if(channel != edit_channel){
+    start(channel);
+  }
+  *points = edit.n;
+  if(edit.n >= CAL_POINTS){
+    return 1;
+  }
+
+  // one point per lookup bucket at most, see Sensors.cpp
+  uint16_t apart = 1 << (10 + bits(channel) - CAL_BUCKET_BITS);
+  uint8_t i = 0;
+  while(i < edit.n && edit.p[i].adc < adc){
+    i++;
+  }
+  if((i > 0 && adc - edit.p[i - 1].adc < apart) || (i < edit.n && edit.p[i].adc - adc < apart)){
+    return 2;
+  }
+
+  memmove(&edit.p[i + 1], &edit.p[i], (edit.n - i) * sizeof(CalPoint)); // kept sorted by reading
+  edit.p[i].adc = adc;
+  edit.p[i].value = value;
+  *points = ++edit.n;
+  return 0;
+}
+
+uint8_t Calibration::save(uint8_t channel)
+{
+  if(channel != edit_channel || !edit.n){
+    return 1;
+  }
+  for(uint8_t i = 1; i < edit.n; i++){
+    if(!(edit.p[i].value > edit.p[i - 1].value)){ // the sensors rise with the pressure
+      return 2;
+    }
+  }
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+    table[channel] = edit;
+  }
+  edit_channel = CAL_CHANNELS;
+  store();
+  return 0;
+}
+
+void Calibration::clear(uint8_t channel)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+    table[channel].n = 0;
+  }
+  if(edit_channel == channel){
+    edit_channel = CAL_CHANNELS;
+  }
+  store();
+}
+
+// writes both tables, only the changed bytes are programmed (3.3 ms each)
+void Calibration::store(void)
+{
+  CalImage img;
+  memset(&img, 0, sizeof(img));
+  img.version = CAL_VERSION;
+  for(uint8_t i = 0; i < CAL_CHANNELS; i++){
+    get(i, &img.table[i]);
+  }
+  img.crc = image_crc(&img);
+  eeprom_update_block(&img, (void *)CAL_EEPROM_ADDR, sizeof(img));
+  loaded = 1;
+  changed = 1;
+}
+
+uint8_t Calibration::bits(uint8_t channel)
+{
+  return channel == CAL_P_ACT ? SAMPLER_P_ACT_BITS : SAMPLER_SLOW_BITS;
+}
+
+const char *Calibration::name(uint8_t channel)
+{
+  switch(channel){
+    case CAL_P_ACT: return "p_act";
+    case CAL_P_O2: return "p_o2";
+    default: return "";
+  }
+}
+
+uint8_t Calibration::find(const char *name)
+{
+  uint8_t i = 0;
+  while(i < CAL_CHANNELS && strcmp(name, Calibration::name(i))){
+    i++;
+  }
+  return i;
+}
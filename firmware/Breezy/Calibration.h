@@ -0,0 +1,71 @@
+#ifndef CALIBRATION_H
+#define CALIBRATION_H
+
+#include <inttypes.h>
+#include "Configuration.h"
+
+/*
+Per-device calibration of the pressure sensors.
+
+Each sensor has a table of up to CAL_POINTS points, pairs of sampler
+reading and reference value in the output unit, sorted by reading.
+ - no point: the Configuration.h line (MINVOLT .. MAXOUTP)
+ - one point: zero offset, the Configuration.h gain through that point
+ - more points: straight lines between them, the first and the last line
+   are extended beyond the end points
+
+The tables are kept in EEPROM at CAL_EEPROM_ADDR with a version and a
+CRC16. A table that fails the check at boot is not used, the sensors fall
+back to Configuration.h.
+
+A new table is built with the cal command (see Commands.cpp): start, one
+point per reference pressure, then save. It is only used once saved.
+Sensors expands the tables into integer line segments and picks the
+segment of a reading with a table lookup, see Sensors.cpp.
+*/
+
+#define CAL_P_ACT 0
+#define CAL_P_O2 1
+#define CAL_CHANNELS 2
+
+#define CAL_VERSION 1
+
+struct CalPoint{
+  uint16_t adc; // sampler reading
+  float value; // reference, output unit
+};
+
+struct CalTable{
+  uint8_t n; // points
+  CalPoint p[CAL_POINTS];
+};
+
+class Calibration{
+  public:
+  volatile uint8_t changed; // a table was saved, Sensors expands it again
+  uint8_t loaded; // the EEPROM tables passed the check at boot
+
+  void init(void); // reads the EEPROM
+  void get(uint8_t channel, CalTable *t); // table in use, any task
+
+  // guided calibration, command task
+  void start(uint8_t channel);
+  uint8_t add(uint8_t channel, uint16_t adc, float value, uint8_t *points); // 0 = ok, 1 = table full, 2 = too close to a point
+  uint8_t save(uint8_t channel); // 0 = ok, 1 = nothing started, 2 = values not increasing
+  void clear(uint8_t channel); // back to Configuration.h
+
+  static uint8_t bits(uint8_t channel); // oversampling bits of the channel reading
+  static const char *name(uint8_t channel);
+  static uint8_t find(const char *name); // CAL_CHANNELS if unknown
+
+  private:
+  CalTable table[CAL_CHANNELS];
+  CalTable edit; // being built by the cal command
+  uint8_t edit_channel; // CAL_CHANNELS = none
+
+  void store(void);
+};
+
+extern Calibration calibration;
+
+#endif // #ifndef CALIBRATION_H
@@ -0,0 +1,520 @@
+#include <Arduino.h>
+#include "Configuration.h"
+#include "Commands.h"
+#include "Messaging.h"
+#include "Statistics.h"
+#include "LineWriter.h"
+#include "Uart.h"
+#include "Sampler.h"
+#include "BreathLog.h"
+#include "BinaryProtocol.h"
+#include "Trigger.h"
+#include "Alarms.h"
+#include "Calibration.h"
+#include "SFM3300.h"
+
+Commands commands;
+
+void Commands::init(void)
+{
+  len = 0;
+  overflow = 0;
+  crc_errors = 0;
+  errors = 0;
+}
+
+uint8_t Commands::poll(void)
+{
+  ulTaskNotifyTake(pdTRUE, portMAX_DELAY); // the uart RX interrupt wakes us at each '\n'
+
+  int16_t c;
+  while((c = uart.read()) >= 0){
+    if(c == '\n'){
+      if(overflow){
+        reply_error("too long");
+      }else if(len){
+        line[len] = 0;
+        execute();
+      }
+      len = 0;
+      overflow = 0;
+    }else if(c == '\r'){
+      // ignored, lines may end with "\r\n" or "\n"
+    }else if(len < COMMAND_MAX_LINE - 1){
+      line[len++] = c;
+    }else{
+      overflow = 1;
+    }
+  }
+  return 1;
+}
+
+// checks the checksum and splits the line into arguments
+void Commands::execute(void)
+{
+  char *last_comma = strrchr(line, ',');
+  if(last_comma == NULL){
+    reply_error("checksum missing");
+    return;
+  }
+  
+  char *crc_field = last_comma + 1;
+  if(strcmp(crc_field, "-1") != 0){ // -1 = no checksum
+    CRC16 crc16;
+    crc16.reset();
+    crc16.update(line, crc_field - line); // up to and including the last comma
+    if(crc16.get() != (uint16_t)atol(crc_field)){
+      crc_errors++;
+      reply_error("checksum");
+      return;
+    }
+  }
+  *last_comma = 0;
+  
+  char *argv[COMMAND_MAX_ARGS];
+  uint8_t argc = 0;
+  char *p = line;
+  while(argc < COMMAND_MAX_ARGS){
+    argv[argc++] = p;
+    p = strchr(p, ',');
+    if(p == NULL) break;
+    *p++ = 0;
+  }
+  
+  run(argc, argv);
+}
+
+void Commands::run(uint8_t argc, char **argv)
+{
+  if(!strcmp(argv[0], "valve")){
+    cmd_valve(argc, argv);
+  }else if(!strcmp(argv[0], "format")){
+    cmd_format(argc, argv);
+  }else if(!strcmp(argv[0], "rate")){
+    cmd_rate(argc, argv);
+  }else if(!strcmp(argv[0], "settings")){
+    cmd_settings();
+  }else if(!strcmp(argv[0], "diag")){
+    cmd_diag();
+  }else if(!strcmp(argv[0], "breaths")){
+    cmd_breaths(argc, argv);
+  }else if(!strcmp(argv[0], "trend")){
+    cmd_trend(argc, argv);
+  }else if(!strcmp(argv[0], "trigger")){
+    cmd_trigger(argc, argv);
+  }else if(!strcmp(argv[0], "ack")){
+    cmd_ack();
+  }else if(!strcmp(argv[0], "cal")){
+    cmd_cal(argc, argv);
+  }else{
+    reply_error("unknown command");
+  }
+}
+
+// finishes the line with checksum and sends it in the current message format
+void Commands::send(LineWriter *w)
+{
+  w->put_crc();
+  if(messaging.print_line(w->c_str(), w->length()) == 2){
+    reply_error("reply too long");
+  }
+}
+
+void Commands::reply_error(const char *reason)
+{
+  char msg[48];
+  LineWriter w(msg, sizeof(msg), 1);
+  errors++;
+  w.put("error,");
+  w.put(reason);
+  w.put(',');
+  send(&w);
+}
+
+// "usage: <head><min>-<max><tail>" with the range from Configuration.h
+void Commands::reply_usage(const char *head, uint16_t min, uint16_t max, const char *tail)
+{
+  char msg[48];
+  LineWriter w(msg, sizeof(msg), 1);
+  errors++;
+  w.put("error,usage: ");
+  w.put(head);
+  w.put_uint(min, 0);
+  w.put('-');
+  w.put_uint(max, 0);
+  w.put(tail);
+  w.put(',');
+  send(&w);
+}
+
+// valve,<a|b|c|d>,<open|close>
+void Commands::cmd_valve(uint8_t argc, char **argv)
+{
+  if(argc != 3 || strlen(argv[1]) != 1){
+    reply_error("usage: valve,<a-d>,<open|close>");
+    return;
+  }
+  uint8_t open = !strcmp(argv[2], "open");
+  if(!open && strcmp(argv[2], "close")){
+    reply_error("usage: valve,<a-d>,<open|close>");
+    return;
+  }
+  
+  switch(argv[1][0]){
+    case 'a':
+      if(open) valve_A_open(); else valve_A_close();
+      break;
+    case 'b':
+      if(open) valve_B_open(); else valve_B_close();
+      break;
+    case 'c':
+      if(open) valve_C_open(); else valve_C_close();
+      break;
+    case 'd':
+      if(open) valve_D_open(); else valve_D_close();
+      break;
+    default:
+      reply_error("unknown valve");
+      return;
+  }
+  
+  char msg[32];
+  LineWriter w(msg, sizeof(msg), 1);
+  w.put("ok,valve,");
+  w.put(argv[1]);
+  w.put(',');
+  w.put(argv[2]);
+  w.put(',');
+  send(&w);
+}
+
+// format,<text|binary|wave>
+void Commands::cmd_format(uint8_t argc, char **argv)
+{
+  uint8_t format = 0;
+  if(argc == 2){
+    if(!strcmp(argv[1], "text")) format = MESSAGE_FORMAT_TEXT;
+    else if(!strcmp(argv[1], "binary")) format = MESSAGE_FORMAT_BINARY;
+    else if(!strcmp(argv[1], "wave")) format = MESSAGE_FORMAT_WAVE;
+  }
+  if(!format){
+    reply_error("usage: format,<text|binary|wave>");
+    return;
+  }
+  messaging.format = format; // the reply already goes out in the new format
+  
+  char msg[32];
+  LineWriter w(msg, sizeof(msg), 1);
+  w.put("ok,format,");
+  w.put(argv[1]);
+  w.put(',');
+  send(&w);
+}
+
+// rate,<waveform period ms>
+void Commands::cmd_rate(uint8_t argc, char **argv)
+{
+  long ms = argc == 2 ? atol(argv[1]) : 0;
+  if(ms < STATISTICS_PERIOD_MS || ms > 1000){
+    reply_usage("rate,<", STATISTICS_PERIOD_MS, 1000, " ms>");
+    return;
+  }
+  messaging.wave_period_ms = ms;
+  
+  char msg[32];
+  LineWriter w(msg, sizeof(msg), 1);
+  w.put("ok,rate,");
+  w.put_uint(ms, 0);
+  w.put(',');
+  send(&w);
+}
+
+// ok,settings,<o2>,<max_p>,<peep>,<rr>,<tv>,<ie>,<format>,<wave ms>
+void Commands::cmd_settings(void)
+{
+  char msg[96];
+  LineWriter w(msg, sizeof(msg), 1);
+  StatisticsSnapshot st;
+  statistics.read(&st);
+  w.put("ok,settings,");
+  w.put_fixed(st.set_o2, 0, 0);
+  w.put(',');
+  w.put_fixed(st.set_max_p, 0, 0);
+  w.put(',');
+  w.put_fixed(st.set_peep, 0, 0);
+  w.put(',');
+  w.put_fixed(st.set_rr, 0, 0);
+  w.put(',');
+  w.put_fixed(st.set_tv, 0, 0);
+  w.put(',');
+  w.put_ie(st.set_ie);
+  w.put(',');
+  w.put_uint(messaging.format, 0);
+  w.put(',');
+  w.put_uint(messaging.wave_period_ms, 0);
+  w.put(',');
+  send(&w);
+}
+
+// ok,diag,<tx dropped>,<tx high watermark>,<rx dropped>,<telemetry dropped>,<crc errors>,<errors>,<sample overruns>,<flow errors>,<filter cycles>,
+//   <flow crc errors>,<flow sensor restarts>
+void Commands::cmd_diag(void)
+{
+  char msg[96];
+  LineWriter w(msg, sizeof(msg), 1);
+  StatisticsSnapshot st;
+  statistics.read(&st);
+  w.put("ok,diag,");
+  w.put_uint(uart.tx_dropped, 0);
+  w.put(',');
+  w.put_uint(uart.tx_high_watermark, 0);
+  w.put(',');
+  w.put_uint(uart.rx_dropped, 0);
+  w.put(',');
+  w.put_uint(messaging.dropped, 0);
+  w.put(',');
+  w.put_uint(crc_errors, 0);
+  w.put(',');
+  w.put_uint(errors, 0);
+  w.put(',');
+  w.put_uint(sampler.overruns, 0);
+  w.put(',');
+  w.put_uint(sfm.errors, 0);
+  w.put(',');
+  w.put_uint(st.filter_cycles, 0);
+  w.put(',');
+  w.put_uint(sfm.crc_errors, 0);
+  w.put(',');
+  w.put_uint(sfm.restarts, 0);
+  w.put(',');
+  send(&w);
+}
+
+// breaths[,<count>] - sends the last <count> (default all kept) breaths oldest first,
+// then ok,breaths,<first number>,<records sent>,<seconds since reset>
+void Commands::cmd_breaths(uint8_t argc, char **argv)
+{
+  long n = argc == 2 ? atol(argv[1]) : BREATH_LOG_SIZE;
+  if(argc > 2 || n < 1 || n > BREATH_LOG_SIZE){
+    reply_usage("breaths[,<", 1, BREATH_LOG_SIZE, ">]");
+    return;
+  }
+
+  uint16_t last = breath_log.count;
+  uint16_t number = breath_log.first();
+  if((uint16_t)(last - number) > n){
+    number = last - n;
+  }
+  uint16_t first = number;
+  uint8_t sent = 0;
+  
+  while(number != last){
+    BreathRecord r[BIN_BREATH_LOG_RECORDS];
+    uint8_t count = 0;
+    while(count < BIN_BREATH_LOG_RECORDS && (uint16_t)(number + count) != last &&
+          !breath_log.get(number + count, &r[count])){
+      count++;
+    }
+    if(!count){ // overwritten while sending
+      break;
+    }
+    for(uint8_t tries = 0; messaging.print_breath_log(number, r, count) && tries < 3; tries++){
+      vTaskDelay(1); // the TX queue is full, let it drain
+    }
+    number += count;
+    sent += count;
+    vTaskDelay(1); // leave room for the telemetry
+  }
+  
+  char msg[48];
+  LineWriter w(msg, sizeof(msg), 1);
+  w.put("ok,breaths,");
+  w.put_uint(first, 0);
+  w.put(',');
+  w.put_uint(sent, 0);
+  w.put(',');
+  w.put_ulong(millis() / 1000);
+  w.put(',');
+  send(&w);
+}
+
+// trend,<minutes> - ok,trend,<minutes>,<breaths>,<rr>,<vti>,<vte>,<mve>,<p_peak>,<peep>
+void Commands::cmd_trend(uint8_t argc, char **argv)
+{
+  long minutes = argc == 2 ? atol(argv[1]) : 0;
+  if(minutes < 1 || minutes > BREATH_TREND_MINUTES){
+    reply_usage("trend,<", 1, BREATH_TREND_MINUTES, ">");
+    return;
+  }
+
+  BreathTrend t;
+  breath_log.trend(minutes, &t);
+  
+  char msg[96];
+  LineWriter w(msg, sizeof(msg), 1);
+  w.put("ok,trend,");
+  w.put_uint(t.minutes, 0);
+  w.put(',');
+  w.put_uint(t.breaths, 0);
+  w.put(',');
+  w.put_fixed(t.rr, 0, 1);
+  w.put(',');
+  w.put_fixed(t.vti, 0, 0);
+  w.put(',');
+  w.put_fixed(t.vte, 0, 0);
+  w.put(',');
+  w.put_fixed(t.mve, 0, 1);
+  w.put(',');
+  w.put_fixed(t.p_peak, 0, 1);
+  w.put(',');
+  w.put_fixed(t.peep, 0, 1);
+  w.put(',');
+  send(&w);
+}
+
+// trigger[,<l/min>] - sets the flow trigger sensitivity, 0 = off
+// ok,trigger,<l/min>,<triggered breaths>,<last latency ms>,<max latency ms>
+void Commands::cmd_trigger(uint8_t argc, char **argv)
+{
+  if(argc > 2){
+    reply_usage("trigger[,<", 0, TRIGGER_MAX_SLM, " l/min>]");
+    return;
+  }
+  if(argc == 2){
+    float slm = atof(argv[1]);
+    if(!(slm >= 0 && slm <= TRIGGER_MAX_SLM)){
+      reply_usage("trigger[,<", 0, TRIGGER_MAX_SLM, " l/min>]");
+      return;
+    }
+    trigger.set_sensitivity(slm);
+  }
+  
+  char msg[48];
+  LineWriter w(msg, sizeof(msg), 1);
+  w.put("ok,trigger,");
+  w.put_fixed(trigger.sensitivity(), 0, 1);
+  w.put(',');
+  w.put_uint(trigger.breaths, 0);
+  w.put(',');
+  w.put_uint(trigger.last_latency_ms, 0);
+  w.put(',');
+  w.put_uint(trigger.max_latency_ms, 0);
+  w.put(',');
+  send(&w);
+}
+
+// ack - acknowledges the alarms, the ones still active stay latched
+// ok,ack,<active>,<latched>
+void Commands::cmd_ack(void)
+{
+  uint16_t active, latched;
+  alarms.ack();
+  alarms.get(&active, &latched);
+  
+  char msg[32];
+  LineWriter w(msg, sizeof(msg), 1);
+  w.put("ok,ack,");
+  w.put_uint(active, 0);
+  w.put(',');
+  w.put_uint(latched, 0);
+  w.put(',');
+  send(&w);
+}
+
+// mean of CAL_AVERAGE sampler readings of a calibrated sensor, one per tick
+static uint16_t cal_reading(uint8_t channel)
+{
+  uint32_t sum = 0;
+  for(uint8_t i = 0; i < CAL_AVERAGE; i++){
+    vTaskDelay(1); // at least one new statistics batch
+    if(channel == CAL_P_ACT){
+      StatisticsSnapshot st;
+      statistics.read(&st);
+      sum += st.p_act_adc;
+    }else{
+      sum += sampler.slow(SAMPLER_SLOW_P_O2);
+    }
+  }
+  return (sum + CAL_AVERAGE / 2) / CAL_AVERAGE;
+}
+
+// cal,<p_act|p_o2> - a calpoint,<sensor>,<point>,<point reading>,<point value> line per point of the
+//   table in use, then ok,cal,<sensor>,<reading>,<points>
+// cal,<sensor>,start - ok,cal,<sensor>,start - begins a new table, the one in use stays until save
+// cal,<sensor>,point,<value> - ok,cal,<sensor>,point,<reading>,<value>,<points> - the sensor is at value now
+// cal,<sensor>,save - stores the new table in EEPROM and uses it, answered like cal,<sensor>
+// cal,<sensor>,default - back to Configuration.h, answered like cal,<sensor>
+void Commands::cmd_cal(uint8_t argc, char **argv)
+{
+  uint8_t channel = argc >= 2 ? Calibration::find(argv[1]) : CAL_CHANNELS;
+  const char *action = argc >= 3 ? argv[2] : "";
+  if(channel >= CAL_CHANNELS || argc > 4 || (argc == 4) != !strcmp(action, "point")){
+    reply_error("usage: cal,<sensor>[,<action>]");
+    return;
+  }
+
+  char msg[64];
+  LineWriter w(msg, sizeof(msg), 1);
+  w.put("ok,cal,");
+  w.put(argv[1]);
+  w.put(',');
+
+  if(!strcmp(action, "start")){
+    calibration.start(channel);
+    w.put("start,");
+    send(&w);
+    return;
+  }
+  if(!strcmp(action, "point")){
+    float value = atof(argv[3]);
+    uint16_t adc = cal_reading(channel);
+    uint8_t points;
+    switch(calibration.add(channel, adc, value, &points)){
+      case 1: reply_error("cal table full"); return;
+      case 2: reply_error("cal point too close"); return;
+    }
+    w.put("point,");
+    w.put_uint(adc, 0);
+    w.put(',');
+    w.put_fixed(value, 0, 2);
+    w.put(',');
+    w.put_uint(points, 0);
+    w.put(',');
+    send(&w);
+    return;
+  }
+  if(!strcmp(action, "save")){
+    switch(calibration.save(channel)){
+      case 1: reply_error("cal not started"); return;
+      case 2: reply_error("cal values not rising"); return;
+    }
+  }else if(!strcmp(action, "default")){
+    calibration.clear(channel);
+  }else if(*action){
+    reply_error("usage: cal,<sensor>[,<action>]");
+    return;
+  }
+
+  // a line per point, all of them on one line do not fit a text frame
+  CalTable t;
+  calibration.get(channel, &t);
+  for(uint8_t i = 0; i < t.n; i++){
+    char point[48];
+    LineWriter p(point, sizeof(point), 1);
+    p.put("calpoint,");
+    p.put(argv[1]);
+    p.put(',');
+    p.put_uint(i + 1, 0);
+    p.put(',');
+    p.put_uint(t.p[i].adc, 0);
+    p.put(',');
+    p.put_fixed(t.p[i].value, 0, 2);
+    p.put(',');
+    send(&p);
+  }
+  w.put_uint(cal_reading(channel), 0);
+  w.put(',');
+  w.put_uint(t.n, 0);
+  w.put(',');
+  send(&w);
+}
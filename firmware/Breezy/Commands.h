@@ -0,0 +1,53 @@
+#ifndef COMMANDS_H
+#define COMMANDS_H
+
+#include <inttypes.h>
+#include "LineWriter.h"
+
+/*
+Line oriented serial commands, see docs/serial_protocol.md.
+
+  <command>[,<argument>...],<checksum>\r\n
+
+The checksum is the CRC16-CCITT of the line up to and including the last
+comma, like the messages the controller sends, or -1 for "no checksum".
+Each command is answered by an "ok,<command>,..." or "error,<reason>,..." line.
+*/
+
+#define COMMAND_MAX_LINE (64)
+#define COMMAND_MAX_ARGS (6)
+
+class Commands{
+  public:
+  uint16_t crc_errors; // lines rejected because of a wrong checksum
+  uint16_t errors; // all rejected lines, checksum errors included
+
+  void init(void);
+  uint8_t poll(void); // command task, blocks until a line arrives
+
+  private:
+  char line[COMMAND_MAX_LINE];
+  uint8_t len;
+  uint8_t overflow;
+  
+  void execute(void);
+  void run(uint8_t argc, char **argv);
+  void send(LineWriter *w);
+  void reply_error(const char *reason);
+  void reply_usage(const char *head, uint16_t min, uint16_t max, const char *tail);
+  
+  void cmd_valve(uint8_t argc, char **argv);
+  void cmd_format(uint8_t argc, char **argv);
+  void cmd_rate(uint8_t argc, char **argv);
+  void cmd_settings(void);
+  void cmd_diag(void);
+  void cmd_breaths(uint8_t argc, char **argv);
+  void cmd_trend(uint8_t argc, char **argv);
+  void cmd_trigger(uint8_t argc, char **argv);
+  void cmd_ack(void);
+  void cmd_cal(uint8_t argc, char **argv);
+};
+
+extern Commands commands;
+
+#endif // #ifndef COMMANDS_H
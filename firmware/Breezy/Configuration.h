@@ -1,24 +1,82 @@
 #include <Arduino_FreeRTOS.h>
 #include <semphr.h>  // add the FreeRTOS functions for Semaphores (or Flags).
 extern SemaphoreHandle_t xSerialSemaphore;
-extern SemaphoreHandle_t xStatisticsSemaphore;
+
+// Serial port (USART0)
+#define UART_BAUD (115200)
+#define UART_TX_BUFFER_SIZE (512) // power of 2, holds several messages
+#define UART_RX_BUFFER_SIZE (64) // power of 2, max 256
 
 // Message time granularity
 #define MESSAGE_PERIOD_MS (50)
 
-// Statistics time granularity
-#define STATISTICS_PERIOD_MS (50)
+// Samples buffered between Statistics and the telemetry task
+#define TELEMETRY_QUEUE_LEN (16)
+
+// Default waveform message period (10 = 100 Hz), can be changed at runtime
+#define WAVE_PERIOD_MS (10)
+
+// Pressure and flow sampling rate (Timer3), samples queued for Statistics
+#define SAMPLER_RATE_HZ (500)
+#define SAMPLER_RING_SIZE (32) // power of 2, 64 ms at 500 Hz
+#define SAMPLER_FLOW_RETRIES (5) // failed flow reads in a row before the sensor is power cycled
+#define SFM3300_OFF_MS (100) // power off time of a restart
+#define SFM3300_STARTUP_MS (110) // power on to the start measurement command
+#define SFM3300_HOLD_MS (10) // a failed flow read repeats the last good value this long
+// ADC oversampling: 4^bits conversions per reading, decimated to ADC_MAXVAL << bits
+#define SAMPLER_P_ACT_BITS (2) // pressure, 16 conversions each sample
+#define SAMPLER_SLOW_BITS (1) // O2 supply and potentiometers, 4 conversions each visit
+// Slow channel rates, at most one slow channel is converted per tick
+#define SAMPLER_P_O2_HZ (50) // O2 supply pressure
+#define SAMPLER_POT_HZ (5) // each potentiometer
+#define SENSORS_POT_HYSTERESIS (4) // sampler counts (0 .. 2046), a smaller potentiometer change is ignored
+
+// Statistics time granularity (processes the queued samples in batches)
+#define STATISTICS_PERIOD_MS (10)
+
+// Filters applied to the sampler stream before Statistics, see Filters.h. The flow trigger sees the raw flow.
+#define FILTER_P_ACT_MEDIAN (3) // samples, odd, drops the valve switching spikes
+#define FILTER_P_ACT_LOWPASS 1105, 2210, 1105, -18727, 6763 // Butterworth 50 Hz at SAMPLER_RATE_HZ 500, Q14
+#define FILTER_FLOW_MEDIAN (3) // samples, odd
+
+// Plateau pressure and PEEP are the mean pressure over the last ms of inspiration / expiration,
+// the plateau and total PEEP only when the valves were closed (hold / pause) for the whole window
+#define STATISTICS_END_WINDOW_MS (50)
+#define PLATEAU_MAX_SPREAD (1.0) // cmH2O, a wider pressure range in the window is no plateau
+#define FLOW_EMA_SHIFT (2) // flow smoothing for the peak flows, 2^2 samples
+
+// Breaths kept for the breaths command (16 bytes each) and the trend buckets (one per minute)
+#define BREATH_LOG_SIZE (32)
+#define BREATH_TREND_MINUTES (15) // longest trend window
+
+// Alarm limits, see Alarms.h. Delays count statistics batches (STATISTICS_PERIOD_MS) or breaths, max 255.
+#define ALARM_HIGH_P_MARGIN (5) // cmH2O above the set max. pressure
+#define ALARM_P_HYSTERESIS (2) // cmH2O
+#define ALARM_HIGH_P_DELAY (2) // batches
+#define ALARM_PEEP_MARGIN (3) // cmH2O below the set PEEP
+#define ALARM_MIN_MVE (3.0) // l/min
+#define ALARM_MAX_MVE (20.0) // l/min
+#define ALARM_MVE_HYSTERESIS (0.5) // l/min
+#define ALARM_BREATHS_DELAY (2) // breaths
+#define ALARM_APNEA_MS (15000) // no breath for this long
+#define ALARM_MIN_P_O2 (100) // kPa, the bottle runs lower than that only when the supply fails
+#define ALARM_P_O2_HYSTERESIS (10) // kPa
+#define ALARM_P_O2_DELAY (200) // batches, the bottle empties during each inspiration
+#define ALARM_FLOW_SENSOR_DELAY (30) // batches, covers a sensor restart (retries, off, startup)
+#define ALARM_PERIOD_MS (1000) // alarm message repeat while an alarm is latched
+
+// Profile message period, the run time counters cover one period
+#define PROFILE_PERIOD_MS (1000)
 
 // Display time granularity
 #define DISPLAY_PERIOD_MS (700)
 
-// Flow higher than this will switch to the inspiration state
-// lower than negative will swith to the expiration state
-// unit: lpm
-#define INSPIRATION_FLOW_DETECT_TRIGGER (4.5)
+// Flow trigger, see Trigger.h. The sensitivity (l/min) is set by the trigger command, default off.
+#define TRIGGER_DEBOUNCE_SAMPLES (3) // samples above the threshold in a row, 6 ms at 500 Hz
+#define TRIGGER_BASELINE_SHIFT (4) // baseline flow EMA, 2^4 samples
+#define TRIGGER_MAX_SLM (20)
 
-// Minimum times - helps to debounce inspiration / expiration detection
-#define MIN_INSPIRATION_TIME_MS 400
+// No trigger this early in the expiration
 #define MIN_EXPIRATION_TIME_MS 600
 
 // max time to prolong expiration (ms)
@@ -31,6 +89,16 @@ extern SemaphoreHandle_t xStatisticsSemaphore;
 #define ADC_MAXVAL (1023)
 #define ADC_REF_VOLT (5)
 
+// 1 = analog sensors are converted in fixed point (AdcScale.h), 0 = in float
+#define SENSORS_FIXED_POINT (1)
+
+// Per-device calibration of the pressure sensors (cal command), see Calibration.h.
+// Without a stored table the sensors use the MINVOLT .. MAXOUTP lines below.
+#define CAL_POINTS (5) // per sensor
+#define CAL_BUCKET_BITS (4) // lookup buckets over the reading range, 2^4, the points must be a bucket apart
+#define CAL_AVERAGE (16) // readings averaged for a point, one per tick (15 ms)
+#define CAL_EEPROM_ADDR (0)
+
 // define which analog input is used to measure the actual pressure (default:  MPX5010 10 kPa)
 #define P_ACT_PIN A9
 #define P_ACT_MINVOLT (0.2)
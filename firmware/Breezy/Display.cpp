@@ -42,6 +42,9 @@
 #include "Configuration.h"
 #include "Display.h"
 #include "Statistics.h"
+#include "LineWriter.h"
+#include "Profiler.h"
+#include "Alarms.h"
 
 
 
@@ -51,8 +54,21 @@ U8GLIB_ST7920_128X64_1X u8g(LCD_EN_PIN, LCD_RW_PIN, LCD_DI_PIN);  // SPI Com: SC
 
 float p = 0; // TODO remove
 
+// draws "<label><value>" at x, y
+static void draw_value(LineWriter &w, uint8_t x, uint8_t y, const char *label, float value, uint8_t prec)
+{
+  w.reset();
+  w.put(label);
+  w.put_fixed(value, 5, prec);
+  u8g.drawStr(x, y, w.c_str());
+}
+
+static StatisticsSnapshot st; // read once per redraw, all pages show the same values
+static uint16_t alarms_active, alarms_latched;
+
 void draw(void) {
-  uint8_t msg[40] = "";
+  char msg[40];
+  LineWriter w(msg, sizeof(msg));
   // graphic commands to redraw the complete screen should be placed here  
 
 // TODO remove
@@ -66,105 +82,69 @@ void draw(void) {
   u8g.setFont(u8g_font_5x7);
   //u8g.setFont(u8g_font_osb21);
 
-  sprintf(msg, "Ppeak" );
-  dtostrf(statistics.p_peak, 5, 1, &msg[strlen(msg)]);
-  u8g.drawStr( 0, 7, msg);
-
-  sprintf(msg, "Pmean" );
-  dtostrf(statistics.p_mean, 5, 0, &msg[strlen(msg)]);
-  u8g.drawStr( 0, 14, msg);
-
-  sprintf(msg, "PEEP " );
-  dtostrf(statistics.peep, 5, 0, &msg[strlen(msg)]);
-  u8g.drawStr( 0, 21, msg);
-
-  sprintf(msg, "RR   " );
-  dtostrf(statistics.rr, 5, 0, &msg[strlen(msg)]);
-  u8g.drawStr( 0, 28, msg);
-
-  sprintf(msg, "Ti   " );
-  dtostrf(statistics.ti, 5, 0, &msg[strlen(msg)]);
-  u8g.drawStr( 0, 35, msg);
-  
-  
+  draw_value(w, 0, 7, "Ppeak", st.p_peak, 1);
+  draw_value(w, 0, 14, "Pmean", st.p_mean, 0);
+  draw_value(w, 0, 21, "PEEP ", st.peep, 0);
+  draw_value(w, 0, 28, "RR   ", st.rr, 0);
+  draw_value(w, 0, 35, "Ti   ", st.ti, 0);
+  draw_value(w, 0, 42, "Pplat", st.p_plat, 1);
   
-  sprintf(msg, "sMaxP" );
-  dtostrf(statistics.set_max_p, 5, 0, &msg[strlen(msg)]);
-  u8g.drawStr( 0, 45, msg); 
-  
-  sprintf(msg, "sPEEP" );
-  dtostrf(statistics.set_peep, 5, 0, &msg[strlen(msg)]);
-  u8g.drawStr( 0, 52, msg);  
-  
-  sprintf(msg, "s VTi" );
-  dtostrf(statistics.set_tv, 5, 0, &msg[strlen(msg)]);
-  u8g.drawStr( 0, 59, msg);
- 
+  draw_value(w, 0, 49, "sMaxP", st.set_max_p, 0);
+  draw_value(w, 0, 56, "sPEEP", st.set_peep, 0);
+  draw_value(w, 0, 63, "s VTi", st.set_tv, 0);
  
-  if(statistics.i_e > 1){
-    sprintf(msg, "I:E  " );
-    dtostrf(statistics.i_e, 0, 1, &msg[strlen(msg)]);
-    sprintf(&msg[strlen(msg)], ":1" );
-  }else{
-    sprintf(msg, "I:E  1:" );
-    dtostrf(1.0 / statistics.i_e, 0, 1, &msg[strlen(msg)]);
+  w.reset();
+  w.put("I:E  ");
+  w.put_ie(st.i_e);
+  u8g.drawStr( 64, 7, w.c_str());
+
+  draw_value(w, 64, 14, "MVi", st.mvi, 1);
+  draw_value(w, 64, 21, "MVe", st.mve, 1);
+  draw_value(w, 64, 28, "VTi", st.vti, 0);
+  draw_value(w, 64, 35, "VTe", st.vte, 0);
+  draw_value(w, 64, 42, "PEEPt", st.peep_tot, 1);
+  
+  w.reset();
+  w.put("I:E  "); // set I:E
+  w.put_ie(st.set_ie);
+  u8g.drawStr( 64, 49, w.c_str());
+
+  draw_value(w, 64, 56, "s RR ", st.set_rr, 0);
+  draw_value(w, 64, 63, "s FiO2", st.set_o2, 0);
+
+  // highest priority alarm over the first settings row, inverted while still active
+  uint8_t top = Alarms::top(alarms_latched);
+  if(top < ALARMS){
+    uint8_t is_active = (alarms_active >> top) & 1;
+    w.reset();
+    w.put(Alarms::name(top));
+    if(alarms_latched & ~_BV(top)){
+      w.put(" +"); // more alarms
+    }
+    u8g.setColorIndex(is_active);
+    u8g.drawBox(0, 42, 128, 8);
+    u8g.setColorIndex(!is_active);
+    u8g.drawStr(1, 49, w.c_str());
+    u8g.setColorIndex(1);
   }
   
-  u8g.drawStr( 64, 7, msg);
-
-  sprintf(msg, "MVi" );
-  dtostrf(statistics.mvi, 5, 1, &msg[strlen(msg)]);
-  u8g.drawStr( 64, 14, msg);
-
-  sprintf(msg, "MVe" );
-  dtostrf(statistics.mve, 5, 1, &msg[strlen(msg)]);
-  u8g.drawStr( 64, 21, msg);
-
-  sprintf(msg, "VTi" );
-  dtostrf(statistics.vti, 5, 0, &msg[strlen(msg)]);
-  u8g.drawStr( 64, 28, msg);
-
-  sprintf(msg, "VTe" );
-  dtostrf(statistics.vte, 5, 0, &msg[strlen(msg)]);
-  u8g.drawStr( 64, 35, msg);
-  
-  
-  sprintf(msg, "s I:E" );
-  if(statistics.set_ie > 1){
-    sprintf(msg, "I:E  " );
-    dtostrf(statistics.set_ie, 0, 1, &msg[strlen(msg)]);
-    sprintf(&msg[strlen(msg)], ":1" );
-  }else{
-    sprintf(msg, "I:E  1:" );
-    dtostrf(1.0 / statistics.set_ie, 0, 1, &msg[strlen(msg)]);
-  }
-  u8g.drawStr( 64, 45, msg);
-
-  
-  sprintf(msg, "s RR " );
-  dtostrf(statistics.set_rr, 5, 0, &msg[strlen(msg)]);
-  u8g.drawStr( 64, 52, msg);  
- 
-  
-  sprintf(msg, "s FiO2" );
-  dtostrf(statistics.set_o2, 5, 0, &msg[strlen(msg)]);
-  u8g.drawStr( 64, 59, msg);
-  
 }
 
 
-uint8_t Display::poll(void)
+uint8_t Display::poll(uint8_t now)
 {
   static uint32_t last_poll = 0;
   uint32_t mil = millis();
   
-  if(mil - last_poll < (uint32_t)DISPLAY_PERIOD_MS){ // it is not the time yet
+  if(mil - last_poll >= (uint32_t)DISPLAY_PERIOD_MS){
+    last_poll += (uint32_t)DISPLAY_PERIOD_MS;
+  }else if(!now){ // it is not the time yet
     return 0;
   }
-  
-  last_poll += (uint32_t)DISPLAY_PERIOD_MS;
 
+  uint32_t start_us = micros();
   display.hello();
+  profiler.add(PROFILE_DISPLAY, start_us);
   
   return 1;
   
@@ -194,7 +174,9 @@ void Display::init(void) {
 
 void Display::hello(void) {
 
-  p = statistics.p_o2;
+  statistics.read(&st);
+  alarms.get(&alarms_active, &alarms_latched);
+  p = st.p_o2;
 
   u8g.firstPage();  
   do {
@@ -4,7 +4,7 @@ class Display{
   public:
     void init(void);
     void hello(void);
-    uint8_t poll(void);
+    uint8_t poll(uint8_t now = 0); // now: redraw without waiting for the period, e.g. a setting changed
 
   private:
 
@@ -0,0 +1,129 @@
+#ifndef FILTERS_H
+#define FILTERS_H
+
+#include <inttypes.h>
+
+/*
+Integer filter stages for the sampler rate stream, composed at compile time.
+Samples are int16_t: ADC counts or raw flow - SFM3300_OFFSET.
+
+Median<N>                       median of the last N samples (N odd, max 7), drops spikes
+                                shorter than N / 2 + 1 samples, delays by N / 2 samples
+Biquad<N0, N1, N2, D1, D2>      second order IIR, numerator b0 b1 b2 and denominator a1 a2
+                                coefficients in Q14 (16384 = 1.0), a0 = 1
+FilterChain<S1, S2, ...>        S1, then S2, ... - each stage has push() and reset()
+
+The stages start from the first sample pushed after reset(), as if it had
+always been there, so they do not ramp up from 0.
+*/
+
+template <uint8_t N>
+class Median{
+  public:
+  Median() { reset(); }
+
+  void reset(void)
+  {
+    count = 0;
+    head = 0;
+  }
+
+  int16_t push(int16_t x)
+  {
+    if(!count){ // fill the window with the first sample
+      for(uint8_t i = 0; i < N; i++) ring[i] = x;
+      count = 1;
+    }
+    ring[head] = x;
+    if(++head >= N) head = 0;
+
+    int16_t s[N]; // insertion sort of a copy, N is small
+    for(uint8_t i = 0; i < N; i++){
+      int16_t v = ring[i];
+      uint8_t j = i;
+      while(j && s[j - 1] > v){
+        s[j] = s[j - 1];
+        j--;
+      }
+      s[j] = v;
+    }
+    return s[N / 2];
+  }
+
+  private:
+  int16_t ring[N];
+  uint8_t head;
+  uint8_t count;
+
+  static_assert(N & 1 && N <= 7, "Median: N must be odd, max 7");
+};
+
+// Direct form I. The rounding error of each output is fed back into the next
+// one (error feedback), so a low-pass settles exactly on a constant input.
+// |x|, |y| < 2^15 and the sum of the |coefficients| < 2^16 keep the accumulator in 32 bits.
+template <int16_t N0, int16_t N1, int16_t N2, int16_t D1, int16_t D2>
+class Biquad{
+  public:
+  Biquad() { reset(); }
+
+  void reset(void)
+  {
+    x1 = x2 = y1 = y2 = 0; // set by the first push, keeps the compiler from warning
+    err = 0;
+    primed = 0;
+  }
+
+  int16_t push(int16_t x)
+  {
+    if(!primed){ // steady state for a constant x, a gain of 1 is assumed
+      x1 = x2 = y1 = y2 = x;
+      err = 0;
+      primed = 1;
+    }
+    int32_t acc = (int32_t)N0 * x + (int32_t)N1 * x1 + (int32_t)N2 * x2
+                - (int32_t)D1 * y1 - (int32_t)D2 * y2 + err;
+    int16_t y = (acc + (1 << 13)) >> 14;
+    err = acc - ((int32_t)y << 14);
+    x2 = x1;
+    x1 = x;
+    y2 = y1;
+    y1 = y;
+    return y;
+  }
+
+  private:
+  int16_t x1, x2, y1, y2;
+  int16_t err; // Q14 rounding error of the last output
+  uint8_t primed;
+
+  static_assert((int32_t)(N0 < 0 ? -N0 : N0) + (N1 < 0 ? -N1 : N1) + (N2 < 0 ? -N2 : N2)
+                + (D1 < 0 ? -D1 : D1) + (D2 < 0 ? -D2 : D2) < 65536L, "Biquad: coefficients too large");
+};
+
+template <class... S>
+class FilterChain;
+
+template <>
+class FilterChain<>{
+  public:
+  void reset(void) {}
+  int16_t push(int16_t x) { return x; }
+};
+
+template <class S, class... R>
+class FilterChain<S, R...>{
+  public:
+  void reset(void)
+  {
+    stage.reset();
+    rest.reset();
+  }
+
+  int16_t push(int16_t x) { return rest.push(stage.push(x)); }
+
+  private:
+  S stage;
+  FilterChain<R...> rest;
+};
+
+#endif // #ifndef FILTERS_H
@@ -61,6 +61,7 @@
 
 #include <inttypes.h>
 #include "I2C.h"
+#include "Uart.h" // Breezy: Serial is replaced by the interrupt driven uart
 
 
 
@@ -158,8 +159,7 @@ void I2C::scan()
   uint16_t tempTime = timeOutDelay;
   timeOut(80);
   uint8_t totalDevicesFound = 0;
-  Serial.println("Scanning for devices...please wait");
-  Serial.println();
+  uart.print("Scanning for devices...please wait\r\n\r\n");
   for(uint8_t s = 0; s <= 0x7F; s++)
   {
     returnStatus = 0;
@@ -172,21 +172,21 @@ void I2C::scan()
     {
       if(returnStatus == 1)
       {
-        Serial.println("There is a problem with the bus, could not complete scan");
+        uart.print("There is a problem with the bus, could not complete scan\r\n");
         timeOutDelay = tempTime;
         return;
       }
     }
     else
     {
-      Serial.print("Found device at address - ");
-      Serial.print(" 0x");
-      Serial.println(s,HEX);
+      char msg[40];
+      sprintf(msg, "Found device at address -  0x%X\r\n", s);
+      uart.print(msg);
       totalDevicesFound++;
     }
     stop();
   }
-  if(!totalDevicesFound){Serial.println("No devices found");}
+  if(!totalDevicesFound){uart.print("No devices found\r\n");}
   timeOutDelay = tempTime;
 }
 
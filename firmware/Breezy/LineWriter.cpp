@@ -0,0 +1,138 @@
+#include <Arduino.h>
+#include "LineWriter.h"
+
+static const uint16_t pow10_table[] PROGMEM = {1, 10, 100, 1000, 10000};
+
+LineWriter::LineWriter(char *buf, uint8_t size, uint8_t with_crc)
+{
+  this->buf = buf;
+  this->size = size;
+  this->with_crc = with_crc;
+  reset();
+}
+
+void LineWriter::reset(void)
+{
+  len = 0;
+  buf[0] = 0;
+  crc16.reset();
+}
+
+void LineWriter::put(char c)
+{
+  if(len + 1 >= size) return; // keep room for the terminating NUL
+  buf[len++] = c;
+  buf[len] = 0;
+  if(with_crc) crc16.update(c);
+}
+
+void LineWriter::put(const char *text)
+{
+  while(*text){
+    put(*text++);
+  }
+}
+
+// tmp holds the characters last-to-first, pad with spaces up to width
+void LineWriter::put_reversed(const char *tmp, uint8_t n, int8_t width)
+{
+  while(width > n){
+    put(' ');
+    width--;
+  }
+  while(n){
+    put(tmp[--n]);
+  }
+}
+
+// writes the decimal digits of v last-to-first, at least min_digits, returns the count
+static uint8_t digits_reversed(char *tmp, uint32_t v, uint8_t min_digits)
+{
+  uint8_t n = 0;
+  while(v > 0xFFFF){ // rare, full 32 bit division
+    tmp[n++] = '0' + (uint8_t)(v % 10);
+    v /= 10;
+  }
+  uint16_t v16 = v;
+  do{
+    uint16_t q = ((uint32_t)v16 * 0xCCCDu) >> 19; // v16 / 10 without a division, exact for 16 bits
+    tmp[n++] = '0' + (uint8_t)(v16 - q * 10);
+    v16 = q;
+  }while(v16 || n < min_digits);
+  return n;
+}
+
+void LineWriter::put_uint(uint16_t v, uint8_t width)
+{
+  char tmp[5];
+  uint8_t n = digits_reversed(tmp, v, 1);
+  put_reversed(tmp, n, width);
+}
+
+void LineWriter::put_ulong(uint32_t v)
+{
+  char tmp[10];
+  uint8_t n = digits_reversed(tmp, v, 1);
+  put_reversed(tmp, n, 0);
+}
+
+void LineWriter::put_fixed(float v, int8_t width, uint8_t prec)
+{
+  char tmp[16];
+  uint8_t n = 0;
+  
+  if(isnan(v)){
+    put_reversed("NAN", 3, width); // palindrome - order does not matter
+    return;
+  }
+  uint8_t neg = signbit(v);
+  if(neg) v = -v;
+  
+  if(isinf(v)){
+    tmp[n++] = 'F';
+    tmp[n++] = 'N';
+    tmp[n++] = 'I';
+  }else if(v >= 1e6 || prec > 4){ // more digits than a float holds - leave it to dtostrf
+    char big[24];
+    dtostrf(neg ? -v : v, width, prec, big);
+    put(big);
+    return;
+  }else{
+    // integer and fraction part separately, v - ip is exact so rounding happens only once
+    uint32_t ip = (uint32_t)v;
+    uint16_t scale = pgm_read_word(&pow10_table[prec]);
+    uint16_t fp = (uint16_t)((v - ip) * scale + 0.5f);
+    if(fp >= scale){ // rounding carried into the integer part
+      fp -= scale;
+      ip++;
+    }
+    if(prec){
+      n = digits_reversed(tmp, fp, prec);
+      tmp[n++] = '.';
+    }
+    n += digits_reversed(&tmp[n], ip, 1);
+  }
+  if(neg) tmp[n++] = '-';
+  put_reversed(tmp, n, width);
+}
+
+void LineWriter::put_ie(float i_e, uint8_t prec)
+{
+  if(i_e > 1){
+    put_fixed(i_e, 0, prec);
+    put(":1");
+  }else{
+    put("1:");
+    put_fixed(1.0 / i_e, 0, prec);
+  }
+}
+
+void LineWriter::put_crc(void)
+{
+  uint8_t crc_on = with_crc;
+  uint16_t crc = crc16.get();
+  with_crc = 0; // the checksum itself is not checksummed
+  put_uint(crc, 5);
+  put("\r\n");
+  with_crc = crc_on;
+}
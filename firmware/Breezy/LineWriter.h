@@ -0,0 +1,44 @@
+#ifndef LINEWRITER_H
+#define LINEWRITER_H
+
+#include <inttypes.h>
+#include "crc16.h"
+
+/*
+Builds a text line in a caller supplied buffer in a single pass.
+The write cursor is kept, so no field rescans the line (no strlen/strcat),
+numbers are rendered from integers (no dtostrf/sprintf), and the CRC16
+can be computed while the line is written.
+Output is the same as the dtostrf()/"%5u" chains it replaces, except that a
+value within float precision of a rounding tie may round away from zero (docs/serial_protocol.md).
+Writing past the end of the buffer is truncated, the line stays NUL terminated.
+*/
+
+class LineWriter{
+  public:
+  LineWriter(char *buf, uint8_t size, uint8_t with_crc = 0);
+
+  void reset(void); // start a new line in the same buffer
+
+  void put(char c);
+  void put(const char *text);
+  void put_uint(uint16_t v, uint8_t width); // same as sprintf("%<width>u")
+  void put_ulong(uint32_t v); // same as sprintf("%lu")
+  void put_fixed(float v, int8_t width, uint8_t prec); // same as dtostrf(v, width, prec)
+  void put_ie(float i_e, uint8_t prec = 1); // I:E ratio as "2.0:1" or "1:2.0"
+  void put_crc(void); // CRC of the line so far as "%5u", then "\r\n"
+  
+  const char *c_str(void) { return buf; }
+  uint8_t length(void) { return len; }
+  uint16_t crc(void) { return crc16.get(); }
+
+  private:
+  char *buf;
+  uint8_t size;
+  uint8_t len;
+  uint8_t with_crc;
+  CRC16 crc16;
+  void put_reversed(const char *tmp, uint8_t n, int8_t width);
+};
+
+#endif // #ifndef LINEWRITER_H
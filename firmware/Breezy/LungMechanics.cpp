@@ -0,0 +1,55 @@
+#include <Arduino.h>
+#include "LungMechanics.h"
+
+void LungMechanics::reset(void)
+{
+  n = 0;
+  e = res = p0 = 0;
+  cov[0] = cov[3] = cov[5] = MECHANICS_START_COV;
+  cov[1] = cov[2] = cov[4] = 0;
+}
+
+void LungMechanics::add(float p, float v, float q)
+{
+  if(n == 0xFFFF) return;
+  n++;
+  v *= 0.001; // l
+  // u = cov * (v, q, 1)
+  float u0 = cov[0] * v + cov[1] * q + cov[2];
+  float u1 = cov[1] * v + cov[3] * q + cov[4];
+  float u2 = cov[2] * v + cov[4] * q + cov[5];
+  float inv = 1 / (1 + v * u0 + q * u1 + u2);
+  float err = p - (e * v + res * q + p0); // a priori error
+  // gain k = u / (1 + (v, q, 1) u)
+  float k0 = u0 * inv;
+  float k1 = u1 * inv;
+  float k2 = u2 * inv;
+  e += k0 * err;
+  res += k1 * err;
+  p0 += k2 * err;
+  // cov -= k u^T, kept symmetric
+  cov[0] -= k0 * u0;
+  cov[1] -= k0 * u1;
+  cov[2] -= k0 * u2;
+  cov[3] -= k1 * u1;
+  cov[4] -= k1 * u2;
+  cov[5] -= k2 * u2;
+}
+
+uint8_t LungMechanics::estimate(float *c, float *r)
+{
+  *c = NAN;
+  *r = NAN;
+  if(n < MECHANICS_MIN_SAMPLES){
+    return 1;
+  }
+  if(!(cov[0] < MECHANICS_MAX_COV && cov[3] < MECHANICS_MAX_COV)){ // volume and flow moved together, C and R cannot be told apart
+    return 1;
+  }
+  if(!(e > 0) || res < 0){ // no lung, e.g. valve closed or sensors off
+    return 1;
+  }
+  *c = 1000 / e;
+  *r = res;
+  return 0;
+}
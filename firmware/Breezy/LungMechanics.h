@@ -0,0 +1,36 @@
+#ifndef LUNGMECHANICS_H
+#define LUNGMECHANICS_H
+
+#include <inttypes.h>
+
+/*
+Recursive least squares fit of the single compartment lung model over one inspiration
+
+  P = V / C + R * Q + P0
+
+P pressure (cmH2O), V volume since the start of inspiration (ml),
+Q flow (l/s). C is the compliance (ml/cmH2O), R the resistance (cmH2O/l/s).
+
+add() takes one sample and updates the estimate of 1/C, R and P0 and its
+3x3 covariance: about 20 float multiplies and one division, whatever the
+number of samples. estimate() can be read at any time. The volume is fitted
+in litres, so the three parameters are of a similar size in float.
+*/
+
+#define MECHANICS_MIN_SAMPLES (50) // 100 ms at SAMPLER_RATE_HZ 500
+#define MECHANICS_START_COV (1e4) // covariance of the parameters before the first sample, the prior is 0
+#define MECHANICS_MAX_COV (1e2) // the variance of 1/C and R has to shrink below this for an estimate
+
+class LungMechanics{
+  public:
+  void reset(void);
+  void add(float p, float v, float q);
+  uint8_t estimate(float *c, float *r); // 0 = ok, 1 = not enough or not fitting data
+
+  private:
+  uint16_t n;
+  float e, res, p0; // elastance (cmH2O/l), resistance, pressure at V = 0 and Q = 0
+  float cov[6]; // symmetric covariance, upper triangle: ee er ep rr rp pp
+};
+
+#endif // #ifndef LUNGMECHANICS_H
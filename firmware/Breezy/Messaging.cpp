@@ -3,119 +3,483 @@
 #include "Messaging.h"
 #include "Statistics.h"
 #include "crc16.h"
+#include "BinaryProtocol.h"
+#include "Uart.h"
+#include "LineWriter.h"
+#include "MessageFields.h"
+#include "Profiler.h"
+#include "Alarms.h"
+
+// Expanders for the field lists in MessageFields.h: each field becomes one
+// put_fixed / put_ie call followed by its comma, the same code as written by hand.
+#define PUT_FIELD_FIXED(v, width, prec) w.put_fixed(v, width, prec)
+#define PUT_FIELD_RATIO(v, width, prec) w.put_ie(v, prec)
+#define PUT_SAMPLE_FIELD(name, label, width, prec, min, max, kind, comment) \
+  PUT_FIELD_##kind(s->name, width, prec); w.put(',');
+#define PUT_BREATH_FIELD(name, label, width, prec, min, max, kind, comment) \
+  PUT_FIELD_##kind(stats.name, width, prec); w.put(',');
 
-CRC16 Crc16; //class instance for CRC
 Messaging messaging;
 
-uint8_t Messaging::poll(void)
+void Messaging::init(void)
 {
-  static uint32_t last_poll = 0;
+  format = MESSAGE_FORMAT_TEXT;
+  wave_period_ms = WAVE_PERIOD_MS;
+  seq = 0;
+  dropped = 0;
+  last_phase_changes = statistics.phase_changes;
+  queue = xQueueCreate(TELEMETRY_QUEUE_LEN, sizeof(TelemetrySample));
+}
 
+// Called by the producer (Statistics). Never blocks: when the queue is full
+// the oldest sample is thrown away to make room and counted.
+uint8_t Messaging::push(const TelemetrySample *s)
+{
+  TelemetrySample oldest;
   
-  uint32_t mil = millis();
-  
-  if(mil - last_poll < (uint32_t)MESSAGE_PERIOD_MS){ // it is not the time yet
+  if(xQueueSend(queue, s, 0) == pdPASS){
     return 0;
   }
-  
-  last_poll += (uint32_t)MESSAGE_PERIOD_MS;
+  xQueueReceive(queue, &oldest, 0);
+  dropped++;
+  xQueueSend(queue, s, 0);
+  return 1;
+}
 
+// Returns 1 once per period. When it falls more than a period behind
+// (e.g. the period was just changed) it resynchronizes instead of bursting.
+static uint8_t is_due(uint32_t *last, uint32_t mil, uint16_t period_ms)
+{
+  if(mil - *last < period_ms){ // it is not the time yet
+    return 0;
+  }
+  *last += period_ms;
+  if(mil - *last >= period_ms){
+    *last = mil;
+  }
+  return 1;
+}
+
+// Telemetry task body: waits for the next sample, then formats and queues
+// whatever messages are due at the sample's time.
+uint8_t Messaging::poll(void)
+{
+  TelemetrySample s;
   
-  
-  print_msg();
-  print_service_msg();
-  
+  if(xQueueReceive(queue, &s, portMAX_DELAY) != pdPASS){
+    return 0;
+  }
+
+  uint32_t start_us = micros();
+  statistics.read(&stats); // at least as new as the sample
+  send_due(&s);
+  profiler.add(PROFILE_MESSAGING, start_us);
   return 1;
+}
+
+void Messaging::send_due(const TelemetrySample *s)
+{
+  static uint32_t last_poll = 0;
+  static uint32_t last_wave = 0;
+  static uint32_t last_profile = 0;
+  static uint32_t last_alarm = 0;
+  static uint16_t sent_active = 0, sent_latched = 0;
+
+  if(format != MESSAGE_FORMAT_TEXT){
+    // the summary values change only at the inspiration / expiration transitions
+    if(s->phase_changes != last_phase_changes){
+      last_phase_changes = s->phase_changes;
+      if(format == MESSAGE_FORMAT_BINARY){
+        print_bin_breath(s);
+      }else{
+        print_summary_msg(s);
+      }
+    }
+    
+    if(wave_period_ms < STATISTICS_PERIOD_MS){ // no point sending samples faster than they are taken
+      wave_period_ms = STATISTICS_PERIOD_MS;
+    }
+    if(is_due(&last_wave, s->ms, wave_period_ms)){
+      if(format == MESSAGE_FORMAT_BINARY){
+        print_bin_sample(s);
+      }else{
+        print_wave_msg(s);
+      }
+    }
+  }
+
+  // at once when an alarm changes, repeated while one is latched
+  uint16_t active, latched;
+  alarms.get(&active, &latched);
+  uint8_t alarm_due = is_due(&last_alarm, s->ms, ALARM_PERIOD_MS) && latched;
+  if(alarm_due || active != sent_active || latched != sent_latched){
+    sent_active = active;
+    sent_latched = latched;
+    if(format == MESSAGE_FORMAT_BINARY){
+      print_bin_alarm(s, active, latched);
+    }else{
+      print_alarm_msg(s, active, latched);
+    }
+  }
+
+  if(is_due(&last_profile, s->ms, PROFILE_PERIOD_MS)){
+    if(format == MESSAGE_FORMAT_BINARY){
+      print_bin_profile(s);
+    }else{
+      print_profile_msg(s);
+    }
+  }
   
+  if(!is_due(&last_poll, s->ms, MESSAGE_PERIOD_MS)){
+    return;
+  }
+  profiler.late(PROFILE_JITTER_MESSAGE, millis() - last_poll); // last_poll is the time it was due
+
+  if(format == MESSAGE_FORMAT_BINARY){
+    print_bin_service(s);
+  }else{
+    if(format == MESSAGE_FORMAT_TEXT){
+      print_msg(s);
+    }
+    print_service_msg(s);
+  }
 }
 
 
-uint8_t Messaging::print_msg(void)
+uint8_t Messaging::print_msg(const TelemetrySample *s)
 {
-  uint16_t time = (uint16_t)millis();
+  uint16_t time = (uint16_t)s->ms;
 
-  char msg[200];
-  sprintf(msg, "breezy,1,%5u,", time );
+  char msg[128];
+  LineWriter w(msg, sizeof(msg), 1);
+  w.put("breezy,1,");
+  w.put_uint(time, 5);
+  w.put(',');
   
-  dtostrf(statistics.p_act, 5, 2, &msg[strlen(msg)]);
-  strcat(msg, ",");
+  BREEZY_MSG_LAYOUT(PUT_SAMPLE_FIELD, PUT_BREATH_FIELD)
+
+  w.put_crc();
+  if ( profiler.take( xSerialSemaphore, ( TickType_t ) 5, PROFILE_SERIAL_WAIT ) == pdTRUE )
+  {
+    uart.write((const uint8_t *)msg, w.length()); // queued, never waits for the wire
+    xSemaphoreGive( xSerialSemaphore ); // Now free or "Give" the Serial Port for others.
+  }
   
-  dtostrf(statistics.slm, 5, 2, &msg[strlen(msg)]);
-  strcat(msg, ",");
+  return 0;
+}
 
-  dtostrf(statistics.slm_sum, 5, 2, &msg[strlen(msg)]);
-  strcat(msg, ",");
+uint8_t Messaging::print_wave_msg(const TelemetrySample *s)
+{
+  uint16_t time = (uint16_t)s->ms;
 
-  dtostrf(statistics.p_peak, 5, 1, &msg[strlen(msg)]);
-  strcat(msg, ",");
-  
-  dtostrf(statistics.p_mean, 2, 0, &msg[strlen(msg)]);
-  strcat(msg, ",");
+  char msg[64];
+  LineWriter w(msg, sizeof(msg), 1);
+  w.put("wave,1,");
+  w.put_uint(time, 5);
+  w.put(',');
   
-  dtostrf(statistics.peep, 2, 0, &msg[strlen(msg)]);
-  strcat(msg, ",");
+  WAVE_MSG_LAYOUT(PUT_SAMPLE_FIELD, PUT_BREATH_FIELD)
+
+  w.put_crc();
+  if ( profiler.take( xSerialSemaphore, ( TickType_t ) 5, PROFILE_SERIAL_WAIT ) == pdTRUE )
+  {
+    uart.write((const uint8_t *)msg, w.length()); // queued, never waits for the wire
+    xSemaphoreGive( xSerialSemaphore ); // Now free or "Give" the Serial Port for others.
+  }
   
-  dtostrf(statistics.rr, 2, 0, &msg[strlen(msg)]);
-  strcat(msg, ",");
+  return 0;
+}
+
+uint8_t Messaging::print_summary_msg(const TelemetrySample *s)
+{
+  uint16_t time = (uint16_t)s->ms;
+
+  char msg[128];
+  LineWriter w(msg, sizeof(msg), 1);
+  w.put("summary,1,");
+  w.put_uint(time, 5);
+  w.put(',');
+
+  SUMMARY_MSG_LAYOUT(PUT_SAMPLE_FIELD, PUT_BREATH_FIELD)
+
+  w.put_crc();
+  if ( profiler.take( xSerialSemaphore, ( TickType_t ) 5, PROFILE_SERIAL_WAIT ) == pdTRUE )
+  {
+    uart.write((const uint8_t *)msg, w.length()); // queued, never waits for the wire
+    xSemaphoreGive( xSerialSemaphore ); // Now free or "Give" the Serial Port for others.
+  }
   
-  dtostrf(statistics.o2_perc, 3, 0, &msg[strlen(msg)]);
-  strcat(msg, ",");
+  return 0;
+}
+
+uint8_t Messaging::print_service_msg(const TelemetrySample *s)
+{
+  uint16_t time = (uint16_t)s->ms;
+
+  char msg[64];
+  LineWriter w(msg, sizeof(msg), 1);
+  w.put("service,1,");
+  w.put_uint(time, 5);
+  w.put(',');
   
-  dtostrf(statistics.ti, 5, 2, &msg[strlen(msg)]);
-  strcat(msg, ",");
+  w.put_fixed(s->p_o2, 5, 2);
+  w.put(',');
 
-  if(statistics.i_e > 1){
-    dtostrf(statistics.i_e, 0, 1, &msg[strlen(msg)]);
-    sprintf(&msg[strlen(msg)], ":1" );
-  }else{
-    sprintf(&msg[strlen(msg)], "1:" );
-    dtostrf(1.0 / statistics.i_e, 0, 1, &msg[strlen(msg)]);
+  w.put_uint(s->is_i, 0);
+  w.put(',');
+  w.put_uint(uart.tx_dropped, 0);
+  w.put(',');
+  w.put_uint(uart.tx_high_watermark, 0);
+  w.put(',');
+  w.put_uint(dropped, 0);
+  w.put(',');
+
+  w.put_crc();
+  if ( profiler.take( xSerialSemaphore, ( TickType_t ) 5, PROFILE_SERIAL_WAIT ) == pdTRUE )
+  {
+    uart.write((const uint8_t *)msg, w.length()); // queued, never waits for the wire
+    xSemaphoreGive( xSerialSemaphore ); // Now free or "Give" the Serial Port for others.
   }
-  strcat(msg, ",");
+  return 0;
+}
 
-  dtostrf(statistics.mvi, 4, 1, &msg[strlen(msg)]);
-  strcat(msg, ",");
+// Run time counters of the last PROFILE_PERIOD_MS, see Profiler.h
+uint8_t Messaging::print_profile_msg(const TelemetrySample *s)
+{
+  static ProfileReport r; // only the telemetry task gets here, keeps it off the stack
+  profiler.report(&r);
 
-  dtostrf(statistics.mve, 4, 1, &msg[strlen(msg)]);
-  strcat(msg, ",");
+  char msg[255]; // the longest line: 6 digit sections (PROFILE_MAX_US), at most 100 jitter counts a period, 4 digit stacks
+  LineWriter w(msg, sizeof(msg), 1);
+  w.put("profile,1,");
+  w.put_uint((uint16_t)s->ms, 5);
+  w.put(',');
 
-  dtostrf(statistics.vti, 3, 0, &msg[strlen(msg)]);
-  strcat(msg, ",");
+  for(uint8_t i = 0; i < PROFILE_SECTIONS; i++){
+    w.put_ulong(r.min_us[i]);
+    w.put(',');
+    w.put_ulong(r.avg_us[i]);
+    w.put(',');
+    w.put_ulong(r.max_us[i]);
+    w.put(',');
+  }
+  for(uint8_t j = 0; j < PROFILE_JITTERS; j++){
+    for(uint8_t i = 0; i < PROFILE_JITTER_BINS; i++){
+      w.put_uint(r.jitter[j][i], 0);
+      w.put(',');
+    }
+  }
+  for(uint8_t i = 0; i < PROFILE_TASKS; i++){
+    w.put_uint(r.stack_free[i], 0);
+    w.put(',');
+  }
 
-  dtostrf(statistics.vte, 3, 0, &msg[strlen(msg)]);
-  strcat(msg, ",");
+  w.put_crc();
+  if ( profiler.take( xSerialSemaphore, ( TickType_t ) 5, PROFILE_SERIAL_WAIT ) == pdTRUE )
+  {
+    uart.write((const uint8_t *)msg, w.length()); // queued, never waits for the wire
+    xSemaphoreGive( xSerialSemaphore ); // Now free or "Give" the Serial Port for others.
+  }
+  return 0;
+}
 
-  uint16_t crc = Crc16.get_crc16(msg);
+// alarm,1,<time>,<active>,<latched> - bit masks of ALARM_*
+uint8_t Messaging::print_alarm_msg(const TelemetrySample *s, uint16_t active, uint16_t latched)
+{
+  char msg[32];
+  LineWriter w(msg, sizeof(msg), 1);
+  w.put("alarm,1,");
+  w.put_uint((uint16_t)s->ms, 5);
+  w.put(',');
+  w.put_uint(active, 0);
+  w.put(',');
+  w.put_uint(latched, 0);
+  w.put(',');
 
-  sprintf(&msg[strlen(msg)], "%5u\r\n", crc);
-  if ( xSemaphoreTake( xSerialSemaphore, ( TickType_t ) 5 ) == pdTRUE )
+  w.put_crc();
+  if ( profiler.take( xSerialSemaphore, ( TickType_t ) 5, PROFILE_SERIAL_WAIT ) == pdTRUE )
   {
-    Serial.print(msg);
+    uart.write((const uint8_t *)msg, w.length()); // queued, never waits for the wire
     xSemaphoreGive( xSerialSemaphore ); // Now free or "Give" the Serial Port for others.
   }
-  
   return 0;
 }
 
-uint8_t Messaging::print_service_msg(void)
+uint8_t Messaging::print_bin_sample(const TelemetrySample *s)
 {
-  uint16_t time = (uint16_t)millis();
+  BinSample f;
+  f.h.type = BIN_TYPE_SAMPLE;
+  f.h.time = (uint16_t)s->ms;
+  f.p_act = bin_s16(s->p_act, 100);
+  f.slm = bin_s16(s->slm, 100);
+  f.slm_sum = bin_s16(s->slm_sum, 10);
+  return send_frame((uint8_t *)&f, sizeof(f));
+}
+
+uint8_t Messaging::print_bin_breath(const TelemetrySample *s)
+{
+  BinBreath f;
+  f.h.type = BIN_TYPE_BREATH;
+  f.h.time = (uint16_t)s->ms;
+  f.p_peak = bin_u16(stats.p_peak, 10);
+  f.p_mean = bin_u8(stats.p_mean, 1);
+  f.peep = bin_u8(stats.peep, 1);
+  f.rr = bin_u8(stats.rr, 1);
+  f.o2_perc = bin_u8(stats.o2_perc, 1);
+  f.ti = bin_u16(stats.ti, 100);
+  f.i_e = bin_u16(stats.i_e, 100);
+  f.mvi = bin_u16(stats.mvi, 10);
+  f.mve = bin_u16(stats.mve, 10);
+  f.vti = bin_u16(stats.vti, 1);
+  f.vte = bin_u16(stats.vte, 1);
+  f.compliance = bin_u16(stats.compliance, 10);
+  f.resistance = bin_u16(stats.resistance, 10);
+  f.p_plat = bin_s16(stats.p_plat, 10);
+  f.peep_tot = bin_s16(stats.peep_tot, 10);
+  return send_frame((uint8_t *)&f, sizeof(f));
+}
 
-  char msg[200];
-  sprintf(msg, "service,1,%5u,", time );
+uint8_t Messaging::print_bin_service(const TelemetrySample *s)
+{
+  BinService f;
+  f.h.type = BIN_TYPE_SERVICE;
+  f.h.time = (uint16_t)s->ms;
+  f.p_o2 = bin_s16(s->p_o2, 10);
+  f.is_i = s->is_i;
+  f.tx_dropped = uart.tx_dropped;
+  f.tx_high_watermark = uart.tx_high_watermark;
+  f.telemetry_dropped = dropped;
+  return send_frame((uint8_t *)&f, sizeof(f));
+}
+
+uint8_t Messaging::print_bin_profile(const TelemetrySample *s)
+{
+  static ProfileReport r;
+  BinProfile f;
+  profiler.report(&r);
+  f.h.type = BIN_TYPE_PROFILE;
+  f.h.time = (uint16_t)s->ms;
+  for(uint8_t i = 0; i < PROFILE_SECTIONS; i++){
+    f.section[i][0] = bin_u16(r.min_us[i], 0.1);
+    f.section[i][1] = bin_u16(r.avg_us[i], 0.1);
+    f.section[i][2] = bin_u16(r.max_us[i], 0.1);
+  }
+  memcpy(f.jitter, r.jitter, sizeof(f.jitter));
+  memcpy(f.stack_free, r.stack_free, sizeof(f.stack_free));
+  return send_frame((uint8_t *)&f, sizeof(f));
+}
+
+uint8_t Messaging::print_bin_alarm(const TelemetrySample *s, uint16_t active, uint16_t latched)
+{
+  BinAlarm f;
+  f.h.type = BIN_TYPE_ALARM;
+  f.h.time = (uint16_t)s->ms;
+  f.active = active;
+  f.latched = latched;
+  return send_frame((uint8_t *)&f, sizeof(f));
+}
+
+// Sends a text line (with its own checksum and line end) in the current format.
+// In the binary format the line is wrapped in a text frame, so it does not break the framing.
+// A line longer than a text frame holds is not sent in either format (2), a cut line
+// would lose its checksum and line end.
+uint8_t Messaging::print_line(const char *line, uint8_t len)
+{
+  if(len > BIN_MAX_TEXT){
+    return 2;
+  }
+  if(format == MESSAGE_FORMAT_BINARY){
+    uint8_t payload[BIN_MAX_PAYLOAD];
+    BinHeader *h = (BinHeader *)payload;
+    h->type = BIN_TYPE_TEXT;
+    h->time = (uint16_t)millis();
+    memcpy(&payload[sizeof(BinHeader)], line, len);
+    return send_frame(payload, sizeof(BinHeader) + len);
+  }
   
-  dtostrf(statistics.p_o2, 5, 2, &msg[strlen(msg)]);
-  strcat(msg, ",");
+  uint8_t ret = 1;
+  if ( profiler.take( xSerialSemaphore, ( TickType_t ) 5, PROFILE_SERIAL_WAIT ) == pdTRUE )
+  {
+    ret = uart.write((const uint8_t *)line, len); // queued, never waits for the wire
+    xSemaphoreGive( xSerialSemaphore ); // Now free or "Give" the Serial Port for others.
+  }
+  return ret;
+}
+
+// Breath history for the breaths command: one frame in the binary format,
+// otherwise one breathlog,1 line per record
+uint8_t Messaging::print_breath_log(uint16_t number, const BreathRecord *r, uint8_t count)
+{
+  uint16_t time = (uint16_t)millis();
+  uint8_t ret = 0;
+
+  if(format == MESSAGE_FORMAT_BINARY){
+    BinBreathLog f;
+    f.h.type = BIN_TYPE_BREATH_LOG;
+    f.h.time = time;
+    f.number = number;
+    f.count = count;
+    memcpy(f.r, r, count * sizeof(BreathRecord));
+    return send_frame((uint8_t *)&f, sizeof(f) - (BIN_BREATH_LOG_RECORDS - count) * sizeof(BreathRecord));
+  }
 
-  sprintf(&msg[strlen(msg)], "%u,", statistics.is_i);  
+  for(uint8_t i = 0; i < count; i++, r++){
+    char msg[96];
+    LineWriter w(msg, sizeof(msg), 1);
+    w.put("breathlog,1,");
+    w.put_uint(time, 0);
+    w.put(',');
+    w.put_uint(number + i, 0);
+    w.put(',');
+    w.put_uint(r->end_s, 0);
+    w.put(',');
+    w.put_fixed(r->p_peak == BIN_NAN_S16 ? NAN : r->p_peak * 0.1, 0, 1);
+    w.put(',');
+    w.put_fixed(r->p_mean == BIN_NAN_S16 ? NAN : r->p_mean * 0.1, 0, 1);
+    w.put(',');
+    w.put_fixed(r->peep == BIN_NAN_S16 ? NAN : r->peep * 0.1, 0, 1);
+    w.put(',');
+    w.put_fixed(r->vti == BIN_NAN_U16 ? NAN : r->vti, 0, 0);
+    w.put(',');
+    w.put_fixed(r->vte == BIN_NAN_U16 ? NAN : r->vte, 0, 0);
+    w.put(',');
+    w.put_fixed(r->ti == BIN_NAN_U16 ? NAN : r->ti * 0.01, 0, 2);
+    w.put(',');
+    w.put_fixed(r->te == BIN_NAN_U16 ? NAN : r->te * 0.01, 0, 2);
+    w.put(',');
+    w.put_crc();
+    ret |= print_line(w.c_str(), w.length());
+  }
+  return ret;
+}
 
-  uint16_t crc = Crc16.get_crc16(msg);
+// Appends the CRC, COBS-encodes the payload and sends it terminated by 0x00.
+// Called from several tasks, so everything shared is done holding xSerialSemaphore.
+// The buffers are static, used only holding it: 206 bytes less on the stack of every caller.
+uint8_t Messaging::send_frame(uint8_t *payload, uint8_t len)
+{
+  static uint8_t buf[BIN_MAX_PAYLOAD + 2];
+  static uint8_t frame[BIN_MAX_FRAME];
+  CRC16 crc16;
+  uint8_t ret = 1;
 
-  sprintf(&msg[strlen(msg)], "%5u\r\n", crc);  
-  if ( xSemaphoreTake( xSerialSemaphore, ( TickType_t ) 5 ) == pdTRUE )
+  if ( profiler.take( xSerialSemaphore, ( TickType_t ) 5, PROFILE_SERIAL_WAIT ) == pdTRUE )
   {
-    Serial.print(msg);
+    ((BinHeader *)payload)->seq = seq++;
+    
+    crc16.reset();
+    crc16.update((const char *)payload, len);
+    uint16_t crc = crc16.get();
+    
+    memcpy(buf, payload, len);
+    buf[len] = lowByte(crc);
+    buf[len + 1] = highByte(crc);
+
+    uint8_t n = cobs_encode(buf, len + 2, frame);
+    frame[n++] = 0;
+  
+    ret = uart.write(frame, n);
     xSemaphoreGive( xSerialSemaphore ); // Now free or "Give" the Serial Port for others.
   }
-  return 0;
+  return ret;
 }
@@ -1,16 +1,61 @@
-
 #ifndef MESSAGING_H
 #define MESSAGING_H
 
+#include <Arduino_FreeRTOS.h>
+#include <queue.h>
+#include "Statistics.h"
+#include "BreathLog.h"
+
+// message formats, selected at runtime (see docs/serial_protocol.md)
+#define MESSAGE_FORMAT_TEXT 1 // "breezy,1,..." text lines
+#define MESSAGE_FORMAT_BINARY 2 // COBS framed binary protocol version 2
+#define MESSAGE_FORMAT_WAVE 3 // "wave,1,..." text lines + "summary,1,..." once per phase
+
+// One sample handed from Statistics to the telemetry task.
+// The per-breath values come from the statistics snapshot.
+struct TelemetrySample{
+  uint32_t ms; // millis() when the sample was taken
+  float p_act; // actual pressure (cmH2O)
+  float slm; // flow (l/min)
+  float slm_sum; // volume (ml)
+  float p_o2; // O2 supply pressure (kPa)
+  uint8_t is_i; // is inspiration
+  uint8_t phase_changes; // statistics.phase_changes at the time of the sample
+};
 
 class Messaging{
   public:
-  uint8_t print_msg(void);
-  uint8_t print_service_msg(void);
+  uint8_t format; // MESSAGE_FORMAT_*
+  uint16_t wave_period_ms; // waveform rate for MESSAGE_FORMAT_WAVE and _BINARY
+  uint16_t dropped; // samples thrown away because the telemetry task fell behind
+
+  void init(void);
+  uint8_t print_msg(const TelemetrySample *s);
+  uint8_t print_service_msg(const TelemetrySample *s);
+  uint8_t print_wave_msg(const TelemetrySample *s);
+  uint8_t print_summary_msg(const TelemetrySample *s);
+  uint8_t print_profile_msg(const TelemetrySample *s);
+  uint8_t print_alarm_msg(const TelemetrySample *s, uint16_t active, uint16_t latched);
+
+  uint8_t print_bin_sample(const TelemetrySample *s);
+  uint8_t print_bin_breath(const TelemetrySample *s);
+  uint8_t print_bin_service(const TelemetrySample *s);
+  uint8_t print_bin_profile(const TelemetrySample *s);
+  uint8_t print_bin_alarm(const TelemetrySample *s, uint16_t active, uint16_t latched);
   
-  uint8_t poll(void);
+  uint8_t print_line(const char *line, uint8_t len); // any task, e.g. command responses; 2 = longer than BIN_MAX_TEXT
+  uint8_t print_breath_log(uint16_t number, const BreathRecord *r, uint8_t count); // count <= BIN_BREATH_LOG_RECORDS
+
+  uint8_t push(const TelemetrySample *s); // producer side, never blocks
+  uint8_t poll(void); // telemetry task, blocks until the next sample
 
   private:
+  QueueHandle_t queue;
+  uint8_t seq; // binary frame sequence number
+  uint8_t last_phase_changes; // statistics.phase_changes when the last summary was sent
+  StatisticsSnapshot stats; // per-breath values for the messages, read with each sample
+  uint8_t send_frame(uint8_t *payload, uint8_t len);
+  void send_due(const TelemetrySample *s);
   
 };
 
@@ -0,0 +1,92 @@
+#include <Arduino.h>
+#include <util/atomic.h>
+#include "Configuration.h"
+#include "Profiler.h"
+
+Profiler profiler;
+
+void Profiler::init(void)
+{
+  for(uint8_t i = 0; i < PROFILE_TASKS; i++){
+    tasks[i] = NULL;
+  }
+  restart();
+}
+
+void Profiler::restart(void)
+{
+  for(uint8_t i = 0; i < PROFILE_SECTIONS; i++){
+    sections[i].min_us = 0xFFFFFFFF;
+    sections[i].max_us = 0;
+    sections[i].sum_us = 0;
+    sections[i].count = 0;
+  }
+  memset(jitter, 0, sizeof(jitter));
+}
+
+// Sections are timed from several tasks, the update is short enough to do with interrupts off
+void Profiler::add(uint8_t section, uint32_t start_us)
+{
+  uint32_t us = micros() - start_us;
+  ProfileSection *s = &sections[section];
+
+  if(us > PROFILE_MAX_US) us = PROFILE_MAX_US;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+    if(us < s->min_us) s->min_us = us;
+    if(us > s->max_us) s->max_us = us;
+    if(s->count < 0xFFFF){
+      s->sum_us += us;
+      s->count++;
+    }
+  }
+}
+
+void Profiler::late(uint8_t which, uint32_t late_ms)
+{
+  uint8_t bin = 0;
+  while(late_ms && bin < PROFILE_JITTER_BINS - 1){ // bin = number of significant bits
+    late_ms >>= 1;
+    bin++;
+  }
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+    if(jitter[which][bin] < 0xFFFF) jitter[which][bin]++;
+  }
+}
+
+BaseType_t Profiler::take(SemaphoreHandle_t sem, TickType_t ticks, uint8_t section)
+{
+  uint32_t start = micros();
+  BaseType_t ret = xSemaphoreTake(sem, ticks);
+  add(section, start);
+  return ret;
+}
+
+void Profiler::report(ProfileReport *r)
+{
+  ProfileSection copy[PROFILE_SECTIONS];
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE){ // only copy with interrupts off, the divisions are slow
+    memcpy(copy, sections, sizeof(copy));
+    memcpy(r->jitter, jitter, sizeof(jitter));
+    restart();
+  }
+
+  for(uint8_t i = 0; i < PROFILE_SECTIONS; i++){
+    ProfileSection *s = &copy[i];
+    r->min_us[i] = s->count ? s->min_us : 0;
+    r->max_us[i] = s->max_us;
+    r->avg_us[i] = s->count ? s->sum_us / s->count : 0;
+  }
+
+  for(uint8_t i = 0; i < PROFILE_TASKS; i++){
+    if(!tasks[i]){
+      r->stack_free[i] = 0;
+      continue;
+    }
+#if defined(INCLUDE_uxTaskGetStackHighWaterMark2) && INCLUDE_uxTaskGetStackHighWaterMark2
+    r->stack_free[i] = uxTaskGetStackHighWaterMark2(tasks[i]);
+#else
+    r->stack_free[i] = uxTaskGetStackHighWaterMark(tasks[i]); // UBaseType_t, wraps above 255 on AVR
+#endif
+  }
+}
@@ -0,0 +1,78 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <inttypes.h>
+#include <Arduino_FreeRTOS.h>
+#include <semphr.h>
+
+/*
+Run time counters, reported every PROFILE_PERIOD_MS in the profile message
+(see docs/serial_protocol.md). All counters except the stack high water
+marks restart after each report.
+
+sections: min / avg / max duration in us (micros(), 4 us resolution),
+          at most PROFILE_MAX_US so the text line has a bounded length
+jitter: how late the statistics and message periods fire, histogram with
+        bins 0, 1, 2-3, 4-7, 8-15, 16-31, 32-63, 64+ ms
+stacks: uxTaskGetStackHighWaterMark() of each task, bytes never used
+*/
+
+// timed sections
+#define PROFILE_STATISTICS 0 // Statistics::poll, one batch of samples
+#define PROFILE_MESSAGING 1 // Messaging::poll, one sample
+#define PROFILE_DISPLAY 2 // Display::poll, one redraw
+#define PROFILE_SERIAL_WAIT 3 // waiting for xSerialSemaphore
+#define PROFILE_SNAPSHOT_READ 4 // Statistics::read, including retries
+#define PROFILE_ALARMS 5 // Alarms::sample, all rules once per batch
+#define PROFILE_SECTIONS 6
+#define PROFILE_MAX_US (999999UL)
+
+// periods watched for jitter
+#define PROFILE_JITTER_STATISTICS 0 // STATISTICS_PERIOD_MS
+#define PROFILE_JITTER_MESSAGE 1 // MESSAGE_PERIOD_MS
+#define PROFILE_JITTERS 2
+#define PROFILE_JITTER_BINS 8
+
+// tasks, handles are stored by xTaskCreate
+#define PROFILE_TASK_LCD 0
+#define PROFILE_TASK_VENTILATOR 1
+#define PROFILE_TASK_VALVE 2
+#define PROFILE_TASK_TELEMETRY 3
+#define PROFILE_TASK_COMMAND 4
+#define PROFILE_TASKS 5
+
+struct ProfileSection{
+  uint32_t min_us;
+  uint32_t max_us;
+  uint32_t sum_us;
+  uint16_t count;
+};
+
+// One report, copied out so the counters can keep running
+struct ProfileReport{
+  uint32_t min_us[PROFILE_SECTIONS]; // 0 when the section did not run
+  uint32_t avg_us[PROFILE_SECTIONS];
+  uint32_t max_us[PROFILE_SECTIONS];
+  uint16_t jitter[PROFILE_JITTERS][PROFILE_JITTER_BINS];
+  uint16_t stack_free[PROFILE_TASKS];
+};
+
+class Profiler{
+  public:
+  TaskHandle_t tasks[PROFILE_TASKS];
+
+  void init(void);
+  void add(uint8_t section, uint32_t start_us); // adds micros() - start_us
+  void late(uint8_t which, uint32_t late_ms); // PROFILE_JITTER_* period fired late_ms after it was due
+  BaseType_t take(SemaphoreHandle_t sem, TickType_t ticks, uint8_t section); // xSemaphoreTake, timed
+  void report(ProfileReport *r); // copies the counters and restarts them
+
+  private:
+  ProfileSection sections[PROFILE_SECTIONS];
+  uint16_t jitter[PROFILE_JITTERS][PROFILE_JITTER_BINS];
+  void restart(void);
+};
+
+extern Profiler profiler;
+
+#endif // #ifndef PROFILER_H
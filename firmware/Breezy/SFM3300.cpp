@@ -1,8 +1,21 @@
 
 #include <Arduino.h>
-#include "I2C.h"
+#include "Configuration.h"
 #include "SFM3300.h"
 
+SFM3300 sfm; //class instance for flow sensor
+
+#define SFM3300_ADDRESS 64
+#define SFM3300_CMD_START_H 0x10 // start continuous measurement, 0x1000
+#define SFM3300_CMD_START_L 0x00
+
+#define OFF_TICKS ((uint32_t)SFM3300_OFF_MS * SAMPLER_RATE_HZ / 1000)
+#define STARTUP_TICKS ((uint32_t)SFM3300_STARTUP_MS * SAMPLER_RATE_HZ / 1000)
+#if SFM3300_OFF_MS * SAMPLER_RATE_HZ / 1000 < 1 || SFM3300_OFF_MS * SAMPLER_RATE_HZ / 1000 > 255 \
+ || SFM3300_STARTUP_MS * SAMPLER_RATE_HZ / 1000 < 1 || SFM3300_STARTUP_MS * SAMPLER_RATE_HZ / 1000 > 255
+#error SFM3300_OFF_MS and SFM3300_STARTUP_MS must be 1 to 255 sampler ticks
+#endif
+
 // SFM3300's GND pin connects to D19. By bringing it to HIGH, we turn off power to the sensor.
 // The sensor cannot leak current from I2C, since I2C has PULLUPS. We need to reset I2C interface too
 // to ensure the I2C pins are not active low ?
@@ -10,40 +23,141 @@
 #define SFM3300_POWER_ON() digitalWrite(19, LOW)
 #define SFM3300_POWER_OFF() digitalWrite(19, HIGH)
 
+// STOP, interrupt off until the next transfer
+#define TWI_STOP() (TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWSTO) | _BV(TWEA))
 
-uint8_t SFM3300::init()
+void SFM3300::begin(void)
 {
+  errors = 0;
+  crc_errors = 0;
+  restarts = 0;
+  failed = 0;
+  age = 0xFF;
+  busy = 0;
   SFM3300_POWER_INIT();
-  SFM3300_POWER_OFF();
-  delay(100);
-  SFM3300_POWER_ON();
-  delay(110);
+  power(SFM3300_OFF, OFF_TICKS);
+}
+
+void SFM3300::power(uint8_t s, uint8_t ticks)
+{
+  if(s == SFM3300_OFF){
+    SFM3300_POWER_OFF();
+  }else{
+    SFM3300_POWER_ON();
+  }
+  state = s;
+  wait = ticks;
+}
+
+void SFM3300::fail(void)
+{
+  errors++;
+  if(failed < 0xFF) failed++;
+}
+
+void SFM3300::tick(void)
+{
+  if(age < 0xFF) age++;
+
+  if(busy){ // not complete within a period, the bus is stuck
+    TWCR = _BV(TWEN) | _BV(TWSTO) | _BV(TWINT);
+    busy = 0;
+    fail();
+  }
 
-  // TODO try to remove delays.. In real application it is not acceptable!
+  if(failed >= SAMPLER_FLOW_RETRIES && state != SFM3300_OFF && state != SFM3300_STARTING){
+    restarts++;
+    power(SFM3300_OFF, OFF_TICKS);
+  }
 
-  slm_sum_raw = 0;
-  slm_sum = 0;
-  uint8_t ret = 0;
+  switch(state){
+    case SFM3300_OFF:
+      if(--wait == 0){
+        power(SFM3300_STARTING, STARTUP_TICKS);
+      }
+      return;
+    case SFM3300_STARTING:
+      if(--wait == 0){
+        failed = 0;
+        state = SFM3300_START;
+      }
+      return;
+    default: // START, WARMUP, MEASURING: one transfer per tick
+      writing = state == SFM3300_START;
+      busy = 1;
+      TWCR = _BV(TWINT) | _BV(TWSTA) | _BV(TWEN) | _BV(TWIE);
+      return;
+  }
+}
 
-  ret = I2c.write(64, 0x10, 0); // address
-  
-  return ret;
+// start command: START, SLA+W, 2 bytes, STOP
+// read: START, SLA+R, 2 bytes ACKed, the CRC byte NACKed, STOP
+uint8_t SFM3300::twi_isr(void)
+{
+  switch(TWSR & 0xF8){
+    case 0x08: // START sent
+    case 0x10: // repeated START sent
+      TWDR = (SFM3300_ADDRESS << 1) | (writing ? 0 : 1);
+      count = 0;
+      TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE);
+      return 0;
+    case 0x18: // SLA+W ACKed
+    case 0x28: // data byte sent, ACKed
+      if(count < 2){
+        TWDR = count ? SFM3300_CMD_START_L : SFM3300_CMD_START_H;
+        count++;
+        TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE);
+      }else{
+        TWI_STOP();
+        busy = 0;
+        failed = 0;
+        state = SFM3300_WARMUP;
+      }
+      return 0;
+    case 0x40: // SLA+R ACKed
+      TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE) | _BV(TWEA);
+      return 0;
+    case 0x50: // byte received, ACK sent
+      data[count++] = TWDR;
+      if(count < 2){
+        TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE) | _BV(TWEA);
+      }else{
+        TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE); // NACK the last byte
+      }
+      return 0;
+    case 0x58: // last byte received, NACK sent
+      data[count++] = TWDR;
+      TWI_STOP();
+      busy = 0;
+      if(crc8(data, 2) != data[2]){
+        crc_errors++;
+        fail();
+        return 0;
+      }
+      failed = 0;
+      if(state == SFM3300_WARMUP){
+        state = SFM3300_MEASURING;
+        return 0;
+      }
+      raw = ((uint16_t)data[0] << 8) | data[1];
+      age = 0;
+      return 1;
+    default: // SLA not ACKed, data not ACKed, arbitration lost, bus error
+      TWI_STOP();
+      busy = 0;
+      fail();
+      return 0;
+  }
 }
 
-uint8_t SFM3300::measure()
+uint8_t SFM3300::crc8(const uint8_t *d, uint8_t n)
 {
-  uint16_t f_raw = 0;
-  uint8_t ret = 0;
-  uint8_t data[3];
-  ret = I2c.read(64, 3, data);
-  if(ret == 0){
-    f_raw = (data[0] << 8);
-    f_raw |= data[1];
-    uint8_t crc = data[2]; // TODO check CRC
-    slm = (((float)f_raw) - 32768)/120;
-    slm_sum_raw += ((long int)f_raw)-32768;
-    slm_sum = slm_sum_raw / 120;
-    slm_sum = slm_sum*1000/60/50;
+  uint8_t crc = 0;
+  while(n--){
+    crc ^= *d++;
+    for(uint8_t i = 0; i < 8; i++){
+      crc = (crc & 0x80) ? (crc << 1) ^ 0x31 : crc << 1;
+    }
   }
-  return ret;
+  return crc;
 }
@@ -3,17 +3,61 @@
 
 
 #include <inttypes.h>
+#include "Configuration.h"
+
+// raw value -> slm: (raw - SFM3300_OFFSET) / SFM3300_SCALE
+#define SFM3300_OFFSET 32768
+#define SFM3300_SCALE 120
+
+/*
+Non-blocking SFM3300 driver, run by the sampler interrupts: tick() once per
+sampler tick (Timer3), twi_isr() on each TWI event. No call waits, each one
+takes a single step, so a sensor fault never holds up a task.
+
+  OFF --SFM3300_OFF_MS--> STARTING --SFM3300_STARTUP_MS--> START --command written--> WARMUP
+  WARMUP --first read, discarded--> MEASURING
+
+A transfer fails when the sensor does not ACK, on a bus error, when the
+CRC-8 of a read does not match, or when it is not complete at the next
+tick (stuck bus, the TWI is reset). SAMPLER_FLOW_RETRIES failures in a row
+power cycle the sensor: back to OFF.
+
+The last good value is kept in raw, age counts the ticks since it was read.
+*/
+
+#define SFM3300_OFF 0 // powered off
+#define SFM3300_STARTING 1 // powered, starting up
+#define SFM3300_START 2 // writing the start measurement command
+#define SFM3300_WARMUP 3 // the first read after the command is not valid
+#define SFM3300_MEASURING 4
 
 class SFM3300 {
-  public: 
-    float slm;
-    float slm_sum;
+  public:
+    volatile uint8_t state; // SFM3300_*
+    volatile uint16_t errors; // failed transfers, CRC errors included
+    volatile uint16_t crc_errors; // reads with a wrong CRC
+    volatile uint16_t restarts; // power cycles after failures
+    volatile uint8_t failed; // transfers failed in a row, 0 after a good one
+    uint16_t raw; // last good value
+    uint8_t age; // ticks since raw was read, saturates, 0xFF = none yet
+
+    void begin(void); // starts with a power cycle, the sensor starts from a known state
+    void tick(void); // timer interrupt
+    uint8_t twi_isr(void); // TWI interrupt, 1 = a new value in raw
 
-    uint8_t init();
-    uint8_t measure();
+    static uint8_t crc8(const uint8_t *data, uint8_t n); // poly 0x31, init 0x00
 
-    private:
-    long int slm_sum_raw;
+  private:
+    uint8_t wait; // ticks left in OFF / STARTING
+    volatile uint8_t busy; // transfer running
+    uint8_t writing; // the transfer is the start command
+    uint8_t count; // bytes transferred
+    uint8_t data[3];
+
+    void fail(void);
+    void power(uint8_t state, uint8_t ticks);
 };
 
+extern SFM3300 sfm;
+
 #endif // #ifndef SFM3300_H
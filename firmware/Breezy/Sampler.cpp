@@ -0,0 +1,217 @@
+#include <Arduino.h>
+#include <util/atomic.h>
+#include "Configuration.h"
+#include "Sampler.h"
+#include "Trigger.h"
+#include "SFM3300.h"
+
+Sampler sampler;
+
+#define RING_MASK (SAMPLER_RING_SIZE - 1)
+
+#define HOLD_TICKS ((uint32_t)SFM3300_HOLD_MS * SAMPLER_RATE_HZ / 1000)
+#if SFM3300_HOLD_MS * SAMPLER_RATE_HZ / 1000 > 254
+#error SFM3300_HOLD_MS must be at most 254 sampler ticks
+#endif
+
+// keeps the compiler from moving ring accesses across the index update
+#define memory_barrier() __asm__ __volatile__("" ::: "memory")
+
+// ADC steps within one tick
+#define ADC_P_ACT 0 // converting P_ACT_PIN
+#define ADC_SLOW 1 // converting a slow channel
+#define ADC_DONE 2
+
+#define P_ACT_CONVERSIONS (1 << (2 * SAMPLER_P_ACT_BITS))
+#define SLOW_CONVERSIONS (1 << (2 * SAMPLER_SLOW_BITS))
+
+// a conversion takes 13 ADC clocks at F_CPU / 64
+#if (P_ACT_CONVERSIONS + SLOW_CONVERSIONS) * 13UL * 64 * SAMPLER_RATE_HZ > F_CPU * 3 / 4
+#error the ADC bursts take more than 3/4 of a sampler period
+#endif
+#if P_ACT_CONVERSIONS > 64 || SLOW_CONVERSIONS > 64
+#error the burst sum must fit 16 bits
+#endif
+
+static const uint8_t slow_pins[SAMPLER_SLOW_CHANNELS] = {
+  P_O2_PIN, SET_O2_PIN, SET_MAX_P_PIN, SET_PEEP_PIN, SET_RR_PIN, SET_TV_PIN, SET_IE_PIN
+};
+
+#define P_O2_PERIOD (SAMPLER_RATE_HZ / SAMPLER_P_O2_HZ)
+#define POT_PERIOD (SAMPLER_RATE_HZ / SAMPLER_POT_HZ)
+
+#if P_O2_PERIOD < 1 || P_O2_PERIOD > 255 || POT_PERIOD < 1 || POT_PERIOD > 255
+#error the slow channel periods must be 1 to 255 sampler ticks
+#endif
+#if SAMPLER_P_O2_HZ + (SAMPLER_SLOW_CHANNELS - 1) * SAMPLER_POT_HZ > SAMPLER_RATE_HZ
+#error the slow channels need more than one conversion burst per tick
+#endif
+
+// ticks between two readings of each slow channel
+static const uint8_t slow_period[SAMPLER_SLOW_CHANNELS] = {
+  P_O2_PERIOD, POT_PERIOD, POT_PERIOD, POT_PERIOD, POT_PERIOD, POT_PERIOD, POT_PERIOD
+};
+
+// same reference (AVCC) and channel numbering as analogRead()
+static void adc_start(uint8_t pin)
+{
+  uint8_t ch = pin - A0;
+  ADCSRB = (ADCSRB & ~_BV(MUX5)) | ((ch & 0x08) ? _BV(MUX5) : 0);
+  ADMUX = _BV(REFS0) | (ch & 0x07);
+  ADCSRA |= _BV(ADSC);
+}
+
+void Sampler::begin(void)
+{
+  head = tail = 0;
+  overruns = 0;
+  slow_due = 0;
+  slow_next = 0;
+  adc_step = ADC_P_ACT; // nothing to queue at the first tick
+  adc_sum = 0;
+  adc_count = 0;
+  phase = 0;
+  pending.flags = 0;
+  for(uint8_t i = 0; i < SAMPLER_SLOW_CHANNELS; i++){
+    slow_adc[i] = 0;
+    slow_count[i] = 0;
+    slow_wait[i] = i + 1; // each read once right away, one per tick
+  }
+
+  // ADC: interrupt on completion, prescaler 64 (250 kHz, 52 us per conversion).
+  // Slightly above the 200 kHz for full 10 bit accuracy, the oversampling more than makes up for it.
+  ADCSRA = _BV(ADEN) | _BV(ADIE) | _BV(ADPS2) | _BV(ADPS1);
+
+  // Timer3: CTC mode, prescaler 8 (2 MHz)
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+    TCCR3A = 0;
+    TCCR3B = _BV(WGM32) | _BV(CS31);
+    OCR3A = (F_CPU / 8 / SAMPLER_RATE_HZ) - 1;
+    TCNT3 = 0;
+    TIMSK3 = _BV(OCIE3A);
+  }
+}
+
+uint8_t Sampler::read(RawSample *s)
+{
+  uint8_t t = tail;
+  if(t == head){
+    return 0;
+  }
+  memory_barrier();
+  *s = ring[t];
+  memory_barrier();
+  tail = (t + 1) & RING_MASK;
+  return 1;
+}
+
+uint16_t Sampler::slow(uint8_t channel, uint8_t *count)
+{
+  uint16_t v;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+    v = slow_adc[channel];
+    if(count != NULL) *count = slow_count[channel];
+  }
+  return v;
+}
+
+void Sampler::set_phase(uint8_t flags)
+{
+  phase = flags;
+}
+
+void Sampler::timer_isr(void)
+{
+  // the previous tick is complete, queue it
+  if(!(pending.flags & SAMPLE_FLOW_OK) && sfm.age <= HOLD_TICKS){ // the read failed, repeat the last good one
+    pending.flow = sfm.raw;
+    pending.flags |= SAMPLE_FLOW_STALE;
+  }
+  if(adc_step == ADC_DONE){
+    uint8_t h = head;
+    uint8_t next = (h + 1) & RING_MASK;
+    if(next == tail){
+      overruns++;
+    }else{
+      ring[h] = pending;
+      memory_barrier();
+      head = next;
+    }
+  }
+
+  for(uint8_t i = 0; i < SAMPLER_SLOW_CHANNELS; i++){
+    if(--slow_wait[i] == 0){
+      slow_wait[i] = slow_period[i];
+      slow_due |= _BV(i); // stays due until converted
+    }
+  }
+
+  // start the next one
+  pending.ms = (uint16_t)millis();
+  pending.us = (uint16_t)micros();
+  pending.flags = phase;
+  adc_step = ADC_P_ACT;
+  adc_sum = 0;
+  adc_count = 0;
+  adc_start(P_ACT_PIN);
+
+  sfm.tick(); // reads the flow, or takes the next step of a restart
+}
+
+void Sampler::adc_isr(void)
+{
+  adc_sum += ADC;
+  adc_count++;
+  if(adc_step == ADC_P_ACT){
+    if(adc_count < P_ACT_CONVERSIONS){
+      ADCSRA |= _BV(ADSC); // same channel again
+      return;
+    }
+    pending.p_act = adc_sum >> SAMPLER_P_ACT_BITS;
+    if(slow_due){
+      slow_next = __builtin_ctz(slow_due);
+      adc_step = ADC_SLOW;
+      adc_start(slow_pins[slow_next]);
+    }else{
+      adc_step = ADC_DONE; // the ADC idles until the next tick
+    }
+  }else{
+    if(adc_count < SLOW_CONVERSIONS){
+      ADCSRA |= _BV(ADSC);
+      return;
+    }
+    slow_adc[slow_next] = adc_sum >> SAMPLER_SLOW_BITS; // published only when the burst is complete
+    slow_count[slow_next]++;
+    slow_due &= ~_BV(slow_next);
+    adc_step = ADC_DONE;
+  }
+  adc_sum = 0;
+  adc_count = 0;
+}
+
+uint8_t Sampler::twi_isr(void)
+{
+  if(sfm.twi_isr()){
+    pending.flow = sfm.raw;
+    pending.flags |= SAMPLE_FLOW_OK;
+    return trigger.sample(pending.flow, pending.ms);
+  }
+  return 0;
+}
+
+ISR(TIMER3_COMPA_vect)
+{
+  sampler.timer_isr();
+}
+
+ISR(ADC_vect)
+{
+  sampler.adc_isr();
+}
+
+ISR(TWI_vect)
+{
+  if(sampler.twi_isr()){
+    portYIELD_FROM_ISR(); // the valve task runs now, not at the next tick; the last thing in the handler
+  }
+}
@@ -0,0 +1,96 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <inttypes.h>
+#include "Configuration.h"
+
+/*
+Hardware timed acquisition of pressure and flow.
+
+Timer3 ticks at SAMPLER_RATE_HZ. Each tick starts:
+ - a burst of ADC conversions of P_ACT_PIN, followed by a burst of the slow
+   channel that is due, if any - ADC interrupt. Each burst is summed and
+   decimated, 4^n conversions give n more bits (SAMPLER_P_ACT_BITS,
+   SAMPLER_SLOW_BITS).
+ - a read of the SFM3300 flow value - TWI interrupt, see SFM3300.h
+and queues the results of the previous tick, which are complete by then,
+into a single-producer/single-consumer ring. The samples are therefore
+exactly one period apart, delayed by one period.
+
+Statistics reads the ring in batches with read(). The slow channels are
+only kept as the latest value, see slow(). Each has its own rate: the O2
+supply pressure SAMPLER_P_O2_HZ, the potentiometers SAMPLER_POT_HZ. A channel
+that falls due in the same tick as another waits for the next free tick,
+the lower channel number goes first. In most ticks the ADC only converts
+the pressure. Each sample carries the breath
+phase that was set when it was taken, so Statistics splits the breaths
+exactly at the valve actions however late it reads the ring.
+
+When a flow read fails, the sample repeats the last good value for up to
+SFM3300_HOLD_MS, flagged SAMPLE_FLOW_STALE. The sampler owns the TWI, the
+I2C library must not be used once it runs.
+*/
+
+#if (SAMPLER_RING_SIZE & (SAMPLER_RING_SIZE - 1)) || SAMPLER_RING_SIZE > 128
+#error SAMPLER_RING_SIZE must be a power of 2, max 128
+#endif
+
+#define SAMPLE_FLOW_OK 0x01 // flow holds a new SFM3300 value
+#define SAMPLE_INSPIRATION 0x02 // the breath controller was in inspiration, see set_phase()
+#define SAMPLE_HOLD 0x04 // and had the patient valves closed: inspiratory hold / expiratory pause
+#define SAMPLE_FLOW_STALE 0x08 // the read failed, flow holds the last good value
+
+// slow channels
+#define SAMPLER_SLOW_P_O2 0
+#define SAMPLER_SLOW_SET_O2 1
+#define SAMPLER_SLOW_SET_MAX_P 2
+#define SAMPLER_SLOW_SET_PEEP 3
+#define SAMPLER_SLOW_SET_RR 4
+#define SAMPLER_SLOW_SET_TV 5
+#define SAMPLER_SLOW_SET_IE 6
+#define SAMPLER_SLOW_CHANNELS 7
+
+struct RawSample{
+  uint16_t ms; // low 16 bits of millis() at the timer tick
+  uint16_t us; // low 16 bits of micros() at the timer tick, for the integration
+  uint16_t p_act; // P_ACT_PIN, 0 .. ADC_MAXVAL << SAMPLER_P_ACT_BITS
+  uint16_t flow; // SFM3300 raw value, valid with SAMPLE_FLOW_OK or SAMPLE_FLOW_STALE
+  uint8_t flags; // SAMPLE_*
+};
+
+class Sampler{
+  public:
+  volatile uint16_t overruns; // samples lost because the ring was full
+
+  void begin(void);
+  uint8_t read(RawSample *s); // consumer, 1 = a sample was taken from the ring
+  // latest reading of a SAMPLER_SLOW_* channel, 0 .. ADC_MAXVAL << SAMPLER_SLOW_BITS,
+  // count: readings of the channel so far (wraps), tells a new reading from the last one
+  uint16_t slow(uint8_t channel, uint8_t *count = NULL);
+  void set_phase(uint8_t flags); // breath controller, SAMPLE_INSPIRATION | SAMPLE_HOLD of the following samples
+
+  // interrupt handlers
+  void timer_isr(void);
+  void adc_isr(void);
+  uint8_t twi_isr(void); // 1 = woke a task that outranks the interrupted one
+
+  private:
+  RawSample ring[SAMPLER_RING_SIZE];
+  volatile uint8_t head; // written by the timer interrupt only
+  volatile uint8_t tail; // written by read() only
+
+  RawSample pending; // the sample being acquired
+  volatile uint16_t slow_adc[SAMPLER_SLOW_CHANNELS]; // finished readings, the burst is summed in adc_sum
+  uint16_t adc_sum;
+  uint8_t adc_count; // conversions in adc_sum
+  volatile uint8_t slow_count[SAMPLER_SLOW_CHANNELS]; // readings so far
+  uint8_t slow_wait[SAMPLER_SLOW_CHANNELS]; // ticks until the channel is due again
+  uint8_t slow_due; // channels due, bit = SAMPLER_SLOW_*
+  uint8_t slow_next; // slow channel converted in this tick
+  volatile uint8_t adc_step; // conversions finished in this tick
+  volatile uint8_t phase; // SAMPLE_INSPIRATION | SAMPLE_HOLD
+};
+
+extern Sampler sampler;
+
+#endif // #ifndef SAMPLER_H
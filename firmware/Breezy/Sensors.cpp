@@ -4,46 +4,208 @@
 #include "I2C.h"
 #include "SFM3300.h"
 #include "Sensors.h"
+#include "Sampler.h"
+#include "Calibration.h"
+#include "AdcScale.h"
 
 
-SFM3300 sfm; //class instance for flow sensor
-
 Sensors sensors;
 
+static const AdcScale scale_p_act = ADC_SCALE(P_ACT);
+static const AdcScale scale_p_o2 = ADC_SCALE(P_O2);
+static const AdcScale scale_set_o2 = ADC_SCALE(SET_O2);
+static const AdcScale scale_set_max_p = ADC_SCALE(SET_MAX_P);
+static const AdcScale scale_set_peep = ADC_SCALE(SET_PEEP);
+static const AdcScale scale_set_rr = ADC_SCALE(SET_RR);
+static const AdcScale scale_set_tv = ADC_SCALE(SET_TV);
+static const AdcScale scale_set_ie = ADC_SCALE(SET_IE);
+
+/*
+Calibration tables (Calibration.h) expanded into lines, one per pair of
+neighbouring points, whose gain and offset are computed once here.
+The reading range is split into 2^CAL_BUCKET_BITS buckets. Each bucket
+knows the line at its first reading, and as the points are at least a
+bucket apart, the reading is at most one line further: a conversion is a
+table read, a compare and the multiply and add.
+*/
+#if CAL_POINTS < 2
+#error CAL_POINTS must be at least 2
+#endif
+
+struct CalLines{
+  AdcScale line[CAL_POINTS - 1];
+  uint16_t start[CAL_POINTS]; // first reading of each line, 0xFFFF after the last line
+  uint8_t bucket[1 << CAL_BUCKET_BITS]; // line at the first reading of the bucket
+  uint8_t shift; // reading -> bucket
+};
+
+static CalLines cal[CAL_CHANNELS];
+
+static const AdcScale &cal_line(const CalLines &c, uint16_t adc)
+{
+  uint8_t i = c.bucket[adc >> c.shift];
+  if(adc >= c.start[i + 1]) i++;
+  return c.line[i];
+}
+
+// line: Configuration.h, gain: its gain for a one point table
+static void cal_expand(CalLines &c, uint8_t channel, const AdcScale &line, float gain)
+{
+  CalTable t;
+  calibration.get(channel, &t);
+  uint16_t full = ADC_MAXVAL << Calibration::bits(channel);
+
+  uint8_t lines = 1;
+  c.line[0] = line;
+  if(t.n == 1){ // zero offset
+    c.line[0] = adc_line(gain, t.p[0].value - gain * t.p[0].adc, full);
+  }else if(t.n > 1){
+    lines = t.n - 1;
+    for(uint8_t i = 0; i < lines; i++){
+      float g = (t.p[i + 1].value - t.p[i].value) / ((float)t.p[i + 1].adc - t.p[i].adc);
+      c.line[i] = adc_line(g, t.p[i].value - g * t.p[i].adc, full);
+      c.start[i] = t.p[i].adc;
+    }
+  }
+  c.start[0] = 0; // the first and the last line go on to the ends of the range
+  c.start[lines] = 0xFFFF;
+
+  c.shift = 10 + Calibration::bits(channel) - CAL_BUCKET_BITS;
+  uint8_t i = 0;
+  for(uint8_t b = 0; b < sizeof(c.bucket); b++){
+    while(c.start[i + 1] <= ((uint16_t)b << c.shift)){
+      i++;
+    }
+    c.bucket[b] = i;
+  }
+}
+
+static void cal_expand_all(void)
+{
+  cal_expand(cal[CAL_P_ACT], CAL_P_ACT, scale_p_act, ADC_GAIN(P_ACT));
+  cal_expand(cal[CAL_P_O2], CAL_P_O2, scale_p_o2, ADC_GAIN(P_O2));
+}
+
+/*
+The potentiometers are read at SAMPLER_POT_HZ. Each new reading goes
+through a median of the last 3, which drops a single spike, and a
+hysteresis of SENSORS_POT_HYSTERESIS counts, so a knob resting between two
+counts does not make the setting flicker. The ends of the range are let
+through, so the full scale stays reachable.
+*/
+#define POTS (SAMPLER_SLOW_CHANNELS - SAMPLER_SLOW_SET_O2)
+#define POT_FULL (ADC_MAXVAL << SAMPLER_SLOW_BITS)
+
+struct PotFilter{
+  uint16_t v[3]; // the last readings, newest first
+  uint16_t value; // filtered
+  uint8_t count; // sampler reading count of v[0]
+  uint8_t primed; // v[] holds readings
+};
+
+static PotFilter pots[POTS];
+#define POT(channel) (pots[(channel) - SAMPLER_SLOW_SET_O2].value)
+
+static uint16_t median3(uint16_t a, uint16_t b, uint16_t c)
+{
+  if(a > b){ uint16_t t = a; a = b; b = t; }
+  if(b > c) b = c;
+  return a > b ? a : b;
+}
+
+// 1 when the filtered value changed
+static uint8_t pot_update(PotFilter &f, uint8_t channel)
+{
+  uint8_t count;
+  uint16_t v = sampler.slow(channel, &count);
+  if(count == f.count){ // no new reading
+    return 0;
+  }
+  f.count = count;
+
+  if(!f.primed){
+    f.v[0] = f.v[1] = f.v[2] = f.value = v;
+    f.primed = 1;
+    return 1;
+  }
+  f.v[2] = f.v[1];
+  f.v[1] = f.v[0];
+  f.v[0] = v;
+
+  uint16_t m = median3(f.v[0], f.v[1], f.v[2]);
+  if(m == f.value){
+    return 0;
+  }
+  if(m > f.value + SENSORS_POT_HYSTERESIS || m + SENSORS_POT_HYSTERESIS < f.value
+     || m == 0 || m == POT_FULL){
+    f.value = m;
+    return 1;
+  }
+  return 0;
+}
+
 void Sensors::init(void)
 {
-  I2c.begin();
-  sfm.init();  
+  I2c.begin(); // pull-ups and bit rate
+  sfm.begin();
+  calibration.init();
+  cal_expand_all();
+  calibration.changed = 0;
+  memset(pots, 0, sizeof(pots));
+  changed = 0;
+  convert_pots(); // the lowest settings until the first readings
+  sampler.begin(); // owns the ADC and the I2C bus from now on
 }
 
 uint8_t Sensors::measure(void)
 {
-  uint8_t ret = 0;
-  if(0 == sfm.measure()){
-    slm = sfm.slm;
-  }else{
-    sfm.init();
-    slm = NAN;
-    ret++; // indicate error
+  uint8_t ret = sfm.state != SFM3300_MEASURING; // the flow sensor restarts by itself, see SFM3300.h
+
+  if(calibration.changed){ // saved by the cal command
+    calibration.changed = 0;
+    cal_expand_all();
   }
 
-  // measure analog sensors
-  p_act = AnalogSensor((float)P_ACT_MINVOLT, (float)P_ACT_MAXVOLT, (float)P_ACT_MINOUTP, (float)P_ACT_MAXOUTP, P_ACT_PIN);
-  p_o2 = AnalogSensor((float)P_O2_MINVOLT, (float)P_O2_MAXVOLT, (float)P_O2_MINOUTP, (float)P_O2_MAXOUTP, P_O2_PIN);
+  // analog sensors, converted by the sampler
+  uint16_t adc = sampler.slow(SAMPLER_SLOW_P_O2);
+  p_o2 = adc_convert(cal_line(cal[CAL_P_O2], adc), adc);
   
-  // measure potentiometers
-  set_o2 = AnalogSensor((float)SET_O2_MINVOLT, (float)SET_O2_MAXVOLT, (float)SET_O2_MINOUTP, (float)SET_O2_MAXOUTP, SET_O2_PIN);
-  set_max_p = AnalogSensor((float)SET_MAX_P_MINVOLT, (float)SET_MAX_P_MAXVOLT, (float)SET_MAX_P_MINOUTP, (float)SET_MAX_P_MAXOUTP, SET_MAX_P_PIN);
-  set_peep = AnalogSensor((float)SET_PEEP_MINVOLT, (float)SET_PEEP_MAXVOLT, (float)SET_PEEP_MINOUTP, (float)SET_PEEP_MAXOUTP, SET_PEEP_PIN);
-  set_rr = AnalogSensor((float)SET_RR_MINVOLT, (float)SET_RR_MAXVOLT, (float)SET_RR_MINOUTP, (float)SET_RR_MAXOUTP, SET_RR_PIN);
-  set_tv = AnalogSensor((float)SET_TV_MINVOLT, (float)SET_TV_MAXVOLT, (float)SET_TV_MINOUTP, (float)SET_TV_MAXOUTP, SET_TV_PIN);
-  set_ie = AnalogSensor((float)SET_IE_MINVOLT, (float)SET_IE_MAXVOLT, (float)SET_IE_MINOUTP, (float)SET_IE_MAXOUTP, SET_IE_PIN);
+  // potentiometers, converted only when the filtered value changed
+  changed = 0;
+  for(uint8_t i = 0; i < POTS; i++){
+    if(pot_update(pots[i], SAMPLER_SLOW_SET_O2 + i)){
+      changed |= _BV(i);
+    }
+  }
+  if(changed){
+    convert_pots();
+  }
   
   return ret;
 }
 
-float Sensors::AnalogSensor(float MinVolt, float MaxVolt, float MinOutp, float MaxOutp, const uint8_t pin)
+void Sensors::convert_pots(void)
+{
+  set_o2 = adc_convert(scale_set_o2, POT(SAMPLER_SLOW_SET_O2));
+  set_max_p = adc_convert(scale_set_max_p, POT(SAMPLER_SLOW_SET_MAX_P));
+  set_peep = adc_convert(scale_set_peep, POT(SAMPLER_SLOW_SET_PEEP));
+  set_rr = adc_convert(scale_set_rr, POT(SAMPLER_SLOW_SET_RR));
+  set_tv = adc_convert(scale_set_tv, POT(SAMPLER_SLOW_SET_TV));
+  set_ie = adc_convert(scale_set_ie, POT(SAMPLER_SLOW_SET_IE));
+}
+
+float Sensors::p_act(uint16_t adc)
+{
+  return adc_convert(cal_line(cal[CAL_P_ACT], adc), adc);
+}
+
+// the line of the mean reading, exact unless the readings spread over a calibration point
+float Sensors::p_act_mean(uint32_t adc_sum, uint16_t n)
+{
+  return adc_convert_mean(cal_line(cal[CAL_P_ACT], adc_sum / n), adc_sum, n);
+}
+
+float Sensors::slm(uint16_t raw)
 {
-  float adc_volt = ((float)analogRead(pin))/((float)ADC_MAXVAL)*((float)ADC_REF_VOLT);
-  return (adc_volt - MinVolt) * (MaxOutp - MinOutp)/(MaxVolt - MinVolt) + MinOutp;
+  return ((float)raw - SFM3300_OFFSET) * (1.0 / SFM3300_SCALE);
 }
@@ -7,10 +7,8 @@
 class Sensors{
   public:
   
-  // sensor measurements
-  float p_act; // actual pressure (cmH2O)
+  // sensor measurements, pressure and flow come per sample from the Sampler
   float p_o2; // O2 supply pressure (kPa)
-  float slm; // flow (l/min)
   float o2_perc; // O2 concentration
 
   // potentiometer settings
@@ -20,16 +18,19 @@ class Sensors{
   float set_rr; // respiratory rate (12 to 20) / min
   float set_tv; // Tidal volume (200 - 1000) ml 
   float set_ie; // Inspiration : Expiration, 
+  uint8_t changed; // settings changed by the last measure(), bit = SAMPLER_SLOW_* channel - SAMPLER_SLOW_SET_O2
 
   void init(void);
-  uint8_t measure(void);
+  uint8_t measure(void); // slow channels, 1 while the flow sensor is restarting
+
+  float p_act(uint16_t adc); // P_ACT_PIN sampler reading -> cmH2O
+  float p_act_mean(uint32_t adc_sum, uint16_t n); // mean of n P_ACT_PIN sampler readings -> cmH2O
+  float slm(uint16_t raw); // SFM3300 raw value -> l/min
 
   private:
-  float AnalogSensor(float MinVolt, float MaxVolt, float MinOutp, float MaxOutp, const uint8_t pin);
-  
+  void convert_pots(void); // filtered potentiometer readings -> settings
 };
 
 extern Sensors sensors;
-extern SFM3300 sfm;
 
 #endif // #ifndef SENSORS_H 
@@ -0,0 +1,64 @@
+#ifndef SEQLOCK_H
+#define SEQLOCK_H
+
+#include <inttypes.h>
+#include <string.h>
+#include <Arduino_FreeRTOS.h>
+#include <task.h>
+
+/*
+Sequence lock: one writer publishes a copy of T, any number of readers copy
+it out without blocking the writer.
+
+The writer makes the sequence odd, copies the data, then makes it even again.
+A reader retries when the sequence was odd or changed during its copy, so it
+never returns a half written value. The sequence is 8 bit, reading it is atomic
+on AVR.
+
+Only for tasks: a reader that preempted the writer in the middle of write()
+sleeps a tick, so the writer finishes even when it runs at a lower priority.
+Never call read() from an interrupt.
+*/
+
+// keeps the compiler from moving the data copy across the sequence updates
+#define seqlock_barrier() __asm__ __volatile__("" ::: "memory")
+
+template <class T>
+class Seqlock{
+  public:
+  Seqlock() : seq(0) {}
+
+  // single writer
+  void write(const T *v)
+  {
+    seq = seq + 1; // odd: write in progress
+    seqlock_barrier();
+    memcpy(&data, v, sizeof(T));
+    seqlock_barrier();
+    seq = seq + 1;
+  }
+
+  void read(T *v) const
+  {
+    uint8_t before;
+    for(;;){
+      before = seq;
+      if(before & 1){ // the writer was preempted, let it finish
+        vTaskDelay(1);
+        continue;
+      }
+      seqlock_barrier();
+      memcpy(v, &data, sizeof(T));
+      seqlock_barrier();
+      if(seq == before){
+        return;
+      }
+    }
+  }
+
+  private:
+  volatile uint8_t seq;
+  T data;
+};
+
+#endif // #ifndef SEQLOCK_H
@@ -2,59 +2,140 @@
 #include "Configuration.h"
 #include "Statistics.h"
 #include "Sensors.h"
+#include "Sampler.h"
+#include "SFM3300.h"
+#include "Messaging.h"
+#include "Profiler.h"
+#include "BreathLog.h"
+#include "Alarms.h"
 
 Statistics statistics;
 
+// integrator area -> ml: raw / SFM3300_SCALE is l/min, x us / 60e6 is l, x 1000 is ml,
+// the trapezoid sums two readings per step, kept in units of 2^FLOW_AREA_SHIFT us
+#define FLOW_AREA_SHIFT (3)
+#define FLOW_AREA_ML (1000.0 * (1 << FLOW_AREA_SHIFT) / (2.0 * SFM3300_SCALE * 60000000.0))
+
+// Readings further apart are not bridged, e.g. after a flow sensor restart.
+// Keeps one trapezoid within int32: 2 x 32767 x 30000 us
+#define FLOW_MAX_GAP_MS (30)
+
+// The trapezoids of a batch are summed in int32 and folded into the 64 bit
+// integrators once per batch, at the latest after AREA_FOLD_SAMPLES samples:
+// a gap and the samples after it, 2 x 32767 x (30000 + 32 x 2000 us) / 2^3, stay within int32
+#define AREA_FOLD_SAMPLES (32)
+#if (65534LL * (FLOW_MAX_GAP_MS * 1000LL + AREA_FOLD_SAMPLES * (1000000LL / SAMPLER_RATE_HZ + 1)) >> FLOW_AREA_SHIFT) > 2147483647LL
+#error AREA_FOLD_SAMPLES too large for SAMPLER_RATE_HZ and FLOW_AREA_SHIFT
+#endif
+
+// Timer3 runs the sampler at F_CPU / 8 and restarts every sampler period, so it
+// times a section shorter than a period to 8 CPU cycles, micros() only to 64
+#define TIMER3_PERIOD (F_CPU / 8 / SAMPLER_RATE_HZ)
+static uint16_t timer3_cycles(uint16_t from, uint16_t to)
+{
+  if(to < from) to += TIMER3_PERIOD; // restarted in between
+  return (to - from) * 8;
+}
+
+static float area_ml(int64_t area)
+{
+  return (float)area * (float)FLOW_AREA_ML;
+}
+
+// adds the trapezoids since the last fold to the integrators of their phase
+void Statistics::fold_area(void)
+{
+  vol_area += area_part;
+  vol_ml = area_ml(vol_area);
+  if(last_is_insp){
+    vti_area += area_part;
+  }else{
+    vte_area += area_part;
+  }
+  area_part = 0;
+  area_samples = 0;
+}
+
 void Statistics::init(void)
 {
   sensors.init();
-  is_inspiration_from_automat = 0;
+  breath_log.init();
+  alarms.init();
 
-  vti_int = 0; // vti integrator
-  vte_int = 0; // vte integrator
+  vol_area = 0;
+  vti_area = 0; // vti integrator
+  vte_area = 0; // vte integrator
+  area_part = 0;
+  area_samples = 0;
+  vol_ml = 0;
+  has_last_flow = 0;
   uint32_t last_insp_started_ms = 0;
   uint32_t last_exp_started_ms = 0;
   slm_sum = 0;
   p_mean_detect = 0;
   p_mean_count = 0;
+  phase_changes = 0;
+  p_act_adc = 0;
+  last_is_insp = 0;
+  p_plat = peep_tot = pif = pef = NAN;
+  compliance = resistance = NAN;
+  mechanics.reset();
+  flow_ema.reset();
+  p_act_filter.reset();
+  flow_filter.reset();
+  filter_cycles.reset();
+  flow_peak_detect = 0;
+  reset_end_window();
+  settings_task = NULL;
+  publish_task = NULL;
 }
 
-uint8_t Statistics::is_inspiration(void)
+void Statistics::notify_on_settings(TaskHandle_t task)
 {
-  uint32_t mil = millis();
-  static uint8_t insp = 0;
-  
-  if(1){ // automat determines breathing start/stop. No need to assess.
-      insp = is_inspiration_from_automat;
-  }else{ // free breathing through flow sensor (only for experiment)
-    if((slm > (float)INSPIRATION_FLOW_DETECT_TRIGGER) && (mil - last_exp_started_ms > MIN_EXPIRATION_TIME_MS)){
-      insp = 1;
-    }else if((slm < -((float)INSPIRATION_FLOW_DETECT_TRIGGER))  && (mil - last_insp_started_ms > MIN_INSPIRATION_TIME_MS)){
-      insp = 0;
-    } 
-  }  
-  
-  return insp;
+  settings_task = task;
+}
+
+void Statistics::notify_on_publish(TaskHandle_t task, uint32_t bits)
+{
+  publish_bits = bits;
+  publish_task = task;
+}
+
+void Statistics::reset_end_window(void)
+{
+  p_end.reset();
+  p_end_min.reset();
+  p_end_max.reset();
+  end_hold = 0;
+}
+
+float Statistics::end_plateau(void)
+{
+  if(!p_end.full() || end_hold < END_WINDOW_SAMPLES){
+    return NAN;
+  }
+  if(sensors.p_act(p_end_max.value()) - sensors.p_act(p_end_min.value()) > (float)PLATEAU_MAX_SPREAD){
+    return NAN; // still settling, or a patient effort
+  }
+  return sensors.p_act_mean(p_end.total(), p_end.size());
 }
 
 uint8_t Statistics::poll(void)
 {
   static uint32_t last_poll = 0;
-  static uint8_t last_is_insp = 0;
-  uint8_t is_insp = 0;
   uint32_t mil = millis();
+  RawSample r;
+  uint8_t n = 0;
 
   
   if(mil - last_poll < (uint32_t)STATISTICS_PERIOD_MS){ // it is not the time yet
     return 0;
   }
 
-  if ( xSemaphoreTake( xStatisticsSemaphore, ( TickType_t ) 5 ) == pdFALSE )
-  {
-    return 0;
-  }
+  uint32_t start_us = micros();
   
   last_poll += (uint32_t)STATISTICS_PERIOD_MS;
+  profiler.late(PROFILE_JITTER_STATISTICS, mil - last_poll);
 
   
   sensors.measure();
@@ -66,71 +147,216 @@ uint8_t Statistics::poll(void)
   set_tv = sensors.set_tv; // Tidal volume (200 - 1000) ml 
   set_ie = sensors.set_ie; // Inspiration : Expiration, 
   
-  p_act = sensors.p_act; // actual pressure (cmH2O)
   p_o2 = sensors.p_o2; // oxygen pressure (kPa)
-  slm = sensors.slm; // flow (l/min)
-  float dv_ml_s = slm * 1000 / 60; // actual flow in milliliters per second 
-  float dv_ml = dv_ml_s * ((float)STATISTICS_PERIOD_MS) / 1000; // volume per measurement period
+
+  // everything the sampler queued since the last poll
+  uint16_t p_batch_max = 0; // ADC counts
+  uint32_t p_batch_sum = 0;
+  uint32_t filter_sum = 0; // CPU cycles
+  while(sampler.read(&r)){
+    uint16_t f_start = TCNT3;
+    filter(&r);
+    filter_sum += timer3_cycles(f_start, TCNT3);
+    uint32_t t = mil - (uint16_t)((uint16_t)mil - r.ms); // extend the 16 bit timestamp
+    add_sample(&r, t);
+    if(++area_samples >= AREA_FOLD_SAMPLES) fold_area();
+    if(r.p_act > p_batch_max) p_batch_max = r.p_act;
+    p_batch_sum += r.p_act;
+    n++;
+  }
+  if(n){ // the last sample is reported, converted only once per batch
+    filter_cycles.push(filter_sum / n);
+    p_act_adc = p_batch_sum / n;
+    p_act = sensors.p_act(r.p_act); // actual pressure (cmH2O)
+    slm = (r.flags & (SAMPLE_FLOW_OK | SAMPLE_FLOW_STALE)) ? sensors.slm(r.flow) : NAN; // flow (l/min)
+  }
+  fold_area();
+  slm_sum = vol_ml;
+
+  uint32_t alarms_us = micros();
+  alarms.sample(n ? sensors.p_act(p_batch_max) : NAN, slm, p_o2, set_max_p, mil);
+  profiler.add(PROFILE_ALARMS, alarms_us);
+  
+  TelemetrySample s;
+  s.ms = mil;
+  s.p_act = p_act;
+  s.slm = slm;
+  s.slm_sum = slm_sum;
+  s.p_o2 = p_o2;
+  s.is_i = is_i;
+  s.phase_changes = phase_changes;
   
-  if(p_act > p_peak_detect) p_peak_detect = p_act; // detect peak pressure
-  p_mean_detect += p_act; // calculate mean pressure
+  publish(); // before the sample is queued, a summary never sees older values
+  if(publish_task != NULL){
+    xTaskNotify(publish_task, publish_bits, eSetBits);
+  }
+  if(sensors.changed && settings_task != NULL){
+    xTaskNotifyGive(settings_task);
+  }
+  profiler.add(PROFILE_STATISTICS, start_us);
+
+  if(n){
+    messaging.push(&s); // formatting and sending is done by the telemetry task
+  }
+  return n;
+  
+}
+
+void Statistics::read(StatisticsSnapshot *s)
+{
+  uint32_t start_us = micros();
+  published.read(s);
+  profiler.add(PROFILE_SNAPSHOT_READ, start_us);
+}
+
+void Statistics::publish(void)
+{
+  static StatisticsSnapshot s; // not on the task stack
+
+  s.p_act = p_act;
+  s.slm = slm;
+  s.slm_sum = slm_sum;
+  s.p_o2 = p_o2;
+  s.p_act_adc = p_act_adc;
+  s.p_peak = p_peak;
+  s.p_mean = p_mean;
+  s.peep = peep;
+  s.p_plat = p_plat;
+  s.peep_tot = peep_tot;
+  s.pif = pif;
+  s.pef = pef;
+  s.compliance = compliance;
+  s.resistance = resistance;
+  s.rr = rr;
+  s.o2_perc = o2_perc;
+  s.ti = ti;
+  s.te = te;
+  s.i_e = i_e;
+  s.mvi = mvi;
+  s.mve = mve;
+  s.vti = vti;
+  s.vte = vte;
+  s.set_o2 = set_o2;
+  s.set_max_p = set_max_p;
+  s.set_peep = set_peep;
+  s.set_rr = set_rr;
+  s.set_tv = set_tv;
+  s.set_ie = set_ie;
+  s.filter_cycles = filter_cycles.value();
+  s.is_i = is_i;
+  s.phase_changes = phase_changes;
+  published.write(&s);
+}
+
+// spikes and noise out before the peak, mean and end window detection
+void Statistics::filter(RawSample *r)
+{
+  int16_t p = p_act_filter.push(r->p_act);
+  // the low-pass overshoots a step at the ends of the range, p_act is unsigned
+  if(p < 0) p = 0;
+  if(p > (ADC_MAXVAL << SAMPLER_P_ACT_BITS)) p = ADC_MAXVAL << SAMPLER_P_ACT_BITS;
+  r->p_act = p;
+  if(r->flags & SAMPLE_FLOW_OK){
+    r->flow = flow_filter.push((int16_t)(r->flow - SFM3300_OFFSET)) + SFM3300_OFFSET;
+  }
+}
+
+void Statistics::add_sample(const RawSample *r, uint32_t mil)
+{
+  uint8_t is_insp = 0;
+  int32_t area = 0; // trapezoid since the last valid flow reading, invalid readings are skipped
+  if(r->flags & SAMPLE_FLOW_OK){
+    int16_t flow = (int16_t)(r->flow - SFM3300_OFFSET);
+    if(has_last_flow && (uint16_t)(r->ms - last_flow_ms) <= FLOW_MAX_GAP_MS){
+      area = (((int32_t)last_flow + flow) * (uint16_t)(r->us - last_flow_us) + (1 << (FLOW_AREA_SHIFT - 1))) >> FLOW_AREA_SHIFT;
+    }
+    last_flow = flow;
+    last_flow_us = r->us;
+    last_flow_ms = r->ms;
+    has_last_flow = 1;
+    flow_ema.push(flow);
+  }
+  
+  // pressures are kept in ADC counts, the conversion is linear and rising (P_ACT_MAXOUTP > P_ACT_MINOUTP)
+  if(r->p_act > p_peak_detect) p_peak_detect = r->p_act; // detect peak pressure
+  p_mean_detect += r->p_act; // calculate mean pressure
   p_mean_count++;
   
   /*
   Volume integration
-  dt = STATISTICS_PERIOD_MS (ms)
-  slm = standard liters per minute (spm) 
+  dt = measured time between the flow readings (us)
+  exact sums in raw flow units, converted to ml only when a value is reported
   */
   
-  is_insp = is_i = is_inspiration();
+  is_insp = is_i = (r->flags & SAMPLE_INSPIRATION) != 0; // as the breath controller set it
   if(is_insp){ // inspiration
     if(!last_is_insp){ // inspiration just started!
-      vte = abs(vte_int);
-      vte_int = 0; // reset expiration volume integrator
+      fold_area(); // the trapezoids so far belong to the expiration
+      vte = fabs(area_ml(vte_area));
+      vte_area = 0; // reset expiration volume integrator
       te = (float)(mil - last_exp_started_ms)/1000; // calculate expiration time
       last_insp_started_ms = mil; 
       rr = 60 / (te + ti); // calculate respiratory rate (breaths/min)
       mve = rr * vte / 1000; // calculate mean volume expiration (l/min)
       i_e = ti/te; // calculate inspiraton : exspiration
       
-      slm_sum = 0; /* TODO: At the beginning of inspiration we assume empty volume. 
+      vol_area = 0; /* TODO: At the beginning of inspiration we assume empty volume. 
       This is to prevent driftng off the volume chart because of integration of error. Is this correct?
       */
-      p_peak = p_peak_detect;
+      vol_ml = 0;
+      p_peak = sensors.p_act(p_peak_detect);
       p_peak_detect = 0;
-      p_mean = p_mean_detect / p_mean_count; // calculate mean pressure
+      p_mean = p_mean_count ? sensors.p_act_mean(p_mean_detect, p_mean_count) : NAN; // calculate mean pressure
       p_mean_detect = 0;
       p_mean_count = 0;
-      peep = peep_detect;
+      peep = p_end.size() ? sensors.p_act_mean(p_end.total(), p_end.size()) : NAN; // end-expiratory pressure
+      peep_tot = end_plateau(); // the same, when the expiratory pause settled
+      pef = -sensors.slm(flow_peak_detect + SFM3300_OFFSET);
+      flow_peak_detect = 0;
+      reset_end_window();
+      mechanics.reset(); // volume starts at 0 again
+      breath_log.add(p_peak, p_mean, peep, ti, te, vti, vte); // the breath that just ended
+      alarms.breath(peep, set_peep, mve, mil);
+      phase_changes++;
     }
   
-    vti_int += dv_ml;// integrate inspiration volume
-    slm_sum += dv_ml;// integrate volume
+    area_part += area; // integrate inspiration volume and volume, see fold_area()
+    if(r->flags & SAMPLE_FLOW_OK){ // every sample of the inspiration, volume in ml and flow in l/s
+      mechanics.add(sensors.p_act(r->p_act), vol_ml + (float)area_part * (float)FLOW_AREA_ML,
+                    (float)(int16_t)(r->flow - SFM3300_OFFSET) * (float)(1.0 / (SFM3300_SCALE * 60.0)));
+    }
   
   }else{ // expiration
     if(last_is_insp){ // expiration just started!
-      vti = abs(vti_int);
-      vti_int = 0; // reset inspiration volume integrator
+      fold_area();
+      vti = fabs(area_ml(vti_area));
+      vti_area = 0; // reset inspiration volume integrator
       ti = (float)(mil - last_insp_started_ms)/1000; // calculate expiration time
       last_exp_started_ms = mil; 
       rr = 60 / (te + ti); // calculate respiratory rate (breaths/min)
       mvi = rr * vti / 1000; // calculate mean volume inspiration (l/min)
       i_e = ti/te; // calculate inspiraton : exspiration
+      p_plat = end_plateau(); // end-inspiratory pressure
+      pif = sensors.slm(flow_peak_detect + SFM3300_OFFSET);
+      mechanics.estimate(&compliance, &resistance);
+      flow_peak_detect = 0;
+      reset_end_window();
+      phase_changes++;
     }
   
-    vte_int += dv_ml; // integrate expiration volume
-    slm_sum += dv_ml;// integrate volume
-    
-    peep_detect = p_act; // TODO is this enough to detect peep?
-  
+    area_part += area; // integrate expiration volume and volume
+  }
+
+  // end of phase pressure and peak flow, after a transition they start over
+  p_end.push(r->p_act);
+  p_end_min.push(r->p_act);
+  p_end_max.push(r->p_act);
+  if(!(r->flags & SAMPLE_HOLD)) end_hold = 0;
+  else if(end_hold < 0xFF) end_hold++;
+  if(r->flags & SAMPLE_FLOW_OK){
+    int16_t f = flow_ema.value();
+    if(is_insp ? f > flow_peak_detect : f < flow_peak_detect) flow_peak_detect = f;
   }
   
   last_is_insp = is_insp;
-  
-  float slm_sum; // volume (ml)
-  
-  
-  xSemaphoreGive( xStatisticsSemaphore ); 
-  return 1;
-  
 }
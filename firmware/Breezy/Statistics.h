@@ -1,8 +1,65 @@
 #ifndef STATISTICS_H
 #define STATISTICS_H
 
+#include <inttypes.h>
+#include "Seqlock.h"
+#include "Sampler.h"
+#include "WindowedMetrics.h"
+#include "LungMechanics.h"
+#include "Filters.h"
 
+#define END_WINDOW_SAMPLES (STATISTICS_END_WINDOW_MS * SAMPLER_RATE_HZ / 1000)
+#if END_WINDOW_SAMPLES < 1 || END_WINDOW_SAMPLES > 255
+#error STATISTICS_END_WINDOW_MS must cover 1 to 255 samples
+#endif
 
+// Consistent copy of the statistics values for the other tasks, see Statistics::read()
+struct StatisticsSnapshot{
+  float p_act; // actual pressure (cmH2O)
+  float slm; // flow (l/min)
+  float slm_sum; // volume (ml)
+  float p_o2; // O2 supply pressure (kPa)
+  uint16_t p_act_adc; // mean sampler reading of the last batch, for the calibration
+
+  // per-breath values
+  float p_peak;
+  float p_mean;
+  float peep;
+  float p_plat;
+  float peep_tot;
+  float pif;
+  float pef;
+  float compliance;
+  float resistance;
+  float rr;
+  float o2_perc;
+  float ti;
+  float te;
+  float i_e;
+  float mvi;
+  float mve;
+  float vti;
+  float vte;
+
+  // potentiometer settings
+  float set_o2;
+  float set_max_p;
+  float set_peep;
+  float set_rr;
+  float set_tv;
+  float set_ie;
+
+  uint16_t filter_cycles; // CPU cycles per sample in the filters
+
+  uint8_t is_i;
+  uint8_t phase_changes;
+};
+
+/*
+The public values are the working state of the ventilator task. Other tasks
+must not read them directly, read() gives a copy published at the end of
+each poll() without ever blocking it.
+*/
 class Statistics{
   public:
   float p_act; // actual pressure (cmH2O)
@@ -11,6 +68,10 @@ class Statistics{
   float p_peak; // peak pressure (cmH2O)
   float p_mean; // mean pressure (cmH2O)
   float peep; // positive end-expiratory pressure (cmH2O)
+  float p_plat; // plateau pressure (cmH2O), end of the inspiratory hold, NAN without a flat hold
+  float peep_tot; // total PEEP (cmH2O), end of the expiratory pause, NAN without a flat pause
+  float pif; // peak inspiratory flow (l/min)
+  float pef; // peak expiratory flow (l/min, positive)
   float rr; // respiratory rate
   float o2_perc; // O2 concentration
   float ti; // inspiration time (s)
@@ -20,8 +81,11 @@ class Statistics{
   float mve; // mean volume expiration (l/min)
   float vti; // volume tidal inspiration (ml)
   float vte; // volume tidal expiration (ml)
+  float compliance; // ml/cmH2O, NAN when the inspiration did not fit the lung model
+  float resistance; // cmH2O/l/s
 
   float p_o2; // O2 supply pressure
+  uint16_t p_act_adc; // mean P_ACT_PIN sampler reading of the last batch
   
   //potentiometer settings
   float set_o2; // O2 concentration (21 to 100) %
@@ -31,23 +95,58 @@ class Statistics{
   float set_tv; // Tidal volume (200 - 1000) ml 
   float set_ie; // Inspiration : Expiration, 
   
-  uint8_t is_inspiration_from_automat; // automatic breathing sets this variable
-
   uint8_t is_i; // is inspiration - debug
+  uint8_t phase_changes; // incremented at each inspiration / expiration transition, after the summary values are updated
   
   uint8_t poll(void);
   void init(void);
+  void read(StatisticsSnapshot *s); // any task, never blocks the ventilator task
+  void notify_on_settings(TaskHandle_t task); // gets a task notification when a potentiometer setting changed, once it is published
+  void notify_on_publish(TaskHandle_t task, uint32_t bits); // the bits are set in the task's notification value at each publish
 
   private:
-  uint8_t is_inspiration(void); // returns 0 = inspiration, 1 = expiration
-  float vti_int; // mvi integrator
-  float vte_int; // mvi integrator
+  void add_sample(const RawSample *r, uint32_t mil); // one sampler period
+  void filter(RawSample *r);
+  FilterChain<Median<FILTER_P_ACT_MEDIAN>, Biquad<FILTER_P_ACT_LOWPASS> > p_act_filter; // ADC counts
+  FilterChain<Median<FILTER_FLOW_MEDIAN> > flow_filter; // raw - SFM3300_OFFSET
+  Ema<uint16_t, 4, uint32_t> filter_cycles; // per sample, batch averages including the interrupts
+  uint8_t last_is_insp;
+
+  // volume integrators, trapezoids in raw flow units x 8 us, see FLOW_AREA_ML
+  int64_t vol_area; // slm_sum
+  int64_t vti_area;
+  int64_t vte_area;
+  int32_t area_part; // trapezoids not folded in yet, of the phase in last_is_insp
+  float vol_ml; // vol_area at the last fold
+  uint8_t area_samples;
+  void fold_area(void); // once per batch
+  int16_t last_flow; // raw - SFM3300_OFFSET of the last valid flow reading
+  uint16_t last_flow_us;
+  uint16_t last_flow_ms;
+  uint8_t has_last_flow;
   uint32_t last_insp_started_ms;
   uint32_t last_exp_started_ms;
-  float p_peak_detect;
-  float p_mean_detect;
+  uint16_t p_peak_detect; // ADC counts
+  uint32_t p_mean_detect; // sum of ADC counts
   uint16_t p_mean_count;
-  float peep_detect;
+
+  // pressure at the end of the current phase, ADC counts
+  WindowMean<uint16_t, END_WINDOW_SAMPLES, uint32_t> p_end;
+  WindowMin<uint16_t, END_WINDOW_SAMPLES> p_end_min;
+  WindowMax<uint16_t, END_WINDOW_SAMPLES> p_end_max;
+  uint8_t end_hold; // SAMPLE_HOLD samples in a row at the end of the phase, saturates
+  void reset_end_window(void);
+  float end_plateau(void); // mean of the end window when it is all hold and flat, else NAN
+
+  Ema<int16_t, FLOW_EMA_SHIFT, int32_t> flow_ema; // raw - SFM3300_OFFSET
+  int16_t flow_peak_detect; // of the current phase, furthest from 0 in its direction
+
+  LungMechanics mechanics; // fed every sample of the inspiration
+  Seqlock<StatisticsSnapshot> published;
+  void publish(void);
+  TaskHandle_t settings_task;
+  TaskHandle_t publish_task;
+  uint32_t publish_bits;
 };
 
 extern Statistics statistics;
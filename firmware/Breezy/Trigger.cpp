@@ -0,0 +1,109 @@
+#include <Arduino.h>
+#include <util/atomic.h>
+#include "Configuration.h"
+#include "Trigger.h"
+#include "SFM3300.h"
+
+Trigger trigger;
+
+void Trigger::init(void)
+{
+  state = TRIGGER_IDLE;
+  threshold = 0; // off
+  task = NULL;
+  notify_bits = 0;
+  breaths = 0;
+  last_latency_ms = 0;
+  max_latency_ms = 0;
+}
+
+void Trigger::notify(TaskHandle_t t, uint32_t bits)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+    task = t;
+    notify_bits = bits;
+  }
+}
+
+void Trigger::set_sensitivity(float slm)
+{
+  int16_t t = slm * SFM3300_SCALE;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+    threshold = t;
+  }
+}
+
+float Trigger::sensitivity(void)
+{
+  int16_t t;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+    t = threshold;
+  }
+  return (float)t / SFM3300_SCALE;
+}
+
+void Trigger::arm(uint16_t from)
+{
+  ulTaskNotifyTake(pdTRUE, 0); // forget a trigger that fired after the last take
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+    from_ms = from;
+    baseline.reset();
+    has_baseline = 0;
+    count = 0;
+    state = TRIGGER_ARMED;
+  }
+}
+
+void Trigger::disarm(void)
+{
+  state = TRIGGER_IDLE;
+}
+
+void Trigger::taken(void)
+{
+  uint16_t now = (uint16_t)millis();
+  if(state != TRIGGER_FIRED){
+    return;
+  }
+  last_latency_ms = now - onset_ms;
+  if(last_latency_ms > max_latency_ms) max_latency_ms = last_latency_ms;
+  breaths++;
+  state = TRIGGER_IDLE;
+}
+
+uint8_t Trigger::sample(uint16_t flow, uint16_t ms)
+{
+  if(state != TRIGGER_ARMED && state != TRIGGER_ONSET){
+    return 0;
+  }
+  if(!threshold || (int16_t)(ms - from_ms) < 0){ // off, or too early in the expiration
+    return 0;
+  }
+
+  int16_t f = flow - SFM3300_OFFSET;
+  if(!has_baseline){
+    baseline.push(f);
+    has_baseline = 1;
+    return 0;
+  }
+
+  if((int32_t)f - baseline.value() > threshold){
+    if(state == TRIGGER_ARMED){
+      state = TRIGGER_ONSET;
+      onset_ms = ms;
+      count = 0;
+    }
+    if(++count >= TRIGGER_DEBOUNCE_SAMPLES){
+      state = TRIGGER_FIRED;
+      if(task != NULL){
+        BaseType_t woken = pdFALSE;
+        xTaskNotifyFromISR(task, notify_bits, eSetBits, &woken);
+        return woken == pdTRUE;
+      }
+    }
+  }else{
+    state = TRIGGER_ARMED; // a spike, not an effort
+    baseline.push(f); // the onset samples stay out of the baseline
+  }
+  return 0;
+}
@@ -0,0 +1,65 @@
+#ifndef TRIGGER_H
+#define TRIGGER_H
+
+#include <inttypes.h>
+#include <Arduino_FreeRTOS.h>
+#include "Configuration.h"
+#include "WindowedMetrics.h"
+
+/*
+Flow trigger: detects a patient effort during expiration, so the breath
+controller can start the next inspiration early.
+
+sample() runs in the TWI interrupt on every SFM3300 value (SAMPLER_RATE_HZ).
+While armed, it follows the expiratory baseline flow (leaks, slow
+emptying) with an EMA. A flow more than the sensitivity above the baseline
+starts an onset. TRIGGER_DEBOUNCE_SAMPLES consecutive samples above it
+fire the trigger: the bits given to notify() are set in the task's
+notification value, and the interrupt switches to that task right away
+when it outranks the interrupted one.
+
+  IDLE --arm()--> ARMED --above--> ONSET --debounced--> FIRED --taken()/disarm()--> IDLE
+                    ^                |
+                    +-----below------+
+
+The latency is measured from the first sample of the onset to taken(),
+i.e. when the controller opened the inspiration valve.
+A sensitivity of 0 switches the trigger off (default).
+*/
+
+#define TRIGGER_IDLE 0
+#define TRIGGER_ARMED 1
+#define TRIGGER_ONSET 2
+#define TRIGGER_FIRED 3
+
+class Trigger{
+  public:
+  volatile uint8_t state; // TRIGGER_*
+  uint16_t breaths; // inspirations started by the trigger
+  uint16_t last_latency_ms;
+  uint16_t max_latency_ms;
+
+  void init(void);
+  void notify(TaskHandle_t task, uint32_t bits); // the breath controller, notified when the trigger fires
+  void set_sensitivity(float slm); // l/min above the baseline, 0 = off
+  float sensitivity(void);
+  void arm(uint16_t from_ms); // called by the notified task, watches the samples taken from from_ms (low 16 bits of millis())
+  void disarm(void);
+  void taken(void); // the fired trigger started an inspiration, measures the latency
+
+  uint8_t sample(uint16_t flow, uint16_t ms); // interrupt handler part, raw SFM3300 value, 1 = the interrupt should yield
+
+  private:
+  volatile int16_t threshold; // raw flow units above the baseline, 0 = off
+  TaskHandle_t task;
+  uint32_t notify_bits;
+  uint16_t from_ms;
+  uint16_t onset_ms;
+  Ema<int16_t, TRIGGER_BASELINE_SHIFT, int32_t> baseline; // raw flow - SFM3300_OFFSET
+  uint8_t has_baseline;
+  uint8_t count; // samples above the threshold in a row
+};
+
+extern Trigger trigger;
+
+#endif // #ifndef TRIGGER_H
@@ -0,0 +1,131 @@
+#include <Arduino.h>
+#include <util/atomic.h>
+#include "Configuration.h"
+#include "Uart.h"
+
+Uart uart;
+
+#define TX_MASK (UART_TX_BUFFER_SIZE - 1)
+#define RX_MASK (UART_RX_BUFFER_SIZE - 1)
+
+void Uart::begin(uint32_t baud)
+{
+  tx_head = tx_tail = 0;
+  rx_head = rx_tail = 0;
+  rx_task = NULL;
+  tx_dropped = 0;
+  tx_high_watermark = 0;
+  rx_dropped = 0;
+
+  // double speed mode, same divisor as Arduino HardwareSerial (115200 -> 16, 2.1% error)
+  uint16_t baud_setting = (F_CPU / 4 / baud - 1) / 2;
+  UCSR0A = _BV(U2X0);
+  UBRR0H = baud_setting >> 8;
+  UBRR0L = baud_setting;
+  UCSR0C = _BV(UCSZ01) | _BV(UCSZ00); // 8N1
+  UCSR0B = _BV(RXEN0) | _BV(TXEN0) | _BV(RXCIE0);
+}
+
+uint8_t Uart::write(const uint8_t *data, uint16_t len)
+{
+  uint16_t tail;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+    tail = tx_tail;
+  }
+  
+  uint16_t head = tx_head;
+  uint16_t used = (head - tail) & TX_MASK;
+  if(len > UART_TX_BUFFER_SIZE - 1 - used){ // keep one slot free to tell full from empty
+    tx_dropped++;
+    return 1;
+  }
+
+  while(len--){
+    tx_buf[head] = *data++;
+    head = (head + 1) & TX_MASK;
+  }
+  
+  used = (head - tail) & TX_MASK;
+  if(used > tx_high_watermark) tx_high_watermark = used;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+    tx_head = head;
+    UCSR0B |= _BV(UDRIE0); // start draining
+  }
+  return 0;
+}
+
+uint8_t Uart::print(const char *text)
+{
+  return write((const uint8_t *)text, strlen(text));
+}
+
+void Uart::notify_on_line(TaskHandle_t task)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+    rx_task = task;
+  }
+}
+
+uint8_t Uart::available(void)
+{
+  return (rx_head - rx_tail) & RX_MASK;
+}
+
+int16_t Uart::read(void)
+{
+  uint8_t tail = rx_tail;
+  if(rx_head == tail){
+    return -1;
+  }
+  uint8_t c = rx_buf[tail];
+  rx_tail = (tail + 1) & RX_MASK;
+  return c;
+}
+
+void Uart::tx_isr(void)
+{
+  uint16_t tail = tx_tail;
+  if(tx_head == tail){ // ring empty - stop the interrupt until the next write()
+    UCSR0B &= ~_BV(UDRIE0);
+    return;
+  }
+  UDR0 = tx_buf[tail];
+  tx_tail = (tail + 1) & TX_MASK;
+}
+
+void Uart::rx_isr(void)
+{
+  uint8_t status = UCSR0A;
+  uint8_t c = UDR0;
+  
+  if(status & _BV(DOR0)){
+    rx_dropped++;
+  }
+  if(status & (_BV(FE0) | _BV(UPE0))){
+    return; // framing / parity error - discard the byte
+  }
+  
+  uint8_t head = rx_head;
+  uint8_t next = (head + 1) & RX_MASK;
+  if(next == rx_tail){
+    rx_dropped++;
+    return;
+  }
+  rx_buf[head] = c;
+  rx_head = next;
+
+  if(c == '\n' && rx_task != NULL){
+    vTaskNotifyGiveFromISR(rx_task, NULL); // the reader runs at the next tick
+  }
+}
+
+ISR(USART0_UDRE_vect)
+{
+  uart.tx_isr();
+}
+
+ISR(USART0_RX_vect)
+{
+  uart.rx_isr();
+}
@@ -0,0 +1,57 @@
+#ifndef UART_H
+#define UART_H
+
+#include <inttypes.h>
+#include <Arduino_FreeRTOS.h>
+#include "Configuration.h"
+
+/*
+Interrupt driven USART0 driver, replaces Arduino Serial.
+
+Transmit: write() copies a whole message into the TX ring buffer and returns
+immediately, the UDRE interrupt drains the ring to the wire. When the message
+does not fit, it is dropped as a whole and counted - the caller never waits
+for the line to drain.
+Receive: the RX interrupt fills a small ring buffer, read() takes from it.
+When a line end arrives, the task given to notify_on_line() gets a task notification.
+
+write()/print() are not reentrant - callers hold xSerialSemaphore.
+*/
+
+#if (UART_TX_BUFFER_SIZE & (UART_TX_BUFFER_SIZE - 1)) || (UART_RX_BUFFER_SIZE & (UART_RX_BUFFER_SIZE - 1))
+#error UART buffer sizes must be powers of 2
+#endif
+
+class Uart{
+  public:
+  void begin(uint32_t baud);
+
+  uint8_t write(const uint8_t *data, uint16_t len); // 0 = queued, 1 = dropped (queue full)
+  uint8_t print(const char *text);
+  
+  void notify_on_line(TaskHandle_t task);
+  uint8_t available(void);
+  int16_t read(void); // -1 when there is nothing to read
+
+  // diagnostics
+  uint16_t tx_dropped; // messages dropped because the TX ring was full
+  uint16_t tx_high_watermark; // most bytes ever waiting in the TX ring
+  uint16_t rx_dropped; // bytes lost because the RX ring was full or the USART overran
+  
+  // interrupt handlers
+  void tx_isr(void);
+  void rx_isr(void);
+
+  private:
+  uint8_t tx_buf[UART_TX_BUFFER_SIZE];
+  volatile uint16_t tx_head; // written by write()
+  volatile uint16_t tx_tail; // written by tx_isr()
+  uint8_t rx_buf[UART_RX_BUFFER_SIZE];
+  volatile uint8_t rx_head; // written by rx_isr()
+  volatile uint8_t rx_tail; // written by read()
+  TaskHandle_t rx_task; // woken at each '\n'
+};
+
+extern Uart uart;
+
+#endif // #ifndef UART_H
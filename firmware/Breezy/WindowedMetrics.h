@@ -0,0 +1,249 @@
+#ifndef WINDOWEDMETRICS_H
+#define WINDOWEDMETRICS_H
+
+#include <inttypes.h>
+
+/*
+Streaming metrics over the last N samples, O(1) per sample and fixed size.
+Meant for the sampler rate stream in Statistics, T is usually ADC counts or
+raw flow. N is at most 255.
+
+WindowMean<T, N, S>  mean of the last N samples, S holds the sum
+WindowMax<T, N>      max of the last N samples (monotonic deque)
+WindowMin<T, N>      min of the last N samples
+Ema<T, SHIFT, A>     exponential moving average, weight 2^-SHIFT, A holds T << SHIFT
+WindowPercentile<T, N, PERCENT>
+                     approximate PERCENT percentile of windows of N samples (P-square)
+*/
+
+template <class T, uint8_t N, class S>
+class WindowMean{
+  public:
+  WindowMean() { reset(); }
+
+  void reset(void)
+  {
+    sum = 0;
+    head = 0;
+    count = 0;
+  }
+
+  void push(T x)
+  {
+    if(count == N){
+      sum -= ring[head]; // falls out of the window
+    }else{
+      count++;
+    }
+    ring[head] = x;
+    sum += x;
+    if(++head >= N) head = 0;
+  }
+
+  uint8_t full(void) const { return count == N; }
+  uint8_t size(void) const { return count; }
+  S total(void) const { return sum; }
+  T mean(void) const { return count ? (T)(sum / count) : 0; }
+
+  private:
+  T ring[N];
+  S sum;
+  uint8_t head;
+  uint8_t count;
+};
+
+// Candidates kept in sample order, each one beats all that follow it.
+// The front is the result, it leaves when it is older than N samples.
+template <class T, uint8_t N, uint8_t IS_MAX>
+class MonotonicWindow{
+  public:
+  MonotonicWindow() { reset(); }
+
+  void reset(void)
+  {
+    first = 0;
+    count = 0;
+    n = 0;
+  }
+
+  void push(T x)
+  {
+    n++;
+    if(count && (uint8_t)(n - index[first]) >= N){ // front is out of the window
+      if(++first >= N) first = 0;
+      count--;
+    }
+    while(count && beats(x, values[last()])){
+      count--; // can never be the result again
+    }
+    uint16_t i = first + count;
+    if(i >= N) i -= N;
+    values[i] = x;
+    index[i] = n;
+    count++;
+  }
+
+  uint8_t empty(void) const { return count == 0; }
+  T value(void) const { return values[first]; }
+
+  private:
+  T values[N];
+  uint8_t index[N]; // sample number, wraps
+  uint8_t first;
+  uint8_t count;
+  uint8_t n; // samples pushed, wraps
+
+  uint8_t last(void) const
+  {
+    uint16_t i = first + count - 1;
+    return i >= N ? i - N : i;
+  }
+
+  static uint8_t beats(T a, T b) { return IS_MAX ? a >= b : a <= b; }
+};
+
+template <class T, uint8_t N>
+class WindowMax : public MonotonicWindow<T, N, 1>{};
+
+template <class T, uint8_t N>
+class WindowMin : public MonotonicWindow<T, N, 0>{};
+
+template <class T, uint8_t SHIFT, class A>
+class Ema{
+  public:
+  Ema() { reset(); }
+
+  void reset(void) { started = 0; }
+
+  void push(T x)
+  {
+    if(!started){
+      acc = (A)x * ((A)1 << SHIFT); // start at the first sample, not at 0
+      started = 1;
+      return;
+    }
+    acc += (A)x - (acc >> SHIFT);
+  }
+
+  T value(void) const { return (T)(acc >> SHIFT); }
+
+  private:
+  A acc;
+  uint8_t started;
+};
+
+/*
+P-square (Jain and Chlamtac): five markers at the minimum, PERCENT / 2,
+PERCENT, (100 + PERCENT) / 2 and the maximum of the samples so far. Each
+sample moves the marker positions, and a marker more than one position off
+its desired position is moved by one, its height by a parabola through its
+neighbours. No samples are kept, the height of the middle marker is the
+estimate. The window restarts every N samples, so N can be far larger than
+the ring of the others; value() is the estimate of the last complete window,
+before the first one the estimate of the samples so far.
+*/
+template <class T, uint16_t N, uint8_t PERCENT = 50>
+class WindowPercentile{
+  public:
+  WindowPercentile() { reset(); }
+
+  void reset(void)
+  {
+    count = 0;
+    complete = 0;
+  }
+
+  void push(T x)
+  {
+    if(count < 5){ // the first five samples are the markers, sorted
+      uint8_t i = count;
+      while(i && q[i - 1] > x){
+        q[i] = q[i - 1];
+        i--;
+      }
+      q[i] = x;
+      if(++count == 5){
+        for(uint8_t j = 0; j < 5; j++) pos[j] = j;
+        want[0] = 0;
+        want[1] = 2 * P;
+        want[2] = 4 * P;
+        want[3] = 2 + 2 * P;
+        want[4] = 4;
+      }
+    }else{
+      add(x);
+      count++;
+    }
+    if(count == N){
+      last = estimate();
+      complete = 1;
+      count = 0;
+    }
+  }
+
+  uint8_t full(void) const { return complete; }
+  T value(void) const { return complete ? last : estimate(); }
+
+  private:
+  static constexpr float P = PERCENT / 100.0f;
+  float q[5]; // marker heights
+  uint16_t pos[5]; // marker positions, 0 based
+  float want[5]; // desired positions
+  uint16_t count; // samples in the window
+  T last; // estimate of the last complete window
+  uint8_t complete;
+
+  void add(float x)
+  {
+    uint8_t k; // cell of x, the markers above it move up
+    if(x < q[0]){
+      q[0] = x;
+      k = 0;
+    }else if(x >= q[4]){
+      q[4] = x;
+      k = 3;
+    }else{
+      k = 0;
+      while(x >= q[k + 1]) k++;
+    }
+    for(uint8_t i = k + 1; i < 5; i++) pos[i]++;
+    want[1] += P / 2;
+    want[2] += P;
+    want[3] += (1 + P) / 2;
+    want[4] += 1;
+
+    for(uint8_t i = 1; i < 4; i++){
+      float d = want[i] - pos[i];
+      int8_t s;
+      if(d >= 1 && pos[i + 1] - pos[i] > 1) s = 1;
+      else if(d <= -1 && pos[i - 1] - pos[i] < -1) s = -1;
+      else continue;
+      float h = parabolic(i, s);
+      if(!(q[i - 1] < h && h < q[i + 1])){ // not monotonic, linear towards the neighbour
+        h = q[i] + s * (q[i + s] - q[i]) / ((int16_t)pos[i + s] - (int16_t)pos[i]);
+      }
+      q[i] = h;
+      pos[i] += s;
+    }
+  }
+
+  float parabolic(uint8_t i, int8_t s) const
+  {
+    float below = (int16_t)pos[i] - (int16_t)pos[i - 1];
+    float above = (int16_t)pos[i + 1] - (int16_t)pos[i];
+    return q[i] + s / (below + above) * ((below + s) * (q[i + 1] - q[i]) / above
+                                         + (above - s) * (q[i] - q[i - 1]) / below);
+  }
+
+  T estimate(void) const // an integer T is truncated
+  {
+    if(!count) return 0; // no sample yet
+    if(count >= 5) return (T)q[2];
+    return (T)q[(uint8_t)(P * (count - 1) + 0.5f)]; // nearest rank of the sorted samples so far
+  }
+
+  static_assert(N >= 5, "WindowPercentile: N must be at least 5");
+  static_assert(PERCENT > 0 && PERCENT < 100, "WindowPercentile: PERCENT must be 1 to 99");
+};
+
+#endif // #ifndef WINDOWEDMETRICS_H
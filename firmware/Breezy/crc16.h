@@ -7,13 +7,16 @@
 class CRC16
 {
   public:
-  uint16_t CRC16::get_crc16(char *text);
+  uint16_t get_crc16(const char *text); // CRC of a whole NUL-terminated string
 
+  // streaming interface - reset(), then feed the line piece by piece while it is written
+  void reset(void);
+  void update(uint8_t ch);
+  void update(const char *data, uint16_t len);
+  uint16_t get(void) { return good_crc; }
 
   private:
   uint16_t good_crc;
-  void update_good_crc(uint8_t ch);
-  void augment_message_for_good_crc();
   
 };
 
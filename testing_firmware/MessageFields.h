@@ -0,0 +1,60 @@
+#ifndef MESSAGE_FIELDS_H
+#define MESSAGE_FIELDS_H
+
+/*
+Value fields of the text protocol, see docs/serial_protocol.md
+
+This is the only place the field list and formats are written down.
+The firmware encoders (Messaging.cpp), the testing sketch and the host decoder
+(tools/breezy_decode) expand these lists at compile time, so adding a field
+here changes all of them. testing_firmware/MessageFields.h is a copy of this file.
+
+X(name, label, width, prec, min, max, kind, comment)
+  name     field name, also the member it is read from (TelemetrySample / Statistics)
+  label    column name in the protocol document
+  width    minimum printed width, as dtostrf
+  prec     digits after the decimal point
+  min, max expected range
+  kind     FIXED: dtostrf(value, width, prec)
+           RATIO: value is ti/te, printed as "1:<te/ti>" or "<ti/te>:1" with prec digits
+*/
+
+// waveform values, sent with every sample (breezy,1 and wave,1)
+#define BREEZY_SAMPLE_FIELDS(X) \
+  X(p_act,   "cmH2O",         5, 2,  -99,  99, FIXED, "Actual pressure (to be plotted)") \
+  X(slm,     "l/min",         5, 2, -999, 999, FIXED, "Actual flow (to be plotted)") \
+  X(slm_sum, "ml",            5, 2,    0, 9999, FIXED, "Actual volume (to be plotted)")
+
+// per-breath values (breezy,1 and summary,1)
+#define BREEZY_BREATH_FIELDS(X) \
+  X(p_peak,  "Ppeak (cmH2O)", 5, 1,    0,  99, FIXED, "Peak pressure") \
+  X(p_mean,  "Pmean (cmH2O)", 2, 0,    0,  99, FIXED, "Mean pressure") \
+  X(peep,    "PEEP (cmH2O)",  2, 0,    0,  99, FIXED, "Positive end-expiratory pressure") \
+  X(rr,      "RR",            2, 0,    0,  99, FIXED, "Respiratory rate (b/min)") \
+  X(o2_perc, "O2 (%)",        3, 0,    0, 100, FIXED, "Oxygen concentration") \
+  X(ti,      "Ti (s)",        5, 2,    0,  99, FIXED, "Inspiration time") \
+  X(i_e,     "I:E",           0, 1,    0,  99, RATIO, "Inspiration : Expiration ratio") \
+  X(mvi,     "MVi (l/min)",   4, 1,    0,  99, FIXED, "Mean volume inspiration") \
+  X(mve,     "MVe (l/min)",   4, 1,    0,  99, FIXED, "Mean volume expiration") \
+  X(vti,     "VTi (ml)",      3, 0,    0, 9999, FIXED, "Volume tidal inspiration") \
+  X(vte,     "VTe (ml)",      3, 0,    0, 9999, FIXED, "Volume tidal expiration")
+
+// lung mechanics of the last breath (summary,1 only, breezy,1 keeps its layout)
+#define BREEZY_MECHANICS_FIELDS(X) \
+  X(compliance, "C (ml/cmH2O)", 5, 1, 0, 999, FIXED, "Compliance, fitted over the inspiration") \
+  X(resistance, "R (cmH2O/l/s)", 5, 1, 0, 999, FIXED, "Resistance, fitted over the inspiration") \
+  X(p_plat,  "Pplat (cmH2O)", 4, 1,    0,  99, FIXED, "Plateau pressure, end of the inspiratory hold") \
+  X(peep_tot, "PEEPtot (cmH2O)", 4, 1,  0,  99, FIXED, "Total PEEP, end of the expiratory pause")
+
+// the values of each line, in order: S expands the sample fields, B the per-breath ones
+#define BREEZY_MSG_LAYOUT(S, B) BREEZY_SAMPLE_FIELDS(S) BREEZY_BREATH_FIELDS(B)
+#define WAVE_MSG_LAYOUT(S, B) BREEZY_SAMPLE_FIELDS(S)
+#define SUMMARY_MSG_LAYOUT(S, B) BREEZY_BREATH_FIELDS(B) BREEZY_MECHANICS_FIELDS(B)
+
+// counts the fields of a list: BREEZY_FIELD_COUNT(BREEZY_SAMPLE_FIELDS)
+#define BREEZY_FIELD_ONE(name, label, width, prec, min, max, kind, comment) + 1
+#define BREEZY_FIELD_COUNT(list) (0 list(BREEZY_FIELD_ONE))
+// and of a line: BREEZY_LAYOUT_COUNT(SUMMARY_MSG_LAYOUT)
+#define BREEZY_LAYOUT_COUNT(layout) (0 layout(BREEZY_FIELD_ONE, BREEZY_FIELD_ONE))
+
+#endif // #ifndef MESSAGE_FIELDS_H
@@ -3,6 +3,7 @@ Testing sketch for Breezy app for Arduino Nano
 */
 
 #include "crc16.h"
+#include "MessageFields.h"
 
   float p_act=35; // actual pressure (cmH2O)
   float slm=65; // flow (l/min)
@@ -29,6 +30,25 @@ void setup() {
   Serial.println("Breezy app testing sketch");
 
 }
+
+// "1:2.0" or "2.0:1", like the ventilator firmware
+static void put_ie(char *msg, float i_e, int prec)
+{
+  if (i_e > 1){
+    dtostrf(i_e, 0, prec, &msg[strlen(msg)]);
+    strcat(msg, ":1");
+  }else{
+    strcat(msg, "1:");
+    dtostrf(1.0 / i_e, 0, prec, &msg[strlen(msg)]);
+  }
+}
+
+// the fields of MessageFields.h, read from the globals of the same name
+#define PUT_FIELD_FIXED(v, width, prec) dtostrf(v, width, prec, &msg[strlen(msg)])
+#define PUT_FIELD_RATIO(v, width, prec) put_ie(msg, v, prec)
+#define PUT_FIELD(name, label, width, prec, min, max, kind, comment) \
+  PUT_FIELD_##kind(name, width, prec); strcat(msg, ",");
+
 void loop() {
  
  uint16_t time = (uint16_t)millis();
@@ -36,62 +56,22 @@ void loop() {
     char msg[200];
   sprintf(msg, "breezy,1,%5u,", time );
   
-  dtostrf(p_act, 5, 2, &msg[strlen(msg)]);
-  strcat(msg, ",");
-  
+  BREEZY_MSG_LAYOUT(PUT_FIELD, PUT_FIELD)
+
   p_act=p_act+15*sin(random(0,6.28));
 
   if (p_act>=50) p_act=25;
   if (p_act<=0) p_act=25;
   
-  dtostrf(slm, 5, 2, &msg[strlen(msg)]);
-  strcat(msg, ",");
-  
   slm=slm+1;
   
   if (slm==101) slm=-100;
   
-  dtostrf(slm_sum, 5, 2, &msg[strlen(msg)]);
-  strcat(msg, ",");
-  
    slm_sum=slm_sum+10*cos(random(0,6.28));
   
   if (slm_sum>=800) slm_sum=230;
   if (slm_sum<=0) slm_sum=250;
 
-  dtostrf(p_peak, 5, 1, &msg[strlen(msg)]);
-  strcat(msg, ",");
-  
-  dtostrf(p_mean, 2, 0, &msg[strlen(msg)]);
-  strcat(msg, ",");
-  
-  dtostrf(peep, 2, 0, &msg[strlen(msg)]);
-  strcat(msg, ",");
-  
-  dtostrf(rr, 2, 0, &msg[strlen(msg)]);
-  strcat(msg, ",");
-  
-  dtostrf(o2_perc, 3, 0, &msg[strlen(msg)]);
-  strcat(msg, ",");
-  
-  dtostrf(ti, 5, 2, &msg[strlen(msg)]);
-  strcat(msg, ",");
-  
-  dtostrf(i_e, 4, 1, &msg[strlen(msg)]);
-  strcat(msg, ",");
-
-  dtostrf(mvi, 4, 1, &msg[strlen(msg)]);
-  strcat(msg, ",");
-
-  dtostrf(mve, 4, 1, &msg[strlen(msg)]);
-  strcat(msg, ",");
-
-  dtostrf(vti, 3, 0, &msg[strlen(msg)]);
-  strcat(msg, ",");
-
-  dtostrf(vte, 3, 0, &msg[strlen(msg)]);
-  strcat(msg, ",");
-
   uint16_t crc = Crc16.get_crc16(msg);
 
   sprintf(&msg[strlen(msg)], "%5u\r\n", crc);
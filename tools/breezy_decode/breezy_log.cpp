@@ -0,0 +1,416 @@
+// Validates and reduces Breezy text protocol logs (breezy,1, wave,1,
+// summary,1 and service,1 lines).
+//
+//   breezy_log [--csv] [log...]      check logs (stdin without arguments or for "-")
+//   breezy_log --bench [MB]          decode a synthetic log held in memory
+//   breezy_log --fields              print the field table for the protocol document
+//
+// Logs are memory mapped, so multi-GB files are read straight from the page
+// cache. --csv prints every valid record with the unwrapped time; the
+// counters go to stderr.
+
+#include "breezy_text.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using breezy::TextDecoder;
+using breezy::TextRecord;
+
+namespace {
+
+struct CsvPrinter {
+    void operator()(const TextRecord &r) const {
+        std::printf("%s,%llu,%u", breezy::text_kind_name(r.kind),
+                    static_cast<unsigned long long>(r.t_ms), r.time);
+        for (int i = 0; i < r.count; i++) {
+            std::printf(",%g", r.v[i]);
+        }
+        std::putchar('\n');
+    }
+};
+
+// Keeps the decoded values live without printing them
+struct Checksum {
+    double *sum;
+    void operator()(const TextRecord &r) const {
+        for (int i = 0; i < r.count; i++) {
+            if (!std::isnan(r.v[i])) {
+                *sum += r.v[i];
+            }
+        }
+    }
+};
+
+template <class F> bool decode_file(const char *path, TextDecoder &dec, F f, size_t &bytes)
+{
+    if (std::strcmp(path, "-") == 0) {
+        std::vector<char> buf;
+        char chunk[1 << 16];
+        size_t n;
+        while ((n = std::fread(chunk, 1, sizeof(chunk), stdin)) > 0) {
+            buf.insert(buf.end(), chunk, chunk + n);
+        }
+        bytes += buf.size();
+        if (!buf.empty()) {
+            dec.decode_buffer(&buf[0], buf.size(), f);
+        }
+        return true;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        std::perror(path);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        std::perror(path);
+        close(fd);
+        return false;
+    }
+    size_t len = static_cast<size_t>(st.st_size);
+    if (len > 0) {
+        void *m = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m == MAP_FAILED) {
+            std::perror(path);
+            close(fd);
+            return false;
+        }
+        madvise(m, len, MADV_SEQUENTIAL);
+        dec.decode_buffer(static_cast<const char *>(m), len, f);
+        munmap(m, len);
+    }
+    close(fd);
+    bytes += len;
+    return true;
+}
+
+void print_counters(const TextDecoder &dec)
+{
+    std::fprintf(stderr, "lines: %lu  records: %lu (", dec.lines, dec.records);
+    for (int k = 0; k < breezy::TEXT_KINDS; k++) {
+        std::fprintf(stderr, "%s%s %lu", k ? ", " : "", breezy::text_kind_name(k), dec.by_kind[k]);
+    }
+    std::fprintf(stderr, ")\ncomments: %lu  reset-time: %lu  without crc: %lu  time steps back: %lu\n",
+                 dec.comments, dec.resets, dec.no_crc, dec.time.backsteps);
+    std::fprintf(stderr, "values out of range: %lu\n", dec.out_of_range);
+    std::fprintf(stderr, "parse errors: %lu  crc errors: %lu\n", dec.parse_errors, dec.crc_errors);
+}
+
+// dtostrf(v, width, prec) for the synthetic log
+void put_fixed(std::string &s, double v, int width, int prec)
+{
+    char b[32];
+    std::snprintf(b, sizeof(b), "%*.*f", width, prec, v);
+    s += b;
+}
+
+void put_ratio(std::string &s, double i_e, int prec)
+{
+    if (i_e > 1) {
+        put_fixed(s, i_e, 0, prec);
+        s += ":1";
+    } else {
+        s += "1:";
+        put_fixed(s, 1 / i_e, 0, prec);
+    }
+}
+
+// Values of one synthetic sample, members named like the fields
+struct SyntheticSample {
+    double p_act, slm, slm_sum;
+    double p_peak, p_mean, peep, rr, o2_perc, ti, i_e, mvi, mve, vti, vte;
+    double compliance, resistance, p_plat, peep_tot;
+};
+
+const unsigned long BREATH_SAMPLES = 60; // 3 s breath at 50 ms
+
+void synthetic_values(SyntheticSample &x, unsigned long n)
+{
+    const double pi = 3.14159265358979;
+    double phase = static_cast<double>(n % BREATH_SAMPLES) / BREATH_SAMPLES;
+
+    x.p_act = phase < 0.33 ? 20 * std::sin(phase / 0.33 * pi) + 5 : 5;
+    x.slm = phase < 0.33 ? 40 * std::sin(phase / 0.33 * pi) : -30 * std::exp(-(phase - 0.33) * 8);
+    x.slm_sum = 500 * std::sin(phase * pi);
+    x.p_peak = 25.3;
+    x.p_mean = 11;
+    x.peep = 5;
+    x.rr = 20;
+    x.o2_perc = 21;
+    x.ti = 1.0;
+    x.i_e = 0.5 + (n / BREATH_SAMPLES % 5) * 0.1;
+    x.mvi = 9.8;
+    x.mve = 9.6;
+    x.vti = n % 1000 == 999 ? NAN : 490; // not measured, as in the example logs
+    x.vte = 480;
+    x.compliance = 48.5;
+    x.resistance = 12.3;
+    x.p_plat = 22.1;
+    x.peep_tot = 5.4 + (n / BREATH_SAMPLES % 3) * 0.5;
+}
+
+// The layouts of MessageFields.h expanded as Messaging.cpp does, with the
+// values read from x instead of the TelemetrySample / Statistics
+#define PUT_FIELD_FIXED(v, width, prec) put_fixed(s, v, width, prec)
+#define PUT_FIELD_RATIO(v, width, prec) put_ratio(s, v, prec)
+#define PUT_FIELD(name, label, width, prec, min, max, kind, comment) \
+    PUT_FIELD_##kind(x.name, width, prec); s += ',';
+
+void put_head(std::string &s, const char *head, unsigned long n)
+{
+    char b[16];
+    std::snprintf(b, sizeof(b), "%5u,", static_cast<unsigned>(n * 50) & 0xFFFF);
+    s += head;
+    s += b;
+}
+
+void put_crc(std::string &s, size_t start)
+{
+    char b[16];
+    std::snprintf(b, sizeof(b), "%5u\r\n", breezy::text_crc16(&s[start], s.size() - start));
+    s += b;
+}
+
+// Messaging::print_msg
+void synthetic_line(std::string &s, const SyntheticSample &x, unsigned long n)
+{
+    size_t start = s.size();
+    put_head(s, "breezy,1,", n);
+    BREEZY_MSG_LAYOUT(PUT_FIELD, PUT_FIELD)
+    put_crc(s, start);
+}
+
+// Messaging::print_summary_msg
+void synthetic_summary(std::string &s, const SyntheticSample &x, unsigned long n)
+{
+    size_t start = s.size();
+    put_head(s, "summary,1,", n);
+    SUMMARY_MSG_LAYOUT(PUT_FIELD, PUT_FIELD)
+    put_crc(s, start);
+}
+
+#undef PUT_FIELD
+
+// Compares the decoded values of a line with what was encoded, in the order
+// of the layout; a value may be off by half its last printed digit
+struct LayoutCheck {
+    const TextRecord *r;
+    int i;
+    bool ok;
+
+    void field(const char *name, double v, int prec, bool ratio)
+    {
+        double got = i < r->count ? r->v[i] : NAN;
+        // I:E is printed as 1:<te/ti> or <ti/te>:1, compare the printed side
+        double tol = 0.5 * std::pow(10.0, -prec) + 1e-9;
+        double err = ratio ? std::fabs((v > 1 ? got : 1 / got) - (v > 1 ? v : 1 / v))
+                           : std::fabs(got - v);
+        if (!(err <= tol) && !(std::isnan(v) && std::isnan(got))) {
+            std::fprintf(stderr, "FAILED: %s line, field %d (%s): sent %g, decoded %g\n",
+                         breezy::text_kind_name(r->kind), i, name, v, got);
+            ok = false;
+        }
+        i++;
+    }
+};
+
+#define CHECK_FIELD_FIXED(name, v, prec) c.field(#name, v, prec, false)
+#define CHECK_FIELD_RATIO(name, v, prec) c.field(#name, v, prec, true)
+#define CHECK_FIELD(name, label, width, prec, min, max, kind, comment) \
+    CHECK_FIELD_##kind(name, x.name, prec);
+
+// Decodes one line of each kind as the firmware sends them and checks every
+// value, so a field moved between the lines fails here
+bool check_layouts()
+{
+    bool ok = true;
+    for (unsigned long n = BREATH_SAMPLES - 1; n < 20 * BREATH_SAMPLES; n += BREATH_SAMPLES / 4) {
+        SyntheticSample x;
+        synthetic_values(x, n);
+        for (int kind = 0; kind < 2; kind++) {
+            std::string s;
+            if (kind == 0) {
+                synthetic_line(s, x, n);
+            } else {
+                synthetic_summary(s, x, n);
+            }
+            TextDecoder dec;
+            TextRecord r;
+            if (dec.decode_line(s.data(), s.data() + s.size() - 2, r) != breezy::LINE_RECORD) {
+                std::fprintf(stderr, "FAILED: not decoded: %s", s.c_str());
+                ok = false;
+                continue;
+            }
+            LayoutCheck c = { &r, 0, true };
+            if (kind == 0) {
+                BREEZY_MSG_LAYOUT(CHECK_FIELD, CHECK_FIELD)
+            } else {
+                SUMMARY_MSG_LAYOUT(CHECK_FIELD, CHECK_FIELD)
+            }
+            int expected = kind == 0 ? breezy::TEXT_BREEZY : breezy::TEXT_SUMMARY;
+            if (r.kind != expected || r.count != c.i) {
+                std::fprintf(stderr, "FAILED: %s line with %d values, %d sent\n",
+                             breezy::text_kind_name(r.kind), r.count, c.i);
+                c.ok = false;
+            }
+            ok = ok && c.ok;
+        }
+    }
+    return ok;
+}
+
+#undef CHECK_FIELD
+
+int bench(double mb)
+{
+    const unsigned long CORRUPT_EVERY = 1000;
+    if (!check_layouts()) {
+        return 2;
+    }
+
+    std::string log;
+    log.reserve(static_cast<size_t>(mb * 1e6) + 256);
+    unsigned long n = 0, summaries = 0, corrupted = 0;
+    log += "# synthetic breezy,1 log\r\n";
+    while (log.size() < mb * 1e6) {
+        SyntheticSample x;
+        synthetic_values(x, n);
+        size_t start = log.size();
+        synthetic_line(log, x, n);
+        if (n % CORRUPT_EVERY == CORRUPT_EVERY / 2) {
+            log[start + 12] ^= 1; // a bit flip in the time field
+            corrupted++;
+        }
+        if (n % BREATH_SAMPLES == BREATH_SAMPLES - 1) { // end of a breath
+            synthetic_summary(log, x, n);
+            summaries++;
+        }
+        n++;
+    }
+    unsigned long lines = n + summaries;
+
+    std::fprintf(stderr, "synthetic log: %lu lines, %.1f MB\n", lines, log.size() / 1e6);
+    double best = 0;
+    TextDecoder dec;
+    for (int run = 0; run < 5; run++) {
+        dec = TextDecoder();
+        double sum = 0;
+        Checksum f = { &sum };
+        std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+        dec.decode_buffer(log.data(), log.size(), f);
+        std::chrono::duration<double> dt = std::chrono::steady_clock::now() - t0;
+        double rate = log.size() / dt.count() / 1e6;
+        std::fprintf(stderr, "run %d: %.1f ms  %.0f MB/s  %.1f M lines/s  (sum %g)\n", run,
+                     dt.count() * 1e3, rate, lines / dt.count() / 1e6, sum);
+        if (rate > best) {
+            best = rate;
+        }
+    }
+    print_counters(dec);
+    std::fprintf(stderr, "best: %.0f MB/s\n", best);
+
+    // the decoder must find exactly what was generated
+    bool ok = dec.by_kind[breezy::TEXT_BREEZY] == n - corrupted &&
+              dec.by_kind[breezy::TEXT_SUMMARY] == summaries && dec.records == lines - corrupted &&
+              dec.crc_errors == corrupted && dec.parse_errors == 0 && dec.out_of_range == 0 &&
+              dec.comments == 1 && dec.time.backsteps == 0;
+    if (!ok) {
+        std::fprintf(stderr, "FAILED: expected %lu breezy and %lu summary records, %lu crc errors\n",
+                     n - corrupted, summaries, corrupted);
+    }
+    return ok ? 0 : 2;
+}
+
+// The value rows of the field table in docs/serial_protocol.md
+void print_fields()
+{
+    for (int i = 0; i < breezy::F_FIELD_COUNT; i++) {
+        const breezy::FieldInfo &f = breezy::BREEZY_FIELDS[i];
+        // integer digits from the expected range, then the decimals
+        double big = std::max(std::fabs(f.min), std::fabs(f.max));
+        std::string format(big >= 1 ? static_cast<size_t>(std::log10(big)) + 1 : 1, '#');
+        if (f.prec) {
+            format += '.';
+            format.append(f.prec, '#');
+        }
+        if (f.kind == breezy::FIELD_RATIO) {
+            format = "1:" + format.substr(format.size() - f.prec - 2) + " or " +
+                     format.substr(format.size() - f.prec - 2) + ":1";
+        }
+        std::printf("| `%s` | %s `%s` | %g to %g | %s (`%s`) |\n", f.label,
+                    f.kind == breezy::FIELD_RATIO ? "ratio" : "float", format.c_str(),
+                    f.min, f.max, f.comment, f.name);
+    }
+}
+
+void usage()
+{
+    std::fprintf(stderr, "usage: breezy_log [--csv] [log...]\n"
+                         "       breezy_log --bench [MB]\n"
+                         "       breezy_log --fields\n");
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    bool csv = false;
+    std::vector<const char *> files;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--csv") == 0) {
+            csv = true;
+        } else if (std::strcmp(argv[i], "--bench") == 0) {
+            double mb = i + 1 < argc ? std::atof(argv[i + 1]) : 200;
+            return bench(mb > 0 ? mb : 200);
+        } else if (std::strcmp(argv[i], "--fields") == 0) {
+            print_fields();
+            return 0;
+        } else if (argv[i][0] == '-' && argv[i][1]) {
+            usage();
+            return 1;
+        } else {
+            files.push_back(argv[i]);
+        }
+    }
+    if (files.empty()) {
+        files.push_back("-");
+    }
+
+    TextDecoder dec;
+    size_t bytes = 0;
+    bool ok = true;
+    double sum = 0;
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < files.size(); i++) {
+        if (csv) {
+            ok = decode_file(files[i], dec, CsvPrinter(), bytes) && ok;
+        } else {
+            Checksum f = { &sum };
+            ok = decode_file(files[i], dec, f, bytes) && ok;
+        }
+    }
+    std::chrono::duration<double> dt = std::chrono::steady_clock::now() - t0;
+
+    print_counters(dec);
+    if (!csv && dt.count() > 0) {
+        std::fprintf(stderr, "%.1f MB in %.1f ms (%.0f MB/s)\n", bytes / 1e6, dt.count() * 1e3,
+                     bytes / dt.count() / 1e6);
+    }
+    if (!ok) {
+        return 1;
+    }
+    return dec.parse_errors || dec.crc_errors ? 2 : 0;
+}
@@ -0,0 +1,363 @@
+#include "breezy_text.h"
+
+#include <cmath>
+#include <cstring>
+
+namespace breezy {
+
+namespace {
+
+// Two-byte slicing tables for the CRC: crc_t1 is the usual byte table,
+// crc_t2[x] is the effect of x followed by a zero byte. Two independent
+// lookups per pair of bytes instead of a chain of two.
+struct CrcTables {
+    uint16_t t1[256];
+    uint16_t t2[256];
+
+    CrcTables() {
+        for (unsigned i = 0; i < 256; i++) {
+            uint16_t c = static_cast<uint16_t>(i << 8);
+            for (int b = 0; b < 8; b++) {
+                c = static_cast<uint16_t>(c & 0x8000 ? (c << 1) ^ 0x1021 : c << 1);
+            }
+            t1[i] = c;
+        }
+        for (unsigned i = 0; i < 256; i++) {
+            t2[i] = static_cast<uint16_t>((t1[i] << 8) ^ t1[t1[i] >> 8]);
+        }
+    }
+};
+
+const CrcTables crc_tables;
+
+// the augmented algorithm with init 0xFFFF is the direct one with init 0x1D0F
+const uint16_t CRC_INIT_DIRECT = 0x1D0F;
+
+const double POW10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+inline bool is_digit(char c, unsigned &d)
+{
+    d = static_cast<unsigned>(c - '0');
+    return d < 10;
+}
+
+inline bool match_word(const char *p, const char *e, const char *w)
+{
+    // case insensitive, w is lower case
+    size_t n = std::strlen(w);
+    if (static_cast<size_t>(e - p) < n) {
+        return false;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if ((p[i] | 0x20) != w[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Parses a number at p and advances p past it
+bool scan_number(const char *&p, const char *e, double &v)
+{
+    while (p < e && *p == ' ') {
+        p++;
+    }
+    bool neg = false;
+    if (p < e && (*p == '-' || *p == '+')) {
+        neg = *p == '-';
+        p++;
+    }
+
+    const char *start = p;
+    uint64_t m = 0;
+    unsigned d;
+    while (p < e && is_digit(*p, d)) {
+        m = m * 10 + d;
+        p++;
+    }
+    int scale = 0;
+    bool digits = p != start;
+    if (p < e && *p == '.') {
+        const char *f = ++p;
+        while (p < e && is_digit(*p, d)) {
+            m = m * 10 + d;
+            p++;
+        }
+        scale = -static_cast<int>(p - f);
+        digits = digits || p != f;
+    }
+    if (!digits) {
+        p = start;
+        // no digits, NAN or INF as printed by dtostrf
+        if (match_word(p, e, "nan")) {
+            p += 3;
+            v = NAN;
+            return true;
+        }
+        if (match_word(p, e, "inf")) {
+            p += 3;
+            v = neg ? -INFINITY : INFINITY;
+            return true;
+        }
+        return false;
+    }
+    if (p < e && (*p | 0x20) == 'e') {
+        const char *q = p + 1;
+        bool eneg = false;
+        if (q < e && (*q == '-' || *q == '+')) {
+            eneg = *q == '-';
+            q++;
+        }
+        int x = 0;
+        const char *qs = q;
+        while (q < e && is_digit(*q, d) && x < 10000) {
+            x = x * 10 + static_cast<int>(d);
+            q++;
+        }
+        if (q == qs) {
+            return false;
+        }
+        scale += eneg ? -x : x;
+        p = q;
+    }
+
+    double r = static_cast<double>(m);
+    if (scale < 0) {
+        r = -scale <= 22 ? r / POW10[-scale] : r * std::pow(10.0, scale);
+    } else if (scale > 0) {
+        r = scale <= 22 ? r * POW10[scale] : r * std::pow(10.0, scale);
+    }
+    v = neg ? -r : r;
+    return true;
+}
+
+// A value field: a number, or an I:E ratio "a:b"
+bool scan_value(const char *&p, const char *e, double &v)
+{
+    if (!scan_number(p, e, v)) {
+        return false;
+    }
+    if (p < e && *p == ':') {
+        double den;
+        p++;
+        if (!scan_number(p, e, den)) {
+            return false;
+        }
+        v = v / den;
+    }
+    return true;
+}
+
+bool scan_uint(const char *&p, const char *e, unsigned max, unsigned &v)
+{
+    while (p < e && *p == ' ') {
+        p++;
+    }
+    const char *start = p;
+    unsigned long n = 0;
+    unsigned d;
+    while (p < e && is_digit(*p, d) && n <= max) {
+        n = n * 10 + d;
+        p++;
+    }
+    v = static_cast<unsigned>(n);
+    return p != start && n <= max;
+}
+
+struct KindInfo {
+    const char *name;
+    size_t len;
+    int fields;     // values between time and checksum
+};
+
+const KindInfo KINDS[TEXT_KINDS] = {
+    { "breezy", 6, F_BREEZY_COUNT },
+    { "wave", 4, BREEZY_LAYOUT_COUNT(WAVE_MSG_LAYOUT) },
+    { "summary", 7, BREEZY_LAYOUT_COUNT(SUMMARY_MSG_LAYOUT) },
+    { "service", 7, 5 },
+    { "profile", 7, PROFILE_FIELD_COUNT },
+    { "breathlog", 9, BREATHLOG_FIELD_COUNT },
+    { "alarm", 5, 2 },
+    { "", 0, -1 },
+};
+
+// first field of TextRecord::v in BREEZY_FIELDS, -1 = not a field list
+const int FIRST_FIELD[TEXT_KINDS] = { 0, 0, SAMPLE_FIELD_COUNT, -1, -1, -1, -1, -1 };
+
+int kind_of(const char *b, const char *e)
+{
+    size_t n = static_cast<size_t>(e - b);
+    for (int k = 0; k < TEXT_OTHER; k++) {
+        if (n == KINDS[k].len && std::memcmp(b, KINDS[k].name, n) == 0) {
+            return k;
+        }
+    }
+    return TEXT_OTHER;
+}
+
+} // namespace
+
+#define BREEZY_FIELD_INFO(name, label, width, prec, min, max, kind, comment) \
+    { #name, label, width, prec, min, max, FIELD_##kind, comment },
+const FieldInfo BREEZY_FIELDS[F_FIELD_COUNT] = {
+    BREEZY_SAMPLE_FIELDS(BREEZY_FIELD_INFO)
+    BREEZY_BREATH_FIELDS(BREEZY_FIELD_INFO)
+    BREEZY_MECHANICS_FIELDS(BREEZY_FIELD_INFO)
+};
+#undef BREEZY_FIELD_INFO
+
+const char *text_kind_name(int kind)
+{
+    return kind >= 0 && kind < TEXT_OTHER ? KINDS[kind].name : "other";
+}
+
+uint16_t text_crc16(const char *data, size_t len)
+{
+    const uint8_t *p = reinterpret_cast<const uint8_t *>(data);
+    uint16_t crc = CRC_INIT_DIRECT;
+    size_t i = 0;
+    for (; i + 2 <= len; i += 2) {
+        crc = static_cast<uint16_t>(crc_tables.t2[(crc >> 8) ^ p[i]] ^
+                                    crc_tables.t1[(crc & 0xFF) ^ p[i + 1]]);
+    }
+    if (i < len) {
+        crc = static_cast<uint16_t>((crc << 8) ^ crc_tables.t1[(crc >> 8) ^ p[i]]);
+    }
+    return crc;
+}
+
+bool parse_value(const char *b, const char *e, double &v)
+{
+    const char *p = b;
+    if (!scan_value(p, e, v)) {
+        return false;
+    }
+    while (p < e && *p == ' ') {
+        p++;
+    }
+    return p == e;
+}
+
+uint64_t TimeUnwrapper::unwrap(unsigned time)
+{
+    time &= 0xFFFF;
+    if (!have_last_) {
+        have_last_ = true;
+        t_ms_ = time;
+    } else if (reset_) {
+        t_ms_ += 40;
+    } else {
+        unsigned delta = (time - last_) & 0xFFFF;
+        if (delta < 0x8000) {
+            t_ms_ += delta;
+        } else {
+            backsteps++;
+        }
+    }
+    reset_ = false;
+    last_ = time;
+    return t_ms_;
+}
+
+TextResult TextDecoder::decode_line(const char *b, const char *e, TextRecord &out)
+{
+    lines++;
+    if (e > b && e[-1] == '\n') {
+        e--;
+    }
+    if (e > b && e[-1] == '\r') {
+        e--;
+    }
+    if (b == e) {
+        return LINE_EMPTY;
+    }
+    if (*b == '#') {
+        comments++;
+        return LINE_COMMENT;
+    }
+    if (e - b == 10 && std::memcmp(b, "reset-time", 10) == 0) {
+        resets++;
+        time.reset();
+        return LINE_RESET_TIME;
+    }
+
+    // the checksum follows the last comma, which is part of the checksummed text
+    const char *last = e;
+    while (last > b && last[-1] != ',') {
+        last--;
+    }
+    if (last == b) {
+        parse_errors++;
+        return LINE_PARSE_ERROR;
+    }
+    const char *p = last;
+    while (p < e && *p == ' ') {
+        p++;
+    }
+    unsigned crc = 0;
+    if (e - p == 2 && p[0] == '-' && p[1] == '1') {
+        out.has_crc = false;
+    } else if (scan_uint(p, e, 0xFFFF, crc) && p == e) {
+        out.has_crc = true;
+    } else {
+        parse_errors++;
+        return LINE_PARSE_ERROR;
+    }
+    if (out.has_crc && text_crc16(b, static_cast<size_t>(last - b)) != crc) {
+        crc_errors++;
+        return LINE_CRC_ERROR;
+    }
+
+    // name, version, time
+    const char *comma = static_cast<const char *>(std::memchr(b, ',', static_cast<size_t>(last - b)));
+    out.kind = kind_of(b, comma);
+    out.count = 0;
+    p = comma + 1;
+    if (out.kind == TEXT_OTHER) {
+        // e.g. a command response; valid, but without the common fields
+        out.version = 0;
+        out.time = 0;
+        out.t_ms = 0;
+    } else {
+        const char *fe = last - 1; // the checksummed part without its final comma
+        if (!scan_uint(p, fe, 255, out.version) || p >= fe || *p++ != ',' ||
+            !scan_uint(p, fe, 0xFFFF, out.time)) {
+            parse_errors++;
+            return LINE_PARSE_ERROR;
+        }
+        while (p < fe) {
+            if (*p++ != ',' || out.count == TEXT_MAX_FIELDS ||
+                !scan_value(p, fe, out.v[out.count])) {
+                parse_errors++;
+                return LINE_PARSE_ERROR;
+            }
+            out.count++;
+        }
+        if (out.count != KINDS[out.kind].fields) {
+            parse_errors++;
+            return LINE_PARSE_ERROR;
+        }
+        out.t_ms = time.unwrap(out.time);
+
+        int first = FIRST_FIELD[out.kind];
+        if (first >= 0) {
+            const FieldInfo *f = &BREEZY_FIELDS[first];
+            for (int i = 0; i < out.count; i++) {
+                // NAN compares false and is not counted
+                out_of_range += (out.v[i] < f[i].min) | (out.v[i] > f[i].max);
+            }
+        }
+    }
+
+    records++;
+    by_kind[out.kind]++;
+    if (!out.has_crc) {
+        no_crc++;
+    }
+    return LINE_RECORD;
+}
+
+} // namespace breezy
@@ -0,0 +1,153 @@
+#ifndef BREEZY_TEXT_H
+#define BREEZY_TEXT_H
+
+// Host-side decoder for the Breezy text protocol (breezy,1 and the other
+// CSV lines of docs/serial_protocol.md). Built for reducing long logs:
+// no allocation per line, one pass over the bytes of each line.
+
+#include <cstddef>
+#include <cstdint>
+
+#include "../../firmware/Breezy/MessageFields.h"
+
+namespace breezy {
+
+enum TextKind { TEXT_BREEZY, TEXT_WAVE, TEXT_SUMMARY, TEXT_SERVICE, TEXT_PROFILE, TEXT_BREATHLOG, TEXT_ALARM, TEXT_OTHER, TEXT_KINDS };
+
+// Fields of a breezy,1 line after `time` (F_p_act ... F_vte), index into
+// TextRecord::v. Generated from the lists in MessageFields.h.
+// wave,1 has the sample fields, summary,1 the breath and mechanics fields
+// starting at v[0].
+#define BREEZY_FIELD_ENUM(name, label, width, prec, min, max, kind, comment) F_##name,
+enum BreezyField {
+    BREEZY_SAMPLE_FIELDS(BREEZY_FIELD_ENUM)
+    BREEZY_BREATH_FIELDS(BREEZY_FIELD_ENUM)
+    BREEZY_MECHANICS_FIELDS(BREEZY_FIELD_ENUM)
+    F_FIELD_COUNT
+};
+#undef BREEZY_FIELD_ENUM
+
+const int SAMPLE_FIELD_COUNT = BREEZY_FIELD_COUNT(BREEZY_SAMPLE_FIELDS);
+const int BREATH_FIELD_COUNT = BREEZY_FIELD_COUNT(BREEZY_BREATH_FIELDS);
+const int MECHANICS_FIELD_COUNT = BREEZY_FIELD_COUNT(BREEZY_MECHANICS_FIELDS);
+const int F_BREEZY_COUNT = BREEZY_LAYOUT_COUNT(BREEZY_MSG_LAYOUT); // values of a breezy,1 line
+// the display app and the logs already recorded read breezy,1 by position
+static_assert(F_BREEZY_COUNT == 14, "breezy,1 is frozen, new fields go to summary,1");
+
+enum FieldKind { FIELD_FIXED, FIELD_RATIO };
+
+struct FieldInfo {
+    const char *name;
+    const char *label;
+    int width;
+    int prec;
+    double min, max;
+    int kind;           // FieldKind
+    const char *comment;
+};
+
+// indexed by BreezyField
+extern const FieldInfo BREEZY_FIELDS[F_FIELD_COUNT];
+
+// profile,1: min, avg, max us of 6 sections, 2 jitter histograms of 8 bins, 5 stacks
+const int PROFILE_FIELD_COUNT = 6 * 3 + 2 * 8 + 5;
+
+// breathlog,1: number, end_s, p_peak, p_mean, peep, vti, vte, ti, te
+const int BREATHLOG_FIELD_COUNT = 9;
+
+const int TEXT_MAX_FIELDS = PROFILE_FIELD_COUNT;
+
+struct TextRecord {
+    int kind;           // TextKind
+    unsigned version;   // protocol_version field
+    unsigned time;      // time field as sent, 0-65535
+    uint64_t t_ms;      // time on the unwrapped timeline
+    bool has_crc;       // false when the checksum field is -1
+    int count;          // number of values in v
+    double v[TEXT_MAX_FIELDS]; // fields between time and checksum; I:E as ti/te
+};
+
+enum TextResult {
+    LINE_RECORD,        // out is valid
+    LINE_EMPTY,
+    LINE_COMMENT,       // "#..."
+    LINE_RESET_TIME,    // "reset-time"
+    LINE_PARSE_ERROR,
+    LINE_CRC_ERROR
+};
+
+const char *text_kind_name(int kind);
+
+// CRC16-CCITT of the text protocol, table driven
+uint16_t text_crc16(const char *data, size_t len);
+
+// Parses one value field: decimal or scientific notation, NAN, INF, or an
+// I:E ratio "a:b" (returned as a/b). Leading spaces are skipped. Returns
+// false if [b, e) is not a value.
+bool parse_value(const char *b, const char *e, double &v);
+
+// Maps the wrapping 16-bit time onto a monotonic ms timeline.
+// Deltas of 32768 ms or more are taken as the clock stepping back (the
+// timeline holds still); a real gap that long cannot be told from that.
+class TimeUnwrapper {
+public:
+    TimeUnwrapper() : have_last_(false), reset_(false), last_(0), t_ms_(0), backsteps(0) {}
+
+    uint64_t unwrap(unsigned time);
+    // the next sample is placed 40 ms after the last one, whatever its time value
+    void reset() { reset_ = true; }
+
+private:
+    bool have_last_;
+    bool reset_;
+    unsigned last_;
+    uint64_t t_ms_;
+
+public:
+    unsigned long backsteps;
+};
+
+class TextDecoder {
+public:
+    TextDecoder() : lines(0), records(0), comments(0), resets(0), parse_errors(0),
+                    crc_errors(0), no_crc(0), out_of_range(0) { for (int i = 0; i < TEXT_KINDS; i++) by_kind[i] = 0; }
+
+    // Decodes one line without its line end ("\r\n" or "\n" are stripped if present).
+    TextResult decode_line(const char *b, const char *e, TextRecord &out);
+
+    // Calls f(const TextRecord &) for every valid record in a buffer of whole
+    // lines, e.g. a memory-mapped log. A last line without line end is decoded too.
+    template <class F> void decode_buffer(const char *b, size_t len, F f);
+
+    TimeUnwrapper time;
+
+    unsigned long lines;
+    unsigned long records;
+    unsigned long by_kind[TEXT_KINDS];
+    unsigned long comments;
+    unsigned long resets;
+    unsigned long parse_errors;
+    unsigned long crc_errors;
+    unsigned long no_crc;       // records sent with checksum -1
+    unsigned long out_of_range; // values outside the expected range (not an error)
+};
+
+} // namespace breezy
+
+#include <cstring>
+
+template <class F> void breezy::TextDecoder::decode_buffer(const char *b, size_t len, F f)
+{
+    const char *end = b + len;
+    TextRecord rec;
+    while (b < end) {
+        const char *nl = static_cast<const char *>(std::memchr(b, '\n', end - b));
+        const char *le = nl ? nl : end;
+        if (decode_line(b, le, rec) == LINE_RECORD) {
+            f(rec);
+        }
+        b = le + 1;
+    }
+}
+
+#endif // BREEZY_TEXT_H
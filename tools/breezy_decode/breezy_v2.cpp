@@ -0,0 +1,249 @@
+#include "breezy_v2.h"
+
+#include <cmath>
+
+namespace breezy {
+
+namespace {
+
+const unsigned TYPE_VERSION = 2;
+
+const int16_t NAN_S16 = static_cast<int16_t>(0x8000);
+const uint16_t NAN_U16 = 0xFFFF;
+const uint8_t NAN_U8 = 0xFF;
+
+// Little-endian field reader over a payload
+class Reader {
+public:
+    Reader(const uint8_t *p, size_t len) : p_(p), len_(len), pos_(0) {}
+
+    bool ok(size_t n) const { return pos_ + n <= len_; }
+    size_t pos() const { return pos_; }
+
+    uint8_t u8() { return p_[pos_++]; }
+    uint16_t u16() {
+        uint16_t v = static_cast<uint16_t>(p_[pos_] | (p_[pos_ + 1] << 8));
+        pos_ += 2;
+        return v;
+    }
+    double s16(double scale) {
+        int16_t v = static_cast<int16_t>(u16());
+        return v == NAN_S16 ? NAN : v / scale;
+    }
+    double fu16(double scale) {
+        uint16_t v = u16();
+        return v == NAN_U16 ? NAN : v / scale;
+    }
+    double fu8(double scale) {
+        uint8_t v = u8();
+        return v == NAN_U8 ? NAN : v / scale;
+    }
+
+private:
+    const uint8_t *p_;
+    size_t len_;
+    size_t pos_;
+};
+
+} // namespace
+
+uint16_t crc16_ccitt(const uint8_t *data, size_t len)
+{
+    // Straightforward augmented bitwise algorithm from
+    // http://srecord.sourceforge.net/crc16-ccitt.html
+    uint16_t crc = 0xFFFF;
+    for (size_t i = 0; i < len; i++) {
+        for (uint8_t v = 0x80; v; v >>= 1) {
+            bool x = crc & 0x8000;
+            crc = static_cast<uint16_t>(crc << 1);
+            if (data[i] & v) {
+                crc = static_cast<uint16_t>(crc + 1);
+            }
+            if (x) {
+                crc ^= 0x1021;
+            }
+        }
+    }
+    for (int i = 0; i < 16; i++) {
+        bool x = crc & 0x8000;
+        crc = static_cast<uint16_t>(crc << 1);
+        if (x) {
+            crc ^= 0x1021;
+        }
+    }
+    return crc;
+}
+
+size_t cobs_decode(const uint8_t *src, size_t len, uint8_t *dst)
+{
+    size_t in = 0, out = 0;
+    while (in < len) {
+        uint8_t code = src[in++];
+        if (code == 0 || in + code - 1 > len) {
+            return 0;
+        }
+        for (uint8_t i = 1; i < code; i++) {
+            dst[out++] = src[in++];
+        }
+        if (code != 0xFF && in < len) {
+            dst[out++] = 0;
+        }
+    }
+    return out;
+}
+
+bool decode_v2_frame(const uint8_t *frame, size_t len, V2Frame &out, std::string &err)
+{
+    if (len < 4 + 2) {
+        err = "short frame";
+        return false;
+    }
+    size_t plen = len - 2;
+    uint16_t crc = static_cast<uint16_t>(frame[plen] | (frame[plen + 1] << 8));
+    if (crc16_ccitt(frame, plen) != crc) {
+        err = "crc";
+        return false;
+    }
+
+    Reader r(frame, plen);
+    uint8_t type = r.u8();
+    if ((type >> 4) != TYPE_VERSION) {
+        err = "unknown protocol version";
+        return false;
+    }
+    out = V2Frame();
+    out.kind = type & 0x0F;
+    out.seq = r.u8();
+    out.time = r.u16();
+
+    switch (out.kind) {
+    case V2_SAMPLE:
+        if (!r.ok(6)) break;
+        out.p_act = r.s16(100);
+        out.slm = r.s16(100);
+        out.slm_sum = r.s16(10);
+        return true;
+    case V2_BREATH:
+        if (!r.ok(26)) break;
+        out.p_peak = r.fu16(10);
+        out.p_mean = r.fu8(1);
+        out.peep = r.fu8(1);
+        out.rr = r.fu8(1);
+        out.o2_perc = r.fu8(1);
+        out.ti = r.fu16(100);
+        out.i_e = r.fu16(100);
+        out.mvi = r.fu16(10);
+        out.mve = r.fu16(10);
+        out.vti = r.fu16(1);
+        out.vte = r.fu16(1);
+        out.compliance = r.fu16(10);
+        out.resistance = r.fu16(10);
+        out.p_plat = r.s16(10);
+        out.peep_tot = r.s16(10);
+        return true;
+    case V2_SERVICE:
+        if (!r.ok(9)) break;
+        out.p_o2 = r.s16(10);
+        out.is_i = r.u8();
+        out.tx_dropped = r.u16();
+        out.tx_high_watermark = r.u16();
+        out.telemetry_dropped = r.u16();
+        return true;
+    case V2_PROFILE:
+        if (!r.ok(2 * (PROFILE_SECTIONS * 3 + PROFILE_JITTERS * PROFILE_JITTER_BINS + PROFILE_TASKS))) break;
+        for (int i = 0; i < PROFILE_SECTIONS; i++) {
+            out.section_min[i] = r.fu16(0.1);
+            out.section_avg[i] = r.fu16(0.1);
+            out.section_max[i] = r.fu16(0.1);
+        }
+        for (int j = 0; j < PROFILE_JITTERS; j++) {
+            for (int i = 0; i < PROFILE_JITTER_BINS; i++) {
+                out.jitter[j][i] = r.u16();
+            }
+        }
+        for (int i = 0; i < PROFILE_TASKS; i++) {
+            out.stack_free[i] = r.u16();
+        }
+        return true;
+    case V2_BREATH_LOG: {
+        if (!r.ok(3)) break;
+        unsigned number = r.u16();
+        out.breath_count = r.u8();
+        if (out.breath_count > BREATH_LOG_RECORDS || !r.ok(16 * out.breath_count)) break;
+        for (int i = 0; i < out.breath_count; i++) {
+            V2BreathRecord &b = out.breaths[i];
+            b.number = (number + i) & 0xFFFF;
+            b.end_s = r.u16();
+            b.p_peak = r.s16(10);
+            b.p_mean = r.s16(10);
+            b.peep = r.s16(10);
+            b.vti = r.fu16(1);
+            b.vte = r.fu16(1);
+            b.ti = r.fu16(100);
+            b.te = r.fu16(100);
+        }
+        return true;
+    }
+    case V2_ALARM:
+        if (!r.ok(4)) break;
+        out.alarms_active = r.u16();
+        out.alarms_latched = r.u16();
+        return true;
+    case V2_TEXT:
+        out.text.assign(reinterpret_cast<const char *>(frame) + r.pos(), plen - r.pos());
+        return true;
+    default:
+        err = "unknown frame kind";
+        return false;
+    }
+    err = "truncated frame";
+    return false;
+}
+
+bool V2StreamDecoder::feed(uint8_t byte)
+{
+    if (byte != 0) {
+        if (len_ < sizeof(buf_)) {
+            buf_[len_++] = byte;
+        } else {
+            overflow_ = true;
+        }
+        return false;
+    }
+
+    // delimiter - decode what we have
+    bool overflow = overflow_;
+    size_t len = len_;
+    len_ = 0;
+    overflow_ = false;
+    if (len == 0) {
+        return false; // idle delimiters
+    }
+
+    uint8_t decoded[sizeof(buf_)];
+    size_t n = overflow ? 0 : cobs_decode(buf_, len, decoded);
+    error.clear();
+    if (n == 0) {
+        error = "framing";
+        format_errors++;
+        return true;
+    }
+    if (!decode_v2_frame(decoded, n, frame, error)) {
+        if (error == "crc") {
+            crc_errors++;
+        } else {
+            format_errors++;
+        }
+        return true;
+    }
+
+    frames++;
+    if (have_seq_) {
+        lost_frames += (frame.seq - last_seq_ - 1) & 0xFF;
+    }
+    have_seq_ = true;
+    last_seq_ = frame.seq;
+    return true;
+}
+
+} // namespace breezy
@@ -0,0 +1,100 @@
+#ifndef BREEZY_V2_H
+#define BREEZY_V2_H
+
+// Host-side reference decoder for the Breezy binary protocol (version 2).
+// Written independently of the firmware encoder from docs/serial_protocol.md.
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace breezy {
+
+enum V2Kind { V2_SAMPLE = 1, V2_BREATH = 2, V2_SERVICE = 3, V2_TEXT = 4, V2_PROFILE = 5, V2_BREATH_LOG = 6, V2_ALARM = 7 };
+
+// V2_PROFILE layout
+const int PROFILE_SECTIONS = 6;     // statistics, messaging, display, serial wait, snapshot read, alarms
+const int PROFILE_JITTERS = 2;      // statistics period, message period
+const int PROFILE_JITTER_BINS = 8;  // 0, 1, 2-3, 4-7, 8-15, 16-31, 32-63, 64+ ms late
+const int PROFILE_TASKS = 5;        // LCD, Ventilator, Valve, Telemetry, Command
+
+// V2_BREATH_LOG
+const int BREATH_LOG_RECORDS = 5;   // most records per frame
+
+struct V2BreathRecord {
+    unsigned number;    // breath number, 0-65535 wrapping
+    unsigned end_s;     // seconds since reset, 0-65535 wrapping
+    double p_peak, p_mean, peep, vti, vte, ti, te;
+};
+
+struct V2Frame {
+    int kind;           // V2Kind
+    unsigned seq;       // 0-255
+    unsigned time;      // ms, 0-65535 wrapping
+
+    // V2_SAMPLE
+    double p_act, slm, slm_sum;
+
+    // V2_BREATH
+    double p_peak, p_mean, peep, rr, o2_perc, ti, i_e, mvi, mve, vti, vte;
+    double compliance, resistance, p_plat, peep_tot;
+
+    // V2_SERVICE
+    double p_o2;
+    int is_i;
+    unsigned tx_dropped, tx_high_watermark, telemetry_dropped;
+
+    // V2_TEXT
+    std::string text;
+
+    // V2_PROFILE, durations in us (10 us resolution)
+    double section_min[PROFILE_SECTIONS], section_avg[PROFILE_SECTIONS], section_max[PROFILE_SECTIONS];
+    unsigned jitter[PROFILE_JITTERS][PROFILE_JITTER_BINS];
+    unsigned stack_free[PROFILE_TASKS];
+
+    // V2_ALARM, bit masks
+    unsigned alarms_active, alarms_latched;
+
+    // V2_BREATH_LOG
+    int breath_count;
+    V2BreathRecord breaths[BREATH_LOG_RECORDS];
+};
+
+// CRC16-CCITT as used by both protocol versions (check value 0xE5CC for "123456789")
+uint16_t crc16_ccitt(const uint8_t *data, size_t len);
+
+// Decodes one COBS block (without the 0x00 delimiter). Returns the decoded
+// length, or 0 if the block is malformed. dst needs len bytes.
+size_t cobs_decode(const uint8_t *src, size_t len, uint8_t *dst);
+
+// Decodes a COBS-decoded frame (payload + crc). On failure returns false and sets err.
+bool decode_v2_frame(const uint8_t *frame, size_t len, V2Frame &out, std::string &err);
+
+// Splits a byte stream at 0x00 delimiters and decodes the frames.
+class V2StreamDecoder {
+public:
+    V2StreamDecoder() : frames(0), crc_errors(0), format_errors(0), lost_frames(0),
+                        len_(0), overflow_(false), have_seq_(false), last_seq_(0) {}
+
+    // Returns true when a frame was completed; the result (or error) is in frame / error.
+    bool feed(uint8_t byte);
+
+    V2Frame frame;
+    std::string error;        // empty when frame is valid
+
+    unsigned long frames;
+    unsigned long crc_errors;
+    unsigned long format_errors;
+    unsigned long lost_frames; // from gaps in the sequence number
+
+private:
+    uint8_t buf_[256];
+    size_t len_;
+    bool overflow_;
+    bool have_seq_;
+    unsigned last_seq_;
+};
+
+} // namespace breezy
+
+#endif // BREEZY_V2_H
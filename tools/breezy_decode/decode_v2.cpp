@@ -0,0 +1,87 @@
+// Reads a Breezy protocol version 2 binary capture (file or stdin) and
+// prints the frames as CSV, one line per frame.
+//
+//   decode_v2 [capture.bin]
+
+#include "breezy_v2.h"
+
+#include <cmath>
+#include <cstdio>
+
+using breezy::V2Frame;
+
+static void print_frame(const V2Frame &f)
+{
+    switch (f.kind) {
+    case breezy::V2_SAMPLE:
+        std::printf("sample,%u,%u,%.2f,%.2f,%.1f\n", f.seq, f.time, f.p_act, f.slm, f.slm_sum);
+        break;
+    case breezy::V2_BREATH:
+        std::printf("breath,%u,%u,%.1f,%.0f,%.0f,%.0f,%.0f,%.2f,%.2f,%.1f,%.1f,%.0f,%.0f,%.1f,%.1f,%.1f,%.1f\n",
+                    f.seq, f.time, f.p_peak, f.p_mean, f.peep, f.rr, f.o2_perc,
+                    f.ti, f.i_e, f.mvi, f.mve, f.vti, f.vte, f.compliance, f.resistance,
+                    f.p_plat, f.peep_tot);
+        break;
+    case breezy::V2_SERVICE:
+        std::printf("service,%u,%u,%.1f,%d,%u,%u,%u\n", f.seq, f.time, f.p_o2, f.is_i,
+                    f.tx_dropped, f.tx_high_watermark, f.telemetry_dropped);
+        break;
+    case breezy::V2_PROFILE:
+        std::printf("profile,%u,%u", f.seq, f.time);
+        for (int i = 0; i < breezy::PROFILE_SECTIONS; i++) {
+            std::printf(",%.0f,%.0f,%.0f", f.section_min[i], f.section_avg[i], f.section_max[i]);
+        }
+        for (int j = 0; j < breezy::PROFILE_JITTERS; j++) {
+            for (int i = 0; i < breezy::PROFILE_JITTER_BINS; i++) {
+                std::printf(",%u", f.jitter[j][i]);
+            }
+        }
+        for (int i = 0; i < breezy::PROFILE_TASKS; i++) {
+            std::printf(",%u", f.stack_free[i]);
+        }
+        std::printf("\n");
+        break;
+    case breezy::V2_BREATH_LOG:
+        for (int i = 0; i < f.breath_count; i++) {
+            const breezy::V2BreathRecord &b = f.breaths[i];
+            std::printf("breathlog,%u,%u,%u,%u,%.1f,%.1f,%.1f,%.0f,%.0f,%.2f,%.2f\n", f.seq, f.time,
+                        b.number, b.end_s, b.p_peak, b.p_mean, b.peep, b.vti, b.vte, b.ti, b.te);
+        }
+        break;
+    case breezy::V2_ALARM:
+        std::printf("alarm,%u,%u,%u,%u\n", f.seq, f.time, f.alarms_active, f.alarms_latched);
+        break;
+    case breezy::V2_TEXT:
+        std::printf("# %s", f.text.c_str()); // the line brings its own line end
+        break;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    FILE *in = stdin;
+    if (argc > 1) {
+        in = std::fopen(argv[1], "rb");
+        if (!in) {
+            std::perror(argv[1]);
+            return 1;
+        }
+    }
+
+    breezy::V2StreamDecoder dec;
+    int c;
+    while ((c = std::fgetc(in)) != EOF) {
+        if (!dec.feed(static_cast<uint8_t>(c))) {
+            continue;
+        }
+        if (dec.error.empty()) {
+            print_frame(dec.frame);
+        } else {
+            std::printf("# error: %s\n", dec.error.c_str());
+        }
+    }
+
+    std::fprintf(stderr, "frames: %lu  crc errors: %lu  format errors: %lu  lost: %lu\n",
+                 dec.frames, dec.crc_errors, dec.format_errors, dec.lost_frames);
+    return dec.crc_errors || dec.format_errors ? 2 : 0;
+}
@@ -0,0 +1,859 @@
+// Host tests of firmware modules, compiled from the firmware sources with the
+// shims in host/ (see README.md).
+//
+//   firmware_test            run all tests
+//   firmware_test name...    run the named tests
+//
+// Prints a line per test, and the timings where a test measures one. Exit
+// code 1 when a check failed.
+
+#include "AdcScale.h"
+#include "BinaryProtocol.h"
+#include "Configuration.h"
+#include "Filters.h"
+#include "LineWriter.h"
+#include "LungMechanics.h"
+#include "WindowedMetrics.h"
+#include "crc16.h"
+
+#include "breezy_v2.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+namespace {
+
+bool ok;
+
+#define CHECK(cond, ...)                                                    \
+    do {                                                                    \
+        if (!(cond)) {                                                      \
+            std::fprintf(stderr, "FAILED %s:%d: ", __FILE__, __LINE__);     \
+            std::fprintf(stderr, __VA_ARGS__);                              \
+            std::fputc('\n', stderr);                                       \
+            ok = false;                                                     \
+        }                                                                   \
+    } while (0)
+
+double seconds_since(std::chrono::steady_clock::time_point t0)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+std::mt19937 rng(12345); // fixed seed, a failure repeats
+
+// crc16.cpp
+
+// The bit-by-bit "good_crc" the table replaced: 0xFFFF, the message, 16 zero bits
+uint16_t crc16_bitwise(const uint8_t *data, size_t len)
+{
+    uint16_t crc = 0xFFFF;
+    for (size_t i = 0; i < len + 2; i++) {
+        uint8_t ch = i < len ? data[i] : 0; // the augmentation
+        for (uint8_t v = 0x80; v; v >>= 1) {
+            bool xor_flag = crc & 0x8000;
+            crc = static_cast<uint16_t>((crc << 1) | ((ch & v) ? 1 : 0));
+            if (xor_flag) {
+                crc ^= 0x1021;
+            }
+        }
+    }
+    return crc;
+}
+
+void test_crc16()
+{
+    CRC16 crc;
+    CHECK(crc.get_crc16("123456789") == 0xE5CC, "check value %#x", crc.get_crc16("123456789"));
+
+    // random buffers, whole, byte by byte and in random pieces like LineWriter feeds it
+    std::vector<uint8_t> buf(512);
+    for (int round = 0; round < 2000; round++) {
+        size_t len = rng() % buf.size();
+        for (size_t i = 0; i < len; i++) {
+            buf[i] = static_cast<uint8_t>(rng());
+        }
+        const char *data = reinterpret_cast<const char *>(&buf[0]);
+        uint16_t want = crc16_bitwise(&buf[0], len);
+
+        crc.reset();
+        crc.update(data, static_cast<uint16_t>(len));
+        CHECK(crc.get() == want, "%u bytes: table %#x, bitwise %#x", static_cast<unsigned>(len), crc.get(), want);
+
+        crc.reset();
+        for (size_t i = 0; i < len; i++) {
+            crc.update(buf[i]);
+        }
+        CHECK(crc.get() == want, "%u bytes, byte by byte: %#x, bitwise %#x", static_cast<unsigned>(len), crc.get(),
+              want);
+
+        crc.reset();
+        for (size_t i = 0; i < len;) {
+            size_t n = std::min(len - i, static_cast<size_t>(rng() % 16));
+            crc.update(data + i, static_cast<uint16_t>(n));
+            i += n;
+        }
+        CHECK(crc.get() == want, "%u bytes in pieces: %#x, bitwise %#x", static_cast<unsigned>(len), crc.get(), want);
+
+        buf[len] = 0; // as a string, up to the first NUL
+        size_t text_len = std::strlen(data);
+        uint16_t text_crc = crc.get_crc16(data);
+        CHECK(text_crc == crc16_bitwise(&buf[0], text_len), "get_crc16 of %u bytes", static_cast<unsigned>(text_len));
+    }
+
+    // throughput on the host, 100 byte lines
+    const size_t line = 100, lines = 200000;
+    std::vector<char> text(line);
+    for (size_t i = 0; i < line; i++) {
+        text[i] = static_cast<char>(' ' + rng() % 90);
+    }
+    unsigned sum = 0;
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < lines; i++) {
+        text[0] = static_cast<char>(i);
+        crc.reset();
+        crc.update(&text[0], line);
+        sum += crc.get();
+    }
+    double table_s = seconds_since(t0);
+    t0 = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < lines; i++) {
+        text[0] = static_cast<char>(i);
+        sum += crc16_bitwise(reinterpret_cast<const uint8_t *>(&text[0]), line);
+    }
+    double bitwise_s = seconds_since(t0);
+    double mb = line * lines / 1e6;
+    std::printf("crc16: table %.0f MB/s, bitwise %.0f MB/s on the host, %.1fx (sum %u)\n", mb / table_s,
+                mb / bitwise_s, bitwise_s / table_s, sum);
+}
+
+// AdcScale.h (Sensors.cpp): every reading of a channel against its exact line
+
+// readings, the conversions are to be that close to the exact line
+#define ADC_MAX_ERROR 0.01
+#define ADC_LINE_MAX_ERROR 0.02
+
+// the conversion with SENSORS_FIXED_POINT 0
+float float_convert(double gain, double offset, uint16_t adc)
+{
+    return static_cast<float>(adc) * static_cast<float>(gain) + static_cast<float>(offset);
+}
+
+// the largest error over every reading of a line, and of means of n readings, in readings
+void sweep_channel(const char *name, const AdcScale &s, double gain, double offset, double full)
+{
+    double err = 0, float_err = 0, diff = 0;
+    for (unsigned adc = 0; adc <= full; adc++) {
+        double exact = gain * adc + offset;
+        double got = adc_convert(s, static_cast<uint16_t>(adc));
+        double f = float_convert(gain, offset, static_cast<uint16_t>(adc));
+        err = std::max(err, std::fabs(got - exact));
+        float_err = std::max(float_err, std::fabs(f - exact));
+        diff = std::max(diff, std::fabs(got - f));
+    }
+    double readings = err / std::fabs(gain);
+    CHECK(readings <= ADC_MAX_ERROR, "%s: error %.5f, %.3f readings over %g readings", name, err, readings, full + 1);
+
+    // means of n readings, as the pressure end window uses them
+    const uint16_t ns[] = { 1, 2, 3, 10, 25, 100 };
+    double mean_err = 0;
+    for (size_t i = 0; i < sizeof(ns) / sizeof(ns[0]); i++) {
+        for (int j = 0; j < 1000; j++) {
+            uint32_t sum = static_cast<uint32_t>(rng() % (static_cast<uint32_t>(full) * ns[i] + 1));
+            double exact = gain * sum / ns[i] + offset;
+            mean_err = std::max(mean_err, std::fabs(adc_convert_mean(s, sum, ns[i]) - exact));
+        }
+    }
+    CHECK(mean_err / std::fabs(gain) <= ADC_MAX_ERROR, "%s: mean error %.5f, %.3f readings", name, mean_err,
+          mean_err / std::fabs(gain));
+    std::printf("adc: %-9s max error %.6f (%.4f of a reading, means %.4f), float %.6f, %.6f apart\n", name, err,
+                readings, mean_err / std::fabs(gain), float_err, diff);
+}
+
+#define SWEEP(name)                                                                                 \
+    do {                                                                                            \
+        const AdcScale s = ADC_SCALE(name);                                                         \
+        sweep_channel(#name, s, ADC_GAIN(name), ADC_OFFSET(name), ADC_FULL(name));                  \
+    } while (0)
+
+void test_adc()
+{
+    CHECK(SENSORS_FIXED_POINT, "the firmware converts in float, set SENSORS_FIXED_POINT to test the fixed point");
+    SWEEP(P_ACT);
+    SWEEP(P_O2);
+    SWEEP(SET_O2);
+    SWEEP(SET_MAX_P);
+    SWEEP(SET_PEEP);
+    SWEEP(SET_RR);
+    SWEEP(SET_TV);
+    SWEEP(SET_IE);
+
+    // calibration lines (Sensors.cpp cal_expand): any gain and offset through adc_line, over the
+    // range of P_O2 or P_ACT
+    double line_err = 0;
+    for (int i = 0; i < 200; i++) {
+        uint16_t full = ADC_MAXVAL << (1 + rng() % 2);
+        double gain = std::pow(10.0, std::uniform_real_distribution<double>(-5, 0)(rng)) * (rng() % 4 ? 1 : -1);
+        double offset = std::uniform_real_distribution<double>(-2, 2)(rng) * gain * full;
+        const AdcScale s = adc_line(static_cast<float>(gain), static_cast<float>(offset), full);
+        double g = static_cast<float>(gain), o = static_cast<float>(offset); // the line adc_line was given
+        double err = 0;
+        for (unsigned adc = 0; adc <= full; adc++) {
+            err = std::max(err, std::fabs(adc_convert(s, static_cast<uint16_t>(adc)) - (g * adc + o)));
+        }
+        line_err = std::max(line_err, err / std::fabs(g));
+        CHECK(err / std::fabs(g) <= ADC_LINE_MAX_ERROR, "adc_line(%g, %g, %u): error %.3f readings", g, o, full,
+              err / std::fabs(g));
+    }
+    std::printf("adc: calibration lines max error %.4f of a reading\n", line_err);
+
+    // both conversions on the host; the AVR has no FPU, see README.md for measuring it there
+    const AdcScale s = ADC_SCALE(P_ACT);
+    const int rounds = 5000;
+    double sum = 0;
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; r++) {
+        for (uint16_t adc = 0; adc < 4096; adc++) {
+            sum += adc_convert(s, adc);
+        }
+    }
+    double fixed_s = seconds_since(t0);
+    t0 = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; r++) {
+        for (uint16_t adc = 0; adc < 4096; adc++) {
+            sum += float_convert(ADC_GAIN(P_ACT), ADC_OFFSET(P_ACT), adc);
+        }
+    }
+    double float_s = seconds_since(t0);
+    double n = rounds * 4096.0;
+    std::printf("adc: fixed point %.2f ns, float %.2f ns per conversion on the host (sum %g)\n",
+                fixed_s / n * 1e9, float_s / n * 1e9, sum);
+}
+
+// BinaryProtocol.cpp against the host decoder of breezy_v2.cpp
+
+// Messaging::send_frame without the serial port: payload, CRC low byte first, COBS, 0x00
+std::vector<uint8_t> send_frame(uint8_t *payload, uint8_t len, uint8_t seq)
+{
+    uint8_t buf[BIN_MAX_PAYLOAD + 2];
+    uint8_t frame[BIN_MAX_FRAME];
+    reinterpret_cast<BinHeader *>(payload)->seq = seq;
+    CRC16 crc16;
+    crc16.reset();
+    crc16.update(reinterpret_cast<const char *>(payload), len);
+    uint16_t crc = crc16.get();
+    std::memcpy(buf, payload, len);
+    buf[len] = static_cast<uint8_t>(crc);
+    buf[len + 1] = static_cast<uint8_t>(crc >> 8);
+    uint8_t n = cobs_encode(buf, len + 2, frame);
+    frame[n++] = 0;
+    return std::vector<uint8_t>(frame, frame + n);
+}
+
+// Feeds one encoded frame to the decoder, which has to complete it at the delimiter
+bool receive(breezy::V2StreamDecoder &dec, const std::vector<uint8_t> &frame)
+{
+    for (size_t i = 0; i < frame.size(); i++) {
+        bool done = dec.feed(frame[i]);
+        if (done != (i + 1 == frame.size())) {
+            CHECK(false, "frame of %u bytes %s at byte %u", static_cast<unsigned>(frame.size()),
+                  done ? "ended" : "did not end", static_cast<unsigned>(i));
+            return false;
+        }
+    }
+    CHECK(dec.error.empty(), "frame not decoded: %s", dec.error.c_str());
+    return dec.error.empty();
+}
+
+// A value for a bin_* field: often 0 (zero bytes in the payload), NAN or out of range
+float random_value(float max)
+{
+    switch (rng() % 10) {
+    case 0:
+        return 0;
+    case 1:
+        return NAN;
+    case 2:
+        return rng() % 2 ? 2 * max : -2 * max;
+    default:
+        return std::uniform_real_distribution<float>(-max, max)(rng);
+    }
+}
+
+// What bin_s16 / bin_u16 / bin_u8 should have made of v, after the decoder's scaling
+double expected(float v, double scale, double lo, double hi)
+{
+    if (std::isnan(v)) {
+        return NAN;
+    }
+    float x = v * static_cast<float>(scale); // in float, as on the AVR
+    return std::lround(std::max(lo, std::min(hi, static_cast<double>(x)))) / scale;
+}
+
+#define CHECK_FIELD(got, v, scale, lo, hi)                                                        \
+    do {                                                                                         \
+        double want = expected(v, scale, lo, hi);                                                \
+        CHECK(std::isnan(want) ? std::isnan(got) : std::fabs((got) - want) < 1e-6,              \
+              #got ": sent %g, decoded %g, expected %g", static_cast<double>(v), (got), want); \
+    } while (0)
+#define CHECK_S16(got, v, scale) CHECK_FIELD(got, v, scale, -32767, 32767)
+#define CHECK_U16(got, v, scale) CHECK_FIELD(got, v, scale, 0, 65534)
+#define CHECK_U8(got, v, scale) CHECK_FIELD(got, v, scale, 0, 254)
+
+void test_binary()
+{
+    breezy::V2StreamDecoder dec;
+    unsigned seq = 0;
+
+    // COBS alone: every length a frame can have, from no zero bytes to all zero
+    for (unsigned len = 0; len < 254; len++) {
+        uint8_t src[254], enc[256], dec_buf[256];
+        unsigned zeros = rng() % 4;
+        for (unsigned i = 0; i < len; i++) {
+            src[i] = zeros == 3 || rng() % 4 < zeros ? 0 : static_cast<uint8_t>(1 + rng() % 255);
+        }
+        uint8_t n = cobs_encode(src, static_cast<uint8_t>(len), enc);
+        CHECK(n == len + 1, "cobs_encode of %u bytes gave %u", len, n);
+        CHECK(std::find(enc, enc + n, 0) == enc + n, "0x00 in the COBS output of %u bytes", len);
+        size_t m = breezy::cobs_decode(enc, n, dec_buf);
+        CHECK(m == len && std::memcmp(src, dec_buf, len) == 0, "COBS round trip of %u bytes", len);
+    }
+
+    // sample and breath frames, as Messaging fills them
+    for (int i = 0; i < 1000; i++, seq++) {
+        BinSample s;
+        float p_act = random_value(400), slm = random_value(400), slm_sum = random_value(4000);
+        s.h.type = BIN_TYPE_SAMPLE;
+        s.h.time = static_cast<uint16_t>(i % 3 ? rng() : 0);
+        s.p_act = bin_s16(p_act, 100);
+        s.slm = bin_s16(slm, 100);
+        s.slm_sum = bin_s16(slm_sum, 10);
+        if (!receive(dec, send_frame(reinterpret_cast<uint8_t *>(&s), sizeof(s), static_cast<uint8_t>(seq)))) {
+            continue;
+        }
+        const breezy::V2Frame &f = dec.frame;
+        CHECK(f.kind == breezy::V2_SAMPLE && f.seq == (seq & 0xFF) && f.time == s.h.time, "sample header");
+        CHECK_S16(f.p_act, p_act, 100);
+        CHECK_S16(f.slm, slm, 100);
+        CHECK_S16(f.slm_sum, slm_sum, 10);
+    }
+    for (int i = 0; i < 1000; i++, seq++) {
+        float v[15];
+        for (int j = 0; j < 15; j++) {
+            v[j] = random_value(j == 9 || j == 10 ? 70000 : 300);
+        }
+        BinBreath b;
+        b.h.type = BIN_TYPE_BREATH;
+        b.h.time = static_cast<uint16_t>(rng());
+        b.p_peak = bin_u16(v[0], 10);
+        b.p_mean = bin_u8(v[1], 1);
+        b.peep = bin_u8(v[2], 1);
+        b.rr = bin_u8(v[3], 1);
+        b.o2_perc = bin_u8(v[4], 1);
+        b.ti = bin_u16(v[5], 100);
+        b.i_e = bin_u16(v[6], 100);
+        b.mvi = bin_u16(v[7], 10);
+        b.mve = bin_u16(v[8], 10);
+        b.vti = bin_u16(v[9], 1);
+        b.vte = bin_u16(v[10], 1);
+        b.compliance = bin_u16(v[11], 10);
+        b.resistance = bin_u16(v[12], 10);
+        b.p_plat = bin_s16(v[13], 10);
+        b.peep_tot = bin_s16(v[14], 10);
+        if (!receive(dec, send_frame(reinterpret_cast<uint8_t *>(&b), sizeof(b), static_cast<uint8_t>(seq)))) {
+            continue;
+        }
+        const breezy::V2Frame &f = dec.frame;
+        CHECK(f.kind == breezy::V2_BREATH && f.seq == (seq & 0xFF) && f.time == b.h.time, "breath header");
+        CHECK_U16(f.p_peak, v[0], 10);
+        CHECK_U8(f.p_mean, v[1], 1);
+        CHECK_U8(f.peep, v[2], 1);
+        CHECK_U8(f.rr, v[3], 1);
+        CHECK_U8(f.o2_perc, v[4], 1);
+        CHECK_U16(f.ti, v[5], 100);
+        CHECK_U16(f.i_e, v[6], 100);
+        CHECK_U16(f.mvi, v[7], 10);
+        CHECK_U16(f.mve, v[8], 10);
+        CHECK_U16(f.vti, v[9], 1);
+        CHECK_U16(f.vte, v[10], 1);
+        CHECK_U16(f.compliance, v[11], 10);
+        CHECK_U16(f.resistance, v[12], 10);
+        CHECK_S16(f.p_plat, v[13], 10);
+        CHECK_S16(f.peep_tot, v[14], 10);
+    }
+
+    // the longest frame Messaging sends: a text frame with a line of BIN_MAX_TEXT bytes
+    for (int fill = 0; fill < 4; fill++, seq++) {
+        uint8_t payload[BIN_MAX_PAYLOAD];
+        BinHeader *h = reinterpret_cast<BinHeader *>(payload);
+        h->type = BIN_TYPE_TEXT;
+        h->time = 0;
+        std::string text;
+        for (unsigned i = sizeof(BinHeader); i < sizeof(payload); i++) {
+            // all zero, no zero, alternating, random
+            uint8_t c = fill == 0 ? 0 : fill == 1 ? 'x' : fill == 2 ? (i & 1) * 'x' : static_cast<uint8_t>(rng());
+            payload[i] = c;
+            text += static_cast<char>(c);
+        }
+        std::vector<uint8_t> frame = send_frame(payload, sizeof(payload), static_cast<uint8_t>(seq));
+        CHECK(frame.size() == BIN_MAX_FRAME, "longest frame is %u bytes, BIN_MAX_FRAME %u",
+              static_cast<unsigned>(frame.size()), static_cast<unsigned>(BIN_MAX_FRAME));
+        if (receive(dec, frame)) {
+            CHECK(dec.frame.kind == breezy::V2_TEXT && dec.frame.text == text, "text frame, fill %d", fill);
+        }
+    }
+
+    // a breath log frame, cut after the last record
+    for (int count = 0; count <= BIN_BREATH_LOG_RECORDS; count++, seq++) {
+        BinBreathLog l;
+        std::memset(&l, 0, sizeof(l));
+        l.h.type = BIN_TYPE_BREATH_LOG;
+        l.number = 65535; // wraps within the frame
+        l.count = static_cast<uint8_t>(count);
+        for (int i = 0; i < count; i++) {
+            l.r[i].end_s = static_cast<uint16_t>(rng());
+            l.r[i].p_peak = i ? bin_s16(25.3f * i, 10) : BIN_NAN_S16;
+            l.r[i].vte = static_cast<uint16_t>(i * 100);
+        }
+        uint8_t len = static_cast<uint8_t>(sizeof(l) - (BIN_BREATH_LOG_RECORDS - count) * sizeof(BreathRecord));
+        if (!receive(dec, send_frame(reinterpret_cast<uint8_t *>(&l), len, static_cast<uint8_t>(seq)))) {
+            continue;
+        }
+        const breezy::V2Frame &f = dec.frame;
+        CHECK(f.kind == breezy::V2_BREATH_LOG && f.breath_count == count, "breath log of %d", count);
+        for (int i = 0; i < count && i < f.breath_count; i++) {
+            CHECK(f.breaths[i].number == ((65535u + i) & 0xFFFF) && f.breaths[i].end_s == l.r[i].end_s &&
+                      (i ? std::fabs(f.breaths[i].p_peak - 2.53 * i * 10) < 0.051 : std::isnan(f.breaths[i].p_peak)) &&
+                      f.breaths[i].vte == i * 100,
+                  "breath log record %d of %d", i, count);
+        }
+    }
+
+    CHECK(dec.frames == seq && dec.crc_errors == 0 && dec.format_errors == 0 && dec.lost_frames == 0,
+          "decoder counters: %lu frames of %u, %lu crc errors, %lu format errors, %lu lost", dec.frames, seq,
+          dec.crc_errors, dec.format_errors, dec.lost_frames);
+}
+
+// LineWriter.cpp
+
+// |v| * 10^prec is within float rounding of a tie (x.5), where put_fixed and
+// printf may round differently
+bool near_tie(float v, int prec)
+{
+    double x = std::fabs(static_cast<double>(v)) * std::pow(10.0, prec);
+    return std::fabs(x - std::floor(x) - 0.5) <= x / (1 << 22) + 1e-9;
+}
+
+// v rounded down or up in the last printed digit, keeping its sign
+void format_neighbour(char *s, size_t size, float v, int width, int prec, bool up)
+{
+    double scale = std::pow(10.0, prec);
+    double m = (std::floor(std::fabs(static_cast<double>(v)) * scale) + (up ? 1 : 0)) / scale;
+    std::snprintf(s, size, "%*.*f", width, prec, std::signbit(v) ? -m : m);
+}
+
+// put_fixed against snprintf("%*.*f"); returns 1 for a tie rounded differently. An exact tie
+// rounds half away from zero, as avr-libc's dtostrf, printf rounds it to even. Within float
+// precision of a tie put_fixed may round up where printf rounds down (docs/serial_protocol.md).
+int check_fixed(float v, int width, int prec)
+{
+    char buf[40], want[64];
+    LineWriter w(buf, sizeof(buf));
+    w.put_fixed(v, static_cast<int8_t>(width), static_cast<uint8_t>(prec));
+    std::snprintf(want, sizeof(want), "%*.*f", width, prec, static_cast<double>(v));
+    if (std::isnan(v) || std::isinf(v)) { // "NAN" and "INF" as dtostrf, printf has lower case
+        for (char *p = want; *p; p++) {
+            *p = static_cast<char>(std::toupper(*p));
+        }
+    }
+    if (std::strcmp(buf, want) == 0) {
+        return 0;
+    }
+    if (near_tie(v, prec)) {
+        char down[64], up[64];
+        format_neighbour(down, sizeof(down), v, width, prec, false);
+        format_neighbour(up, sizeof(up), v, width, prec, true);
+        double x = std::fabs(static_cast<double>(v)) * std::pow(10.0, prec);
+        bool exact = x - std::floor(x) == 0.5;
+        CHECK(std::strcmp(buf, up) == 0 || (!exact && std::strcmp(buf, down) == 0),
+              "put_fixed(%.9g, %d, %d) = \"%s\" at a tie, expected \"%s\"", static_cast<double>(v), width, prec,
+              buf, up);
+        return 1;
+    }
+    CHECK(false, "put_fixed(%.9g, %d, %d) = \"%s\", snprintf \"%s\"", static_cast<double>(v), width, prec, buf, want);
+    return 0;
+}
+
+void test_fixed()
+{
+    long checked = 0, ties = 0;
+
+    // the decimal grid one digit finer than printed: every tie a field can meet
+    for (int prec = 0; prec <= 4; prec++) {
+        double step = std::pow(10.0, -(prec + 1));
+        for (long k = -20000; k <= 20000; k++) {
+            ties += check_fixed(static_cast<float>(k * step), 5, prec);
+            checked++;
+        }
+    }
+    // random values over the field ranges, and past the 1e6 where dtostrf takes over
+    for (int i = 0; i < 500000; i++) {
+        int prec = static_cast<int>(rng() % 5), width = static_cast<int>(rng() % 8);
+        float mag = std::pow(10.0f, static_cast<float>(rng() % 9) - 2);
+        float v = std::uniform_real_distribution<float>(-mag, mag)(rng);
+        ties += check_fixed(v, width, prec);
+        checked++;
+    }
+    const float special[] = { 0.0f, -0.0f, -0.001f, 0.5f, 1.5f, 2.5f, 99.995f, 9999.5f, 65535.5f, 999999.9f, 1e6f,
+                              -1e7f, NAN, INFINITY, -INFINITY };
+    for (size_t i = 0; i < sizeof(special) / sizeof(special[0]); i++) {
+        for (int prec = 0; prec <= 3; prec++) {
+            ties += check_fixed(special[i], 5, prec);
+            checked++;
+        }
+    }
+    std::printf("fixed: %ld values, %ld at or within float precision of a tie rounded away from zero, printf not\n",
+                checked, ties);
+}
+
+// Filters.h
+
+typedef Biquad<FILTER_P_ACT_LOWPASS> PressureLowpass;
+typedef FilterChain<Median<FILTER_P_ACT_MEDIAN>, Biquad<FILTER_P_ACT_LOWPASS> > PressureChain;
+
+// |H| of FILTER_P_ACT_LOWPASS at f, from the Q14 coefficients
+double lowpass_gain(double f)
+{
+    const double c[5] = { FILTER_P_ACT_LOWPASS };
+    const double pi = 3.14159265358979;
+    double w = 2 * pi * f / SAMPLER_RATE_HZ;
+    double nr = c[0] + c[1] * std::cos(w) + c[2] * std::cos(2 * w);
+    double ni = -c[1] * std::sin(w) - c[2] * std::sin(2 * w);
+    double dr = 16384 + c[3] * std::cos(w) + c[4] * std::cos(2 * w);
+    double di = -c[3] * std::sin(w) - c[4] * std::sin(2 * w);
+    return std::sqrt((nr * nr + ni * ni) / (dr * dr + di * di));
+}
+
+// amplitude of the integer filter's response to a sine around mid scale, once settled
+double measured_gain(double f)
+{
+    const double pi = 3.14159265358979;
+    PressureLowpass lp;
+    double s = 0, c = 0;
+    int n = 0;
+    for (int i = 0; i < 4 * SAMPLER_RATE_HZ; i++) {
+        double phase = 2 * pi * f * i / SAMPLER_RATE_HZ;
+        int16_t y = lp.push(static_cast<int16_t>(std::lround(2000 + 1000 * std::sin(phase))));
+        if (i >= SAMPLER_RATE_HZ) { // settled
+            s += (y - 2000) * std::sin(phase);
+            c += (y - 2000) * std::cos(phase);
+            n++;
+        }
+    }
+    return 2 * std::sqrt(s * s + c * c) / n / 1000;
+}
+
+void test_filters()
+{
+    const int16_t full = ADC_MAXVAL << SAMPLER_P_ACT_BITS;
+
+    // Median: spikes shorter than N / 2 + 1 samples are dropped, a step is delayed by N / 2
+    Median<3> m3;
+    for (int i = 0; i < 10; i++) {
+        int16_t y = m3.push(i == 5 ? 4000 : 100);
+        CHECK(y == 100, "Median<3> passed a 1 sample spike at %d: %d", i, y);
+    }
+    Median<5> m5;
+    for (int i = 0; i < 10; i++) {
+        int16_t y = m5.push(i == 5 || i == 6 ? -4000 : 100);
+        CHECK(y == 100, "Median<5> passed a 2 sample spike at %d: %d", i, y);
+    }
+    m3.reset();
+    int16_t step[4];
+    for (int i = 0; i < 4; i++) {
+        step[i] = m3.push(i < 2 ? 0 : 500);
+    }
+    CHECK(step[0] == 0 && step[1] == 0 && step[2] == 0 && step[3] == 500,
+          "Median<3> step: %d %d %d %d, expected a delay of 1 sample", step[0], step[1], step[2], step[3]);
+
+    // Biquad: primed from the first sample, no ramp from 0
+    PressureChain chain;
+    for (int i = 0; i < 100; i++) {
+        int16_t y = chain.push(1234);
+        CHECK(y == 1234, "primed chain at sample %d: %d", i, y);
+    }
+
+    // frequency response: the integer filter follows the Q14 coefficients, -3 dB at 50 Hz
+    CHECK(std::fabs(lowpass_gain(50) - std::sqrt(0.5)) < 0.01, "gain at 50 Hz %.4f, not -3 dB", lowpass_gain(50));
+    const double freqs[] = { 1, 5, 10, 25, 50, 75, 100, 150, 200 };
+    for (size_t i = 0; i < sizeof(freqs) / sizeof(freqs[0]); i++) {
+        double want = lowpass_gain(freqs[i]), got = measured_gain(freqs[i]);
+        CHECK(std::fabs(got - want) < 0.005, "gain at %g Hz: %.4f, the coefficients give %.4f", freqs[i], got,
+              want);
+    }
+
+    // step response over the full ADC range: settles exactly (error feedback), overshoots at
+    // both ends, which Statistics::filter clamps away
+    PressureLowpass lp;
+    int16_t hi = 0, lo = 0, y = 0;
+    lp.push(0);
+    for (int i = 0; i < 100; i++) {
+        y = lp.push(full);
+        if (y > hi) hi = y;
+    }
+    CHECK(y == full, "step up settled at %d, not %d", y, full);
+    CHECK(hi > full && hi < full * 1.06, "step up overshoot %d", hi - full);
+    for (int i = 0; i < 100; i++) {
+        y = lp.push(0);
+        if (y < lo) lo = y;
+    }
+    CHECK(y == 0, "step down settled at %d", y);
+    CHECK(lo < 0 && lo > -full * 0.06, "step down undershoot %d", lo);
+
+    // the chain on the host, for scale; Statistics reports the AVR cycles in diag
+    const long samples = 20000000;
+    chain.reset();
+    long long sum = 0;
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    for (long i = 0; i < samples; i++) {
+        sum += chain.push(static_cast<int16_t>((i * 37) & 0xFFF));
+    }
+    double dt = seconds_since(t0);
+    std::printf("filters: pressure chain %.1f ns/sample on the host (sum %lld)\n", dt / samples * 1e9, sum);
+}
+
+// LungMechanics.h
+
+// the first samples of a 1 s inspiration of P = V / C + R * Q + PEEP, fed like
+// Statistics::add_sample at SAMPLER_RATE_HZ; flow in l/min from the shape, p_noise cmH2O of
+// gaussian noise
+uint8_t fit_breath(double c, double r, int shape, double p_noise, int samples, std::mt19937 &gen, float *fit_c,
+                   float *fit_r)
+{
+    const double peep = 5, dt = 1.0 / SAMPLER_RATE_HZ;
+    const int n = SAMPLER_RATE_HZ;
+    std::normal_distribution<double> noise(0, p_noise);
+    LungMechanics m;
+    m.reset();
+    double v = 0, slm_last = 0;
+    for (int i = 0; i < samples; i++) {
+        double x = static_cast<double>(i) / n, slm;
+        switch (shape) {
+        case 0: slm = 60 - 50 * x; break; // decelerating ramp, pressure control
+        case 1: slm = 60 * std::sin(3.14159265358979 * x) + 1; break; // half sine
+        default: slm = 30; break; // square, volume and flow are not independent
+        }
+        if (i) {
+            v += (slm + slm_last) / 2 / 60 * dt * 1000; // ml, trapezoids as Statistics::add_sample
+        }
+        slm_last = slm;
+        double q = slm / 60;
+        double p = v / c + r * q + peep + (p_noise > 0 ? noise(gen) : 0);
+        m.add(static_cast<float>(p), static_cast<float>(v), static_cast<float>(q));
+    }
+    return m.estimate(fit_c, fit_r);
+}
+
+void test_mechanics()
+{
+    const double cs[] = { 10, 30, 50, 100 }; // ml/cmH2O, stiff to normal lungs
+    const double rs[] = { 2, 5, 20, 50 }; // cmH2O/l/s
+    const int n = SAMPLER_RATE_HZ, breaths = 20;
+    std::mt19937 gen(1); // the noise does not depend on the tests run before
+    float c, r;
+    for (size_t i = 0; i < sizeof(cs) / sizeof(cs[0]); i++) {
+        for (size_t j = 0; j < sizeof(rs) / sizeof(rs[0]); j++) {
+            for (int shape = 0; shape < 2; shape++) {
+                uint8_t res = fit_breath(cs[i], rs[j], shape, 0, n, gen, &c, &r);
+                CHECK(res == 0 && std::fabs(c - cs[i]) < 0.001 * cs[i] && std::fabs(r - rs[j]) < 0.02 + 0.001 * rs[j],
+                      "shape %d, C %g R %g: fitted %d, C %g R %g", shape, cs[i], rs[j], res, c, r);
+
+                // 0.2 cmH2O of noise, about the resolution of the pressure sensor: the estimate
+                // converges over the inspiration, the mean of a few breaths is not biased
+                double sum_c = 0, sum_r = 0, err_half = 0, err_end = 0;
+                for (int b = 0; b < breaths; b++) {
+                    res = fit_breath(cs[i], rs[j], shape, 0.2, n / 2, gen, &c, &r);
+                    err_half += res ? 1 : std::fabs(c - cs[i]) / cs[i]; // a low R can come out below 0 early
+                    res = fit_breath(cs[i], rs[j], shape, 0.2, n, gen, &c, &r);
+                    CHECK(res == 0, "shape %d, C %g R %g with noise: no fit", shape, cs[i], rs[j]);
+                    err_end += std::fabs(c - cs[i]) / cs[i];
+                    sum_c += c;
+                    sum_r += r;
+                }
+                CHECK(err_end < err_half, "shape %d, C %g R %g with noise: C error %.3f after half, %.3f at the end",
+                      shape, cs[i], rs[j], err_half / breaths, err_end / breaths);
+                CHECK(std::fabs(sum_c / breaths - cs[i]) < 0.05 * cs[i]
+                          && std::fabs(sum_r / breaths - rs[j]) < 0.05 * rs[j] + 0.5,
+                      "shape %d, C %g R %g with noise: mean C %g R %g", shape, cs[i], rs[j], sum_c / breaths,
+                      sum_r / breaths);
+            }
+        }
+    }
+
+    // no estimate: constant flow, too few samples, no lung
+    CHECK(fit_breath(50, 5, 2, 0, n, gen, &c, &r) == 1 && std::isnan(c) && std::isnan(r),
+          "fitted a constant flow: C %g R %g", c, r);
+    CHECK(fit_breath(50, 5, 0, 0, MECHANICS_MIN_SAMPLES - 1, gen, &c, &r) == 1 && std::isnan(c), "fitted %d samples",
+          MECHANICS_MIN_SAMPLES - 1);
+    LungMechanics m;
+    m.reset();
+    for (int i = 0; i < n; i++) {
+        m.add(5, static_cast<float>(0.5 * i), static_cast<float>(1 - 0.001 * i)); // pressure stays at PEEP
+    }
+    CHECK(m.estimate(&c, &r) == 1 && std::isnan(c), "fitted a flat pressure: C %g R %g", c, r);
+
+    // the cost of a sample on the host; on the AVR see the statistics section of profile,1
+    const long samples = 10000000;
+    m.reset();
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    for (long i = 0; i < samples; i++) {
+        if (i % n == 0) {
+            m.reset();
+        }
+        float x = static_cast<float>(i % n) / n;
+        m.add(10 + 10 * x, 500 * x, 1 - 0.8f * x);
+    }
+    double dt = seconds_since(t0);
+    std::printf("mechanics: %.1f ns/sample on the host\n", dt / samples * 1e9);
+}
+
+// WindowedMetrics.h: WindowPercentile against the exact percentile of each window
+
+// nearest rank percentile of the samples
+double exact_percentile(std::vector<double> v, int percent)
+{
+    std::sort(v.begin(), v.end());
+    return v[static_cast<size_t>(percent / 100.0 * (v.size() - 1) + 0.5)];
+}
+
+// windows of a distribution through WindowPercentile<float, N, PERCENT>, the largest error
+// relative to the spread of the window (max - min)
+template <uint16_t N, uint8_t PERCENT>
+double percentile_error(const char *name, double (*sample)(int i), int windows)
+{
+    WindowPercentile<float, N, PERCENT> w;
+    double worst = 0;
+    std::vector<double> window;
+    for (int k = 0; k < windows; k++) {
+        window.clear();
+        for (int i = 0; i < N; i++) {
+            double x = sample(k * N + i);
+            window.push_back(static_cast<float>(x));
+            w.push(static_cast<float>(x));
+        }
+        CHECK(w.full(), "%s: window %d of %u not complete", name, k, N);
+        double spread = *std::max_element(window.begin(), window.end()) - *std::min_element(window.begin(), window.end());
+        worst = std::max(worst, std::fabs(w.value() - exact_percentile(window, PERCENT)) / spread);
+    }
+    return worst;
+}
+
+std::mt19937 percentile_rng; // seeded by test_percentile, independent of the tests run before
+
+double uniform_sample(int) { return std::uniform_real_distribution<double>(0, 100)(percentile_rng); }
+double normal_sample(int) { return std::normal_distribution<double>(20, 3)(percentile_rng); }
+double skewed_sample(int) { return std::exponential_distribution<double>(0.5)(percentile_rng); }
+double ramp_sample(int i) { return i % 1000; } // sorted, the hard case for the markers
+double breath_sample(int i) // pressure of a breath, 5 cmH2O PEEP and 25 peak, with noise
+{
+    int t = i % 1500;
+    return (t < 500 ? 25 - 20 * std::exp(-t / 50.0) : 5 + 20 * std::exp(-(t - 500) / 80.0)) +
+           std::normal_distribution<double>(0, 0.3)(percentile_rng);
+}
+
+void test_percentile()
+{
+    percentile_rng.seed(1);
+    // the worst window of each case; over 30 seeds the tails reach 0.09 (few samples past the
+    // outer markers), the rest stays under 0.025
+    struct Case {
+        const char *name;
+        double error;
+        double max_error;
+    };
+    const Case cases[] = {
+        { "uniform p50", percentile_error<1000, 50>("uniform p50", uniform_sample, 20), 0.02 },
+        { "uniform p95", percentile_error<1000, 95>("uniform p95", uniform_sample, 20), 0.02 },
+        { "normal p50", percentile_error<500, 50>("normal p50", normal_sample, 20), 0.02 },
+        { "normal p5", percentile_error<500, 5>("normal p5", normal_sample, 20), 0.12 },
+        { "skewed p90", percentile_error<1000, 90>("skewed p90", skewed_sample, 20), 0.12 },
+        { "ramp p50", percentile_error<1000, 50>("ramp p50", ramp_sample, 5), 0.02 },
+        { "breath p10", percentile_error<1500, 10>("breath p10", breath_sample, 10), 0.04 },
+        { "breath p90", percentile_error<1500, 90>("breath p90", breath_sample, 10), 0.04 },
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        CHECK(cases[i].error <= cases[i].max_error, "%s: %.4f of the spread off, max %.2f", cases[i].name,
+              cases[i].error, cases[i].max_error);
+        std::printf("percentile: %-11s %.4f of the spread off\n", cases[i].name, cases[i].error);
+    }
+
+    // fewer than 5 samples: the nearest rank of those; integer samples (ADC counts)
+    WindowPercentile<uint16_t, 100, 50> m;
+    CHECK(m.value() == 0 && !m.full(), "no samples: %u", m.value());
+    const uint16_t first[] = { 900, 100, 500 };
+    for (int i = 0; i < 3; i++) {
+        m.push(first[i]);
+    }
+    CHECK(m.value() == 500, "median of 3 samples: %u", m.value());
+
+    // a window only holds its own samples: a level change shows after the next full window
+    WindowPercentile<uint16_t, 100, 50> level;
+    for (int i = 0; i < 100; i++) {
+        level.push(static_cast<uint16_t>(1000 + i % 7));
+    }
+    uint16_t before = level.value();
+    for (int i = 0; i < 99; i++) {
+        level.push(static_cast<uint16_t>(3000 + i % 7));
+    }
+    CHECK(level.value() == before, "value changed before the window was complete: %u, %u", level.value(), before);
+    level.push(3000);
+    CHECK(level.value() >= 3000 && level.value() <= 3006, "level change: %u", level.value());
+}
+
+struct Test {
+    const char *name;
+    void (*run)();
+};
+
+const Test TESTS[] = {
+    { "adc", test_adc },
+    { "binary", test_binary },
+    { "crc16", test_crc16 },
+    { "filters", test_filters },
+    { "fixed", test_fixed },
+    { "mechanics", test_mechanics },
+    { "percentile", test_percentile },
+};
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    bool all_ok = true;
+    int run = 0;
+    for (size_t t = 0; t < sizeof(TESTS) / sizeof(TESTS[0]); t++) {
+        bool wanted = argc < 2;
+        for (int i = 1; i < argc; i++) {
+            wanted = wanted || std::strcmp(argv[i], TESTS[t].name) == 0;
+        }
+        if (!wanted) {
+            continue;
+        }
+        ok = true;
+        TESTS[t].run();
+        std::printf("%s: %s\n", TESTS[t].name, ok ? "ok" : "FAILED");
+        all_ok = all_ok && ok;
+        run++;
+    }
+    if (run != argc - 1 && argc > 1) {
+        std::fprintf(stderr, "unknown test name\n");
+        return 1;
+    }
+    return all_ok ? 0 : 1;
+}
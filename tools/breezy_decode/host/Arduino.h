@@ -0,0 +1,27 @@
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+// Just enough of the Arduino / avr-libc API to build the firmware modules
+// without hardware access on the host, for firmware_test.cpp.
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PROGMEM
+#define pgm_read_byte(p) (*(const uint8_t *)(p))
+#define pgm_read_word(p) (*(const uint16_t *)(p))
+#define pgm_read_dword(p) (*(const uint32_t *)(p))
+
+#define F_CPU 16000000UL
+
+// avr-libc's dtostrf, through the C library
+static inline char *dtostrf(double v, signed char width, unsigned char prec, char *s)
+{
+    sprintf(s, "%*.*f", width, prec, v);
+    return s;
+}
+
+#endif // HOST_ARDUINO_H
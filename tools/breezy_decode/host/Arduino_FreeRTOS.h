@@ -0,0 +1,6 @@
+#ifndef HOST_ARDUINO_FREERTOS_H
+#define HOST_ARDUINO_FREERTOS_H
+
+// Configuration.h includes the FreeRTOS headers, the modules under test use none of it
+
+#endif // HOST_ARDUINO_FREERTOS_H
@@ -0,0 +1,6 @@
+#ifndef HOST_SEMPHR_H
+#define HOST_SEMPHR_H
+
+typedef void *SemaphoreHandle_t;
+
+#endif // HOST_SEMPHR_H